@@ -0,0 +1,27 @@
+/** Heap allocation counting for pegbench, usable in every build
+ * @file
+ *
+ * pegbench force-includes this header into every browser source file it compiles
+ * (/FI in pegbench.vcxproj), so their malloc, calloc and realloc calls are counted.
+ * Allocations made inside the Acorn VM library itself are not seen.
+ *
+ * This source file is part of the Pegasus3d browser.
+ * See Copyright Notice in pegasus3d.h
+*/
+
+#ifndef benchalloc_h
+#define benchalloc_h 1
+
+#include <stdlib.h>
+
+extern long bench_allocs;	//!< Heap allocations and reallocations counted so far
+
+void *bench_malloc(size_t size);
+void *bench_calloc(size_t count, size_t size);
+void *bench_realloc(void *block, size_t size);
+
+#define malloc(size) bench_malloc(size)
+#define calloc(count, size) bench_calloc(count, size)
+#define realloc(block, size) bench_realloc(block, size)
+
+#endif
@@ -0,0 +1,390 @@
+/** Pegasus3d microbenchmarks - times hot C-level code outside the browser
+ * @file
+ *
+ * Runs each benchmark long enough to time reliably, keeping the fastest of several runs,
+ * and reports nanoseconds per operation, throughput and heap allocations per operation.
+ * Where a benchmark needs Acorn values (number arrays, shapes), it uses a headless
+ * Acorn VM loaded with just the data types it needs: no window or OpenGL context is created.
+ *
+ * Array parsing is timed on the number lists found in stable example resources
+ * (horse.acn and flamingo.acn in examples/horseworld), so runs are comparable over time.
+ *
+ * Usage: pegbench [--json] [dataset directory]
+ *
+ * This source file is part of the Pegasus3d browser.
+ * See Copyright Notice in pegasus3d.h
+*/
+
+#include "../src/pegasus3d.h"
+#include "../src/xyzmath.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "benchalloc.h"
+
+#define BENCH_MINSECONDS 0.2	//!< Shortest time to spend on one timed run
+#define BENCH_RUNS 5			//!< Number of timed runs, keeping the fastest
+
+// Data type initializers, from the browser's sources
+void pegsym_init(Value th);
+void rect_init(Value th);
+void color_init(Value th);
+void xyz_init(Value th);
+void quat_init(Value th);
+void mat4_init(Value th);
+void array_init(Value th);
+void integers_init(Value th);
+void placement_init(Value th);
+void shape_init(Value th);
+
+/** A benchmark's operation, run n times over its context */
+typedef void (*BenchFn)(void *ctx, long n);
+
+/** Result of one benchmark */
+struct BenchResult {
+	const char *name;	//!< Benchmark's name
+	long ops;			//!< Operations in the fastest timed run
+	double nsPerOp;		//!< Nanoseconds per operation in the fastest run
+	double bytesPerOp;	//!< Input bytes processed per operation (0 if not meaningful)
+	double allocsPerOp;	//!< Heap allocations per operation, by the browser code timed
+};
+
+#define BENCH_MAXRESULTS 64
+BenchResult bench_results[BENCH_MAXRESULTS];
+int bench_nresults;
+bool bench_json;
+
+// The benchmark's own buffers are not counted: only the code it times
+#undef malloc
+#undef calloc
+#undef realloc
+
+long bench_allocs;
+
+/** Count a heap allocation */
+void *bench_malloc(size_t size) {
+	bench_allocs++;
+	return malloc(size);
+}
+
+/** Count a heap allocation */
+void *bench_calloc(size_t count, size_t size) {
+	bench_allocs++;
+	return calloc(count, size);
+}
+
+/** Count a heap reallocation */
+void *bench_realloc(void *block, size_t size) {
+	bench_allocs++;
+	return realloc(block, size);
+}
+
+/** Seconds since an arbitrary starting point */
+double bench_now(void) {
+	return (double) SDL_GetPerformanceCounter() / (double) SDL_GetPerformanceFrequency();
+}
+
+/** Time an operation, growing the number of iterations until a run lasts long enough,
+	then keep the fastest of several runs */
+void bench_run(const char *name, BenchFn fn, void *ctx, double bytesPerOp) {
+	// Find how many iterations make for a long enough run
+	long n = 1;
+	for (;;) {
+		double start = bench_now();
+		fn(ctx, n);
+		double secs = bench_now() - start;
+		if (secs >= BENCH_MINSECONDS || n >= (1L<<30))
+			break;
+		n = secs < BENCH_MINSECONDS/100.0? n*100 : (long) (n * 1.2 * BENCH_MINSECONDS / secs);
+	}
+
+	// Keep the fastest of several runs
+	double best = 0.0;
+	for (int run=0; run<BENCH_RUNS; run++) {
+		double start = bench_now();
+		fn(ctx, n);
+		double secs = bench_now() - start;
+		if (run==0 || secs < best)
+			best = secs;
+	}
+
+	// Count allocations over one more run
+	long allocs = bench_allocs;
+	fn(ctx, n);
+	double allocsPerOp = (double) (bench_allocs - allocs) / (double) n;
+
+	if (bench_nresults < BENCH_MAXRESULTS) {
+		BenchResult *result = &bench_results[bench_nresults++];
+		result->name = name;
+		result->ops = n;
+		result->nsPerOp = best * 1.0e9 / (double) n;
+		result->bytesPerOp = bytesPerOp;
+		result->allocsPerOp = allocsPerOp;
+	}
+	if (!bench_json)
+		fprintf(stderr, "  %s\n", name);
+}
+
+/** Print all results, as a table or as JSON for comparing runs */
+void bench_report(const char *datadir) {
+	if (bench_json) {
+		printf("{\n  \"version\": \"%s\",\n  \"dataset\": \"%s\",\n  \"results\": [\n", PEG_RELEASE, datadir);
+		for (int i=0; i<bench_nresults; i++) {
+			BenchResult *r = &bench_results[i];
+			printf("    {\"name\": \"%s\", \"ops\": %ld, \"ns_per_op\": %.3f, \"ops_per_sec\": %.1f",
+				r->name, r->ops, r->nsPerOp, 1.0e9/r->nsPerOp);
+			if (r->bytesPerOp > 0.0)
+				printf(", \"mb_per_sec\": %.3f", r->bytesPerOp * 1.0e3 / r->nsPerOp);
+			printf(", \"allocs_per_op\": %.3f", r->allocsPerOp);
+			printf("}%s\n", i<bench_nresults-1? "," : "");
+		}
+		printf("  ]\n}\n");
+		return;
+	}
+	printf("%-32s %14s %14s %12s %12s\n", "benchmark", "ns/op", "ops/s", "MB/s", "allocs/op");
+	for (int i=0; i<bench_nresults; i++) {
+		BenchResult *r = &bench_results[i];
+		printf("%-32s %14.2f %14.0f", r->name, r->nsPerOp, 1.0e9/r->nsPerOp);
+		if (r->bytesPerOp > 0.0)
+			printf(" %12.2f", r->bytesPerOp * 1.0e3 / r->nsPerOp);
+		else
+			printf(" %12s", "-");
+		printf(" %12.2f\n", r->allocsPerOp);
+	}
+}
+
+/* ********
+   xyzmath
+   ******** */
+
+#define BENCH_NMATS 256		//!< Number of matrices and points cycled through
+
+/** Matrices and points for xyzmath benchmarks */
+struct MathCtx {
+	Mat4 mats[BENCH_NMATS];
+	Mat4 results[BENCH_NMATS];
+	Xyz xyzs[BENCH_NMATS];
+	Xyz newxyzs[BENCH_NMATS];
+	Quat quats[BENCH_NMATS];
+};
+
+/** Fill matrices with well-conditioned placements, and points with small coordinates */
+void bench_mathinit(MathCtx *ctx) {
+	srand(3);
+	for (int i=0; i<BENCH_NMATS; i++) {
+		Xyz origin = {(GLfloat)(rand()%200-100), (GLfloat)(rand()%200-100), (GLfloat)(rand()%200-100)};
+		Xyz scale = {0.5f + (rand()%100)/100.0f, 0.5f + (rand()%100)/100.0f, 0.5f + (rand()%100)/100.0f};
+		Quat *q = &ctx->quats[i];
+		q->x = (rand()%200-100)/100.0f; q->y = (rand()%200-100)/100.0f;
+		q->z = (rand()%200-100)/100.0f; q->w = (rand()%200-100)/100.0f;
+		GLfloat len = sqrt(q->x*q->x + q->y*q->y + q->z*q->z + q->w*q->w);
+		q->x /= len; q->y /= len; q->z /= len; q->w /= len;
+		mat4Place(&ctx->mats[i], &origin, q, &scale);
+		ctx->xyzs[i] = origin;
+	}
+}
+
+void bench_mat4mult(void *vctx, long n) {
+	MathCtx *ctx = (MathCtx*) vctx;
+	for (long i=0; i<n; i++)
+		mat4Mult(&ctx->results[i%BENCH_NMATS], &ctx->mats[i%BENCH_NMATS], &ctx->mats[(i+1)%BENCH_NMATS]);
+}
+
+void bench_mat4multvec(void *vctx, long n) {
+	MathCtx *ctx = (MathCtx*) vctx;
+	for (long i=0; i<n; i++)
+		mat4MultVec(&ctx->newxyzs[i%BENCH_NMATS], &ctx->mats[i%BENCH_NMATS], &ctx->xyzs[i%BENCH_NMATS]);
+}
+
+void bench_mat4inverse(void *vctx, long n) {
+	MathCtx *ctx = (MathCtx*) vctx;
+	for (long i=0; i<n; i++)
+		mat4Inverse(&ctx->results[i%BENCH_NMATS], &ctx->mats[i%BENCH_NMATS]);
+}
+
+void bench_mat4place(void *vctx, long n) {
+	MathCtx *ctx = (MathCtx*) vctx;
+	for (long i=0; i<n; i++)
+		mat4Place(&ctx->results[i%BENCH_NMATS], &ctx->xyzs[i%BENCH_NMATS], &ctx->quats[i%BENCH_NMATS], &ctx->xyzs[(i+1)%BENCH_NMATS]);
+}
+
+/* ********
+   Array parsing and mesh generation, through the headless VM
+   ******** */
+
+/** A VM call: method symbol sent to a global type, with text or numeric parameters */
+struct VmCallCtx {
+	Value th;				//!< VM thread
+	const char *type;		//!< Global type receiving the method
+	const char *method;		//!< Method's name
+	const char *text;		//!< Text parameter (NULL if none)
+	int nparms;				//!< Number of numeric parameters (if no text)
+	Value parms[2];			//!< Numeric parameters
+};
+
+void bench_vmcall(void *vctx, long n) {
+	VmCallCtx *ctx = (VmCallCtx*) vctx;
+	Value th = ctx->th;
+	for (long i=0; i<n; i++) {
+		pushSym(th, ctx->method);
+		pushGloVar(th, ctx->type);
+		if (ctx->text)
+			pushString(th, aNull, ctx->text);
+		else
+			for (int p=0; p<ctx->nparms; p++)
+				pushValue(th, ctx->parms[p]);
+		getCall(th, 1 + (ctx->text? 1 : ctx->nparms), 1);
+		popValue(th);
+	}
+}
+
+/** Read a whole file into memory, or return NULL */
+char *bench_readfile(const char *dir, const char *name) {
+	char path[1024];
+	if (strlen(dir) + strlen(name) + 2 > sizeof(path))
+		return NULL;
+	sprintf(path, "%s/%s", dir, name);
+	FILE *file = fopen(path, "rb");
+	if (file == NULL)
+		return NULL;
+	fseek(file, 0, SEEK_END);
+	long size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	char *text = (char*) malloc(size+1);
+	size = (long) fread(text, 1, size, file);
+	text[size] = '\0';
+	fclose(file);
+	return text;
+}
+
+/** Collect, comma-separated, the text of every '+<typename>"...."' number list in a resource */
+char *bench_numberlists(const char *source, const char *typname) {
+	char marker[64];
+	if (strlen(typname) + 3 > sizeof(marker))
+		return NULL;
+	sprintf(marker, "+%s\"", typname);
+	size_t len = 0;
+	char *lists = (char*) malloc(strlen(source)+1);
+	const char *scanp = source;
+	while ((scanp = strstr(scanp, marker)) != NULL) {
+		scanp += strlen(marker);
+		const char *endp = strchr(scanp, '"');
+		if (endp == NULL)
+			break;
+		if (len > 0)
+			lists[len++] = ',';
+		memcpy(lists+len, scanp, endp-scanp);
+		len += endp-scanp;
+		scanp = endp+1;
+	}
+	lists[len] = '\0';
+	if (len == 0) {
+		free(lists);
+		return NULL;
+	}
+	return lists;
+}
+
+/** Benchmark parsing every number list of one type in a resource */
+void bench_parse(Value th, const char *datadir, const char *file, const char *typname, const char *name) {
+	char *source = bench_readfile(datadir, file);
+	if (source == NULL) {
+		fprintf(stderr, "pegbench: cannot read %s/%s, skipping %s\n", datadir, file, name);
+		return;
+	}
+	char *lists = bench_numberlists(source, typname);
+	free(source);
+	if (lists == NULL)
+		return;
+	VmCallCtx ctx = {th, typname, "New", lists, 0, {aNull, aNull}};
+	bench_run(name, bench_vmcall, &ctx, (double) strlen(lists));
+	free(lists);
+}
+
+/** Benchmark a Shape generator method */
+void bench_generator(Value th, const char *method, int nparms, Value parm1, Value parm2, const char *name) {
+	VmCallCtx ctx = {th, "Shape", method, NULL, nparms, {parm1, parm2}};
+	bench_run(name, bench_vmcall, &ctx, 0.0);
+}
+
+/* ********
+   Checks
+   ******** */
+
+/** Check that appending a 32-bit value to 16-bit Integers holding -1 keeps -1 the largest value.
+	Return the number of failed checks. */
+int bench_checks(Value th) {
+	int failed = 0;
+	pushSym(th, "New");
+	pushGloVar(th, "Integers");
+	pushString(th, aNull, "0,1,-1");
+	getCall(th, 2, 1);
+	Value arrv = getFromTop(th, 0);
+	pushSym(th, "<<");
+	pushValue(th, arrv);
+	pushValue(th, anInt(70000));
+	getCall(th, 2, 0);
+	ArrayHeader *hdr = toArrayHeader(arrv);
+	GLuint *ints = (GLuint*) toCData(arrv);
+	if (hdr->mbrType != Uint32Nbr || getSize(arrv) != 4*sizeof(GLuint)
+		|| ints[1] != 1 || ints[2] != 0xFFFFFFFFu || ints[3] != 70000) {
+		fprintf(stderr, "pegbench: Integers << did not widen -1 to 0xFFFFFFFF\n");
+		failed++;
+	}
+	popValue(th);
+	return failed;
+}
+
+int main(int argc, char *argv[]) {
+	const char *datadir = "examples/horseworld";
+	for (int i=1; i<argc; i++) {
+		if (strcmp(argv[i], "--json")==0)
+			bench_json = true;
+		else
+			datadir = argv[i];
+	}
+
+	// Start a headless Acorn VM with just the data types the benchmarks use
+	Value th = newVM();
+	pegsym_init(th);
+	rect_init(th);
+	color_init(th);
+	xyz_init(th);
+	quat_init(th);
+	mat4_init(th);
+	array_init(th);
+	integers_init(th);
+	placement_init(th);
+	shape_init(th);
+	int failed = bench_checks(th);
+
+	// Matrix and vector math
+	MathCtx *mathctx = (MathCtx*) malloc(sizeof(MathCtx));
+	bench_mathinit(mathctx);
+	bench_run("xyzmath/mat4Mult", bench_mat4mult, mathctx, 0.0);
+	bench_run("xyzmath/mat4MultVec", bench_mat4multvec, mathctx, 0.0);
+	bench_run("xyzmath/mat4Inverse", bench_mat4inverse, mathctx, 0.0);
+	bench_run("xyzmath/mat4Place", bench_mat4place, mathctx, 0.0);
+	free(mathctx);
+
+	// Parsing number arrays from resource text
+	bench_parse(th, datadir, "horse.acn", "Xyzs", "parse/horse Xyzs");
+	bench_parse(th, datadir, "horse.acn", "Uvs", "parse/horse Uvs");
+	bench_parse(th, datadir, "horse.acn", "Integers", "parse/horse Integers");
+	bench_parse(th, datadir, "flamingo.acn", "Xyzs", "parse/flamingo Xyzs");
+	bench_parse(th, datadir, "flamingo.acn", "Integers", "parse/flamingo Integers");
+
+	// Generating meshes
+	bench_generator(th, "NewSphere", 2, aFloat(1.0f), anInt(15), "shape/NewSphere 15");
+	bench_generator(th, "NewSphere", 2, aFloat(1.0f), anInt(100), "shape/NewSphere 100");
+	bench_generator(th, "NewSphere", 2, aFloat(1.0f), anInt(400), "shape/NewSphere 400");
+	bench_generator(th, "NewPlane", 1, anInt(100), aNull, "shape/NewPlane 100");
+	bench_generator(th, "NewPlane", 1, anInt(400), aNull, "shape/NewPlane 400");
+	bench_generator(th, "NewCube", 1, aFloat(1.0f), aNull, "shape/NewCube");
+
+	bench_report(datadir);
+	vmClose(th);
+	return failed? 1 : 0;
+}
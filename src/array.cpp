@@ -6,61 +6,220 @@
 */
 
 #include "pegasus3d.h"
+#include <float.h>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
-/** Create a new Buffer value, with number of Xyz structures. */
-int xyzs_new(Value th) {
+/** Last generation stamp handed out to any number array */
+unsigned int array_generation = 0;
+
+/** Give a newly created array a fresh generation stamp, with nothing yet dirty */
+void array_newgen(ArrayHeader *hdr) {
+	hdr->gen = hdr->cleanGen = ++array_generation;
+	hdr->dirtyLo = hdr->dirtyHi = 0;
+}
+
+/** Mark bytes lo up to hi of an array's contents as changed,
+	widening its dirty range and renewing its generation stamp */
+void array_touch(ArrayHeader *hdr, AuintIdx lo, AuintIdx hi) {
+	if (hdr->dirtyLo >= hdr->dirtyHi) {
+		hdr->dirtyLo = lo;
+		hdr->dirtyHi = hi;
+	}
+	else {
+		if (lo < hdr->dirtyLo) hdr->dirtyLo = lo;
+		if (hi > hdr->dirtyHi) hdr->dirtyHi = hi;
+	}
+	hdr->gen = ++array_generation;
+}
+
+/** Clear an array's dirty range, once its current contents have been uploaded */
+void array_clean(ArrayHeader *hdr) {
+	hdr->cleanGen = hdr->gen;
+	hdr->dirtyLo = hdr->dirtyHi = 0;
+}
+
+/** Is c a decimal digit? (One unsigned compare, independent of locale) */
+#define array_isdigit(c) ((unsigned int)((unsigned char)(c) - '0') <= 9u)
+
+/** Powers of ten that are exactly representable as doubles */
+static const double array_pow10[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/** Convert the decimal number starting at text into a float, setting *endp just past it.
+	The locale is never consulted, so '.' is always the decimal point.
+	A plain number (at most 15 significant digits and a small exponent) is converted exactly.
+	Digits past the 15th only shift the exponent, and a larger exponent is applied in steps:
+	either way the error is far below a float's precision. Numbers too large for a float
+	saturate at its largest magnitude. */
+static GLfloat array_tofloat(const char *text, const char **endp) {
+	const char *scanp = text;
+	bool neg = false;
+	if (*scanp=='-') {neg = true; scanp++;}
+	else if (*scanp=='+') scanp++;
+
+	// Accumulate every digit into one integer mantissa, tracking the decimal point's shift
+	unsigned long long mant = 0;
+	int exp10 = 0;
+	unsigned int digit;
+	while ((digit = (unsigned char)*scanp - '0') <= 9) {
+		if (mant < 100000000000000ULL) mant = mant*10 + digit;
+		else exp10++;
+		scanp++;
+	}
+	if (*scanp=='.') {
+		scanp++;
+		while ((digit = (unsigned char)*scanp - '0') <= 9) {
+			if (mant < 100000000000000ULL) {mant = mant*10 + digit; exp10--;}
+			scanp++;
+		}
+	}
+	if ((*scanp=='e' || *scanp=='E') && (array_isdigit(scanp[1])
+		|| ((scanp[1]=='-' || scanp[1]=='+') && array_isdigit(scanp[2])))) {
+		scanp++;
+		bool eneg = false;
+		if (*scanp=='-') {eneg = true; scanp++;}
+		else if (*scanp=='+') scanp++;
+		int e = 0;
+		while ((digit = (unsigned char)*scanp - '0') <= 9) {
+			if (e < 10000) e = e*10 + digit;
+			scanp++;
+		}
+		exp10 += eneg? -e : e;
+	}
+
+	*endp = scanp;
+
+	// Mantissa and power of ten are both exact doubles, so one multiply or divide
+	// rounds correctly, just as strtod would. Beyond 1e22, scale in exact steps first.
+	double val = (double) mant;
+	if (mant != 0) {
+		for (; exp10 > 22 && val <= DBL_MAX/1e22; exp10 -= 22)
+			val *= 1e22;
+		for (; exp10 < -22 && val > 0.0; exp10 += 22)
+			val /= 1e22;
+		if (exp10 > 22)
+			val = DBL_MAX;
+		else if (exp10 < -22)
+			val = 0.0;
+		else
+			val = exp10 < 0? val / array_pow10[-exp10] : val * array_pow10[exp10];
+	}
+	if (val > FLT_MAX)
+		val = FLT_MAX;
+	return (GLfloat) (neg? -val : val);
+}
+
+/** Parse every number in a text of len bytes into a newly malloc'd array of floats,
+	in one pass. Numbers may be separated by commas, spaces or anything else
+	that cannot begin a number. Returns how many numbers were found. */
+AuintIdx array_parsefloats(const char *text, AuintIdx len, GLfloat **floatsp) {
+	// Every number after the first needs at least two characters, so this never overflows
+	GLfloat *floats = (GLfloat *) malloc((len/2+1)*sizeof(GLfloat));
+	AuintIdx n = 0;
+	const char *scanp = text;
+	const char *endp = text + len;
+	while (scanp < endp) {
+		char c = *scanp;
+		if (array_isdigit(c)
+			|| ((c=='-' || c=='+' || c=='.') && (array_isdigit(scanp[1])
+				|| (c!='.' && scanp[1]=='.' && array_isdigit(scanp[2])))))
+			floats[n++] = array_tofloat(scanp, &scanp);
+		else
+			scanp++;
+	}
+	*floatsp = floats;
+	return n;
+}
+
+/** Create a new number array of floats, sized by an integer parameter
+	or filled by parsing the numbers in a text parameter */
+static int array_newfloats(Value th, char mbrType, char structSz) {
 	// Get nStructs parameter
 	if (getTop(th)<2) {
 		pushValue(th, aNull);
 		return 1;
 	}
 	Value parm1 = getLocal(th, 1);
-	AintIdx nStructs = 0;
-	if (isInt(parm1))
-		nStructs = toAint(parm1);
-	else if (isStr(parm1)) {
-		// number of floats is one more than the number of commas
-		const char *scanp = toStr(parm1);
-		while (*scanp) {
-			if (*scanp++==',') 
-				nStructs++;
-		}
-		nStructs++;
-		nStructs /= 3;
-	}
+	AintIdx nStructs = isInt(parm1)? toAint(parm1) : 0;
 
 	// Create the number array
-	Value bufv = pushCData(th, pushProperty(th, 0, "traits"), ArrayValue, nStructs*3*sizeof(float), sizeof(ArrayHeader));
+	Value bufv = pushCData(th, pushProperty(th, 0, "traits"), ArrayValue, nStructs*structSz*sizeof(float), sizeof(ArrayHeader));
 	ArrayHeader *hdr = toArrayHeader(bufv);
-	hdr->mbrType = XyzValue;
-	hdr->structSz = 3;
+	hdr->mbrType = mbrType;
+	hdr->structSz = structSz;
 	hdr->nStructs = nStructs;
+	array_newgen(hdr);
 
-	// Fill the number array with floating point numbers converted from ascii
+	// Fill the number array with floating point numbers converted from ascii,
+	// handing the filled buffer to AcornVM rather than appending number by number
 	if (isStr(parm1)) {
-		char *scanp = (char*)toStr(parm1);
-		while (*scanp) {
-			if (*scanp=='-' || (*scanp>='0' && *scanp<='9')) {
-				GLfloat afloat = (GLfloat) strtod(scanp, &scanp);
-				strAppend(th, bufv, (const char*)(&afloat), sizeof(GLfloat));
-			}
-			else
-				scanp++;
+		GLfloat *floats;
+		AuintIdx nfloats = array_parsefloats(toStr(parm1), getSize(parm1), &floats);
+		nStructs = nfloats / structSz;
+		nfloats = nStructs * structSz;
+		if (nfloats > 0) {
+			floats = (GLfloat *) realloc(floats, nfloats*sizeof(GLfloat));
+			strSwapBuffer(th, bufv, (char *) floats, nfloats*sizeof(GLfloat));
 		}
+		else
+			free(floats);
+		hdr = toArrayHeader(bufv);
+		hdr->nStructs = nStructs;
 	}
 	return 1;
 }
 
+/** Return the number of bytes in each structure of an array of the member type */
+AuintIdx array_structsize(char mbrType, char structSz) {
+	switch (mbrType) {
+	case Uint8Nbr: case Uint16Nbr: case Uint32Nbr: return structSz * integers_nbrsize(mbrType);
+	case HalfNbr: case Unorm16Nbr: return structSz * sizeof(GLushort);
+	case Unorm8Nbr: return structSz * sizeof(GLubyte);
+	case Snorm1010102Nbr: return sizeof(GLuint);
+	default: return structSz * sizeof(GLfloat);
+	}
+}
+
+/** Push a new number array of the named type (e.g., "Xyzs") holding nStructs structures,
+	adopting the malloc'd buffer at data as its contents rather than copying it.
+	AcornVM frees the buffer when done with the array. */
+Value array_adopt(Value th, const char *typname, char mbrType, char structSz, AuintIdx nStructs, void *data) {
+	pushGloVar(th, typname);
+	Value traits = pushProperty(th, getTop(th) - 1, "traits");
+	popValue(th);
+	popValue(th);
+	Value bufv = pushCData(th, traits, ArrayValue, 0, sizeof(ArrayHeader));
+	ArrayHeader *hdr = toArrayHeader(bufv);
+	hdr->mbrType = mbrType;
+	hdr->structSz = structSz;
+	hdr->nStructs = nStructs;
+	array_newgen(hdr);
+	if (nStructs > 0)
+		strSwapBuffer(th, bufv, (char *) data, nStructs*array_structsize(mbrType, structSz));
+	else
+		free(data);
+	return bufv;
+}
+
+/** Create a new Buffer value, with number of Xyz structures. */
+int xyzs_new(Value th) {
+	return array_newfloats(th, XyzValue, 3);
+}
+
 /* Append a single Xyz value to the end of the array */
 int xyzs_append(Value th) {
 	if (getTop(th)<2)
 		return 1;
 	Value toadd = getLocal(th,1);
-	if (isFloat(toadd)) {
+	if (isFloat(toadd) && toArrayHeader(getLocal(th, 0))->mbrType == XyzValue) {
 		GLfloat afloat = toAfloat(toadd);
+		AuintIdx oldsz = getSize(getLocal(th, 0));
 		strAppend(th, getLocal(th, 0), (const char*)(&afloat), sizeof(GLfloat));
+		array_touch(toArrayHeader(getLocal(th, 0)), oldsz, oldsz+sizeof(GLfloat));
 	}
 	//else if (isxStr(toadd))
 	//	strAppend(th, getLocal(th, 0), toHeader(toadd), getxSize(toadd));
@@ -68,148 +227,244 @@ int xyzs_append(Value th) {
 }
 
 int xyzs_getx(Value th) {
-	if (getTop(th)<2 || !isInt(getLocal(th, 1)))
+	if (getTop(th)<2 || !isInt(getLocal(th, 1)) || toArrayHeader(getLocal(th, 0))->mbrType != XyzValue)
 		return 0;
 	pushValue(th, aFloat(((float *)toCData(getLocal(th, 0)))[3*toAint(getLocal(th, 1))]));
 	return 1;
 }
 
 int xyzs_setx(Value th) {
-	if (getTop(th)<3 || !isInt(getLocal(th, 2))  || !isFloat(getLocal(th, 1)))
+	if (getTop(th)<3 || !isInt(getLocal(th, 2))  || !isFloat(getLocal(th, 1)) || toArrayHeader(getLocal(th, 0))->mbrType != XyzValue)
 		return 0;
-	((float *)toCData(getLocal(th, 0)))[3*toAint(getLocal(th, 1))] = toAfloat(getLocal(th, 1));
+	AuintIdx pos = 3*toAint(getLocal(th, 2));
+	((float *)toCData(getLocal(th, 0)))[pos] = toAfloat(getLocal(th, 1));
+	array_touch(toArrayHeader(getLocal(th, 0)), pos*sizeof(float), (pos+1)*sizeof(float));
 	return 0;
 }
 
 int xyzs_gety(Value th) {
-	if (getTop(th)<2 || !isInt(getLocal(th, 1)))
+	if (getTop(th)<2 || !isInt(getLocal(th, 1)) || toArrayHeader(getLocal(th, 0))->mbrType != XyzValue)
 		return 0;
 	pushValue(th, aFloat(((float *)toCData(getLocal(th, 0)))[1+3*toAint(getLocal(th, 1))]));
 	return 1;
 }
 
 int xyzs_sety(Value th) {
-	int mmm = 1+3*toAint(getLocal(th, 2));
-	float nnn = toAfloat(getLocal(th, 1));
-	if (getTop(th)<3 || !isInt(getLocal(th, 2))  || !isFloat(getLocal(th, 1)))
+	if (getTop(th)<3 || !isInt(getLocal(th, 2))  || !isFloat(getLocal(th, 1)) || toArrayHeader(getLocal(th, 0))->mbrType != XyzValue)
 		return 0;
-	((float *)toCData(getLocal(th, 0)))[1+3*toAint(getLocal(th, 2))] = toAfloat(getLocal(th, 1));
+	AuintIdx pos = 1+3*toAint(getLocal(th, 2));
+	((float *)toCData(getLocal(th, 0)))[pos] = toAfloat(getLocal(th, 1));
+	array_touch(toArrayHeader(getLocal(th, 0)), pos*sizeof(float), (pos+1)*sizeof(float));
 	return 0;
 }
 
 int xyzs_getz(Value th) {
-	if (getTop(th)<2 || !isInt(getLocal(th, 1)))
+	if (getTop(th)<2 || !isInt(getLocal(th, 1)) || toArrayHeader(getLocal(th, 0))->mbrType != XyzValue)
 		return 0;
 	pushValue(th, aFloat(((float *)toCData(getLocal(th, 0)))[2+3*toAint(getLocal(th, 1))]));
 	return 1;
 }
 
 int xyzs_setz(Value th) {
-	if (getTop(th)<3 || !isInt(getLocal(th, 2))  || !isFloat(getLocal(th, 1)))
+	if (getTop(th)<3 || !isInt(getLocal(th, 2))  || !isFloat(getLocal(th, 1)) || toArrayHeader(getLocal(th, 0))->mbrType != XyzValue)
 		return 0;
-	((float *)toCData(getLocal(th, 0)))[2+3*toAint(getLocal(th, 1))] = toAfloat(getLocal(th, 1));
+	AuintIdx pos = 2+3*toAint(getLocal(th, 2));
+	((float *)toCData(getLocal(th, 0)))[pos] = toAfloat(getLocal(th, 1));
+	array_touch(toArrayHeader(getLocal(th, 0)), pos*sizeof(float), (pos+1)*sizeof(float));
 	return 0;
 }
 
 /** Create a new Buffer value, with number of Uv structures. */
 int uvs_new(Value th) {
-	// Get nStructs parameter
-	if (getTop(th)<2) {
-		pushValue(th, aNull);
+	return array_newfloats(th, Vec2Value, 2);
+}
+
+/** Create a new Buffer value, with number of Color structures. */
+int colors_new(Value th) {
+	return array_newfloats(th, ColorValue, 4);
+}
+
+/* Append a single float or Color value to the end of the array */
+int colors_append(Value th) {
+	if (getTop(th)<2)
 		return 1;
+	Value toadd = getLocal(th,1);
+	if (isFloat(toadd) && toArrayHeader(getLocal(th, 0))->mbrType == ColorValue) {
+		GLfloat afloat = toAfloat(toadd);
+		AuintIdx oldsz = getSize(getLocal(th, 0));
+		strAppend(th, getLocal(th, 0), (const char*)(&afloat), sizeof(GLfloat));
+		array_touch(toArrayHeader(getLocal(th, 0)), oldsz, oldsz+sizeof(GLfloat));
 	}
-	Value parm1 = getLocal(th, 1);
-	AintIdx nStructs = 0;
-	if (isInt(parm1))
-		nStructs = toAint(parm1);
-	else if (isStr(parm1)) {
-		// number of floats is one more than the number of commas
-		const char *scanp = toStr(parm1);
-		while (*scanp) {
-			if (*scanp++==',') 
-				nStructs++;
-		}
-		nStructs++;
-		nStructs /= 2;
+	//else if (isxStr(toadd))
+	//	strAppend(th, getLocal(th, 0), toxStr(toadd), getxSize(toadd));
+	return 1;
+}
+
+/** Convert a float to the nearest half-precision (16-bit) float, rounding ties to even */
+GLushort array_tohalf(GLfloat f) {
+	unsigned int x;
+	memcpy(&x, &f, sizeof(x));
+	unsigned int sign = (x >> 16) & 0x8000;
+	unsigned int mant = x & 0x7FFFFF;
+	int exp = (int)((x >> 23) & 0xFF) - 127 + 15;
+	if (((x >> 23) & 0xFF) == 0xFF)
+		return (GLushort) (sign | 0x7C00 | (mant? 0x200 : 0)); // Infinity or NaN
+	if (exp >= 31)
+		return (GLushort) (sign | 0x7C00); // Too big: infinity
+	if (exp <= 0) {
+		// Too small for a normal half: subnormal or zero
+		if (exp < -10)
+			return (GLushort) sign;
+		mant |= 0x800000;
+		unsigned int shift = 14 - exp;
+		unsigned int half = mant >> shift;
+		unsigned int rem = mant & ((1u << shift) - 1);
+		unsigned int mid = 1u << (shift - 1);
+		if (rem > mid || (rem == mid && (half & 1)))
+			half++;
+		return (GLushort) (sign | half);
 	}
+	unsigned int half = (exp << 10) | (mant >> 13);
+	unsigned int rem = mant & 0x1FFF;
+	if (rem > 0x1000 || (rem == 0x1000 && (half & 1)))
+		half++; // A carry out of the mantissa correctly bumps the exponent
+	return (GLushort) (sign | half);
+}
 
-	// Create the number array
-	Value bufv = pushCData(th, pushProperty(th, 0, "traits"), ArrayValue, nStructs*3*sizeof(float), sizeof(ArrayHeader));
-	ArrayHeader *hdr = toArrayHeader(bufv);
-	hdr->mbrType = XyzValue;
-	hdr->structSz = 2;
-	hdr->nStructs = nStructs;
+/** Convert a half-precision (16-bit) float to a float */
+GLfloat array_fromhalf(GLushort h) {
+	unsigned int sign = (h & 0x8000) << 16;
+	unsigned int exp = (h >> 10) & 0x1F;
+	unsigned int mant = h & 0x3FF;
+	unsigned int x;
+	if (exp == 0) {
+		GLfloat f = (GLfloat) mant * (1.0f / 16777216.0f); // Subnormal: mant * 2^-24
+		return sign? -f : f;
+	}
+	else if (exp == 31)
+		x = sign | 0x7F800000 | (mant << 13);
+	else
+		x = sign | ((exp + 112) << 23) | (mant << 13);
+	GLfloat f;
+	memcpy(&f, &x, sizeof(f));
+	return f;
+}
 
-	// Fill the array with floating point numbers converted from ascii
-	if (isStr(parm1)) {
-		char *scanp = (char*) toStr(parm1);
-		while (*scanp) {
-			if (*scanp=='-' || (*scanp>='0' && *scanp<='9')) {
-				GLfloat afloat = (GLfloat) strtod(scanp, &scanp);
-				strAppend(th, bufv, (const char*)(&afloat), sizeof(GLfloat));
-			}
-			else
-				scanp++;
-		}
+/** Replace an array's contents with its quantized numbers, of a new member type */
+static void array_requantize(Value th, Value arrv, char mbrType, void *data, AuintIdx nbytes) {
+	if (nbytes > 0)
+		strSwapBuffer(th, arrv, (char *) data, nbytes);
+	else
+		free(data);
+	ArrayHeader *hdr = toArrayHeader(arrv);
+	hdr->mbrType = mbrType;
+	array_touch(hdr, 0, nbytes);
+}
+
+/** Convert the array's floats to half floats, returning the largest error introduced */
+static GLfloat array_quantizehalf(Value th, Value arrv) {
+	AuintIdx n = getSize(arrv) / sizeof(GLfloat);
+	const GLfloat *from = (const GLfloat *) toCData(arrv);
+	GLushort *to = (GLushort *) malloc(n*sizeof(GLushort));
+	GLfloat maxerr = 0.0f;
+	for (AuintIdx i=0; i<n; i++) {
+		to[i] = array_tohalf(from[i]);
+		GLfloat err = fabs(array_fromhalf(to[i]) - from[i]);
+		if (err > maxerr) maxerr = err;
 	}
-	return 1;
+	array_requantize(th, arrv, HalfNbr, to, n*sizeof(GLushort));
+	return maxerr;
 }
 
-/** Create a new Buffer value, with number of Xyz structures. */
-int colors_new(Value th) {
-	// Get nStructs parameter
-	if (getTop(th)<2) {
+/** Quantize Xyzs into a more compact form for rendering, returning the largest error introduced
+	into any number (or null if already quantized). By default, each number becomes a half float,
+	suitable for positions. With 'Normal', each Xyz of unit-length normals is packed into
+	32 bits as 10-bit signed normalized numbers. Quantized Xyzs can no longer be read or changed. */
+int xyzs_quantize(Value th) {
+	Value arrv = getLocal(th, 0);
+	if (toArrayHeader(arrv)->mbrType != XyzValue) {
 		pushValue(th, aNull);
 		return 1;
 	}
-	Value parm1 = getLocal(th, 1);
-	AintIdx nStructs = 0;
-	if (isInt(parm1))
-		nStructs = toAint(parm1);
-	else if (isStr(parm1)) {
-		// number of floats is one more than the number of commas
-		const char *scanp = toStr(parm1);
-		while (*scanp) {
-			if (*scanp++==',') 
-				nStructs++;
-		}
-		nStructs++;
-		nStructs /= 4;
+	Value kindv = getTop(th)>=2? getLocal(th, 1) : aNull;
+	if (!isSym(kindv) || strcmp(toStr(kindv), "Normal") != 0) {
+		pushValue(th, aFloat(array_quantizehalf(th, arrv)));
+		return 1;
 	}
 
-	// Create the number array
-	Value bufv = pushCData(th, pushProperty(th, 0, "traits"), ArrayValue, nStructs*4*sizeof(float), sizeof(ArrayHeader));
-	ArrayHeader *hdr = toArrayHeader(bufv);
-	hdr->mbrType = ColorValue;
-	hdr->structSz = 4;
-	hdr->nStructs = nStructs;
+	// Pack normals, with w as 1
+	AuintIdx n = getSize(arrv) / sizeof(Xyz);
+	const GLfloat *from = (const GLfloat *) toCData(arrv);
+	GLuint *to = (GLuint *) malloc(n*sizeof(GLuint));
+	GLfloat maxerr = 0.0f;
+	for (AuintIdx i=0; i<n; i++) {
+		GLuint packed = 1u << 30;
+		for (int c=0; c<3; c++) {
+			GLfloat val = from[3*i+c];
+			GLfloat clamped = val < -1.0f? -1.0f : val > 1.0f? 1.0f : val;
+			int q = (int) floor(clamped*511.0f + 0.5f);
+			GLfloat err = fabs((GLfloat)q/511.0f - val);
+			if (err > maxerr) maxerr = err;
+			packed |= ((GLuint)q & 0x3FF) << (10*c);
+		}
+		to[i] = packed;
+	}
+	array_requantize(th, arrv, Snorm1010102Nbr, to, n*sizeof(GLuint));
+	pushValue(th, aFloat(maxerr));
+	return 1;
+}
 
-	// Fill the number array with floating point numbers converted from ascii
-	if (isStr(parm1)) {
-		char *scanp = (char*)toStr(parm1);
-		while (*scanp) { 
-			if (*scanp=='-' || (*scanp>='0' && *scanp<='9')) {
-				GLfloat afloat = (GLfloat) strtod(scanp, &scanp);
-				strAppend(th, bufv, (const char*)(&afloat), sizeof(GLfloat));
-			}
-			else
-				scanp++;
+/** Quantize Uvs into a more compact form for rendering, returning the largest error introduced
+	into any number (or null if already quantized). Uvs between 0 and 1 become 16-bit
+	normalized integers; Uvs that repeat a texture beyond that become half floats.
+	Quantized Uvs can no longer be changed. */
+int uvs_quantize(Value th) {
+	Value arrv = getLocal(th, 0);
+	if (toArrayHeader(arrv)->mbrType != Vec2Value) {
+		pushValue(th, aNull);
+		return 1;
+	}
+	AuintIdx n = getSize(arrv) / sizeof(GLfloat);
+	const GLfloat *from = (const GLfloat *) toCData(arrv);
+	for (AuintIdx i=0; i<n; i++) {
+		if (from[i] < 0.0f || from[i] > 1.0f) {
+			pushValue(th, aFloat(array_quantizehalf(th, arrv)));
+			return 1;
 		}
 	}
+	GLushort *to = (GLushort *) malloc(n*sizeof(GLushort));
+	GLfloat maxerr = 0.0f;
+	for (AuintIdx i=0; i<n; i++) {
+		to[i] = (GLushort) floor(from[i]*65535.0f + 0.5f);
+		GLfloat err = fabs((GLfloat)to[i]/65535.0f - from[i]);
+		if (err > maxerr) maxerr = err;
+	}
+	array_requantize(th, arrv, Unorm16Nbr, to, n*sizeof(GLushort));
+	pushValue(th, aFloat(maxerr));
 	return 1;
 }
 
-/* Append a single float or Color value to the end of the array */
-int colors_append(Value th) {
-	if (getTop(th)<2)
+/** Quantize Colors into 8-bit normalized integers for rendering, returning the largest error
+	introduced into any number (or null if already quantized). Components are clamped to 0-1.
+	Quantized Colors can no longer be changed. */
+int colors_quantize(Value th) {
+	Value arrv = getLocal(th, 0);
+	if (toArrayHeader(arrv)->mbrType != ColorValue) {
+		pushValue(th, aNull);
 		return 1;
-	Value toadd = getLocal(th,1);
-	if (isFloat(toadd)) {
-		GLfloat afloat = toAfloat(toadd);
-		strAppend(th, getLocal(th, 0), (const char*)(&afloat), sizeof(GLfloat));
 	}
-	//else if (isxStr(toadd))
-	//	strAppend(th, getLocal(th, 0), toxStr(toadd), getxSize(toadd));
+	AuintIdx n = getSize(arrv) / sizeof(GLfloat);
+	const GLfloat *from = (const GLfloat *) toCData(arrv);
+	GLubyte *to = (GLubyte *) malloc(n*sizeof(GLubyte));
+	GLfloat maxerr = 0.0f;
+	for (AuintIdx i=0; i<n; i++) {
+		GLfloat clamped = from[i] < 0.0f? 0.0f : from[i] > 1.0f? 1.0f : from[i];
+		to[i] = (GLubyte) floor(clamped*255.0f + 0.5f);
+		GLfloat err = fabs((GLfloat)to[i]/255.0f - from[i]);
+		if (err > maxerr) maxerr = err;
+	}
+	array_requantize(th, arrv, Unorm8Nbr, to, n*sizeof(GLubyte));
+	pushValue(th, aFloat(maxerr));
 	return 1;
 }
 
@@ -234,6 +489,8 @@ void array_init(Value th) {
 			pushCMethod(th, xyzs_setz);
 			pushClosure(th, 2);
 			popProperty(th, 1, "z");
+			pushCMethod(th, xyzs_quantize);
+			popProperty(th, 1, "Quantize");
 		popProperty(th, 0, "traits");
 		pushCMethod(th, xyzs_new);
 		popProperty(th, 0, "New");
@@ -247,6 +504,8 @@ void array_init(Value th) {
 			popProperty(th, 1, "_name");
 			//pushCMethod(th, uvs_append);
 			//popProperty(th, 1, "<<");
+			pushCMethod(th, uvs_quantize);
+			popProperty(th, 1, "Quantize");
 		popProperty(th, 0, "traits");
 		pushCMethod(th, uvs_new);
 		popProperty(th, 0, "New");
@@ -260,6 +519,8 @@ void array_init(Value th) {
 			popProperty(th, 1, "_name");
 			pushCMethod(th, colors_append);
 			popProperty(th, 1, "<<");
+			pushCMethod(th, colors_quantize);
+			popProperty(th, 1, "Quantize");
 		popProperty(th, 0, "traits");
 		pushCMethod(th, colors_new);
 		popProperty(th, 0, "New");
@@ -8,6 +8,9 @@
 
 #include "pegasus3d.h"
 #include "xyzmath.h"
+#include "glstate.h"
+#include "renderqueue.h"
+#include "transform.h"
 
 /** Create a new camera */
 int camera_new(Value th) {
@@ -131,18 +134,36 @@ int camera_renderprep(Value th) {
 	int nodeidx = 1;
 	int parentmatidx = 2;
 
-	// Calculate mmatrix from origin, orientation, scale relative to parent
-	pushSym(th, "CalcMatrix");
-	pushLocal(th, nodeidx);
-	pushLocal(th, parentmatidx);
-	getCall(th, 2, 0);
+	// Bring mmatrix up to date from origin, orientation, scale relative to parent,
+	// recalculating only if any of these have changed.
+	// A node with its own CalcMatrix calculates mmatrix itself, every time.
+	int parent = transform_current;
+	int recnode = renderqueue_recnode;
+	bool unparented = getLocal(th, parentmatidx)==aNull;
+	Value calcmeth = getProperty(th, getLocal(th, nodeidx), pegsym.CalcMatrix);
+	bool scripted = calcmeth != aNull && calcmeth != placement_calcmeth;
+	if (scripted) {
+		pushValue(th, calcmeth);
+		pushLocal(th, nodeidx);
+		pushLocal(th, parentmatidx);
+		getCall(th, 2, 0);
+		transform_current = transform_adopt(th, nodeidx, unparented? -1 : parent);
+	}
+	else if (calcmeth != aNull)
+		transform_current = transform_update(th, nodeidx, unparented? -1 : parent, -1);
+
+	// A static group recording its subtree notes every node it visits
+	if (renderqueue_recording)
+		renderqueue_recordnode(getLocal(th, nodeidx), calcmeth != aNull, unparented, scripted);
 
 	// Node-specific render preparation
-	pushSym(th, "_RenderPrep");
+	pushValue(th, pegsym.RenderPrep);
 	pushLocal(th, nodeidx);
 	pushLocal(th, selfidx);
 	getCall(th, 2, 0);
 
+	transform_current = parent;
+	renderqueue_recnode = recnode;
 	return 0;
 }
 
@@ -171,7 +192,7 @@ int camera_render(Value th) {
 		targetrect->h = viewport->h;
 		targetrect->w = viewport->w;
 		glScissor(viewport->x, viewport->y, viewport->w, viewport->h);
-		glEnable(GL_SCISSOR_TEST);
+		glsEnable(GL_SCISSOR_TEST);
 	}
 	else
 		glViewport(0, 0, targetrect->w, targetrect->h); // just in case
@@ -186,14 +207,15 @@ int camera_render(Value th) {
 	// OpenGL: Clear target buffers for 3D rendering
 	glClearColor(background->red, background->green, background->blue, background->alpha);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    glEnable(GL_DEPTH_TEST);
-    glDepthFunc(GL_LESS); // Closer objects obscure further objects
-	glUseProgram(0); // No shader
+	glsEnable(GL_DEPTH_TEST);
+	glsDepthFunc(GL_LESS); // Closer objects obscure further objects
 	if (viewportv!=aNull)
-		glDisable(GL_SCISSOR_TEST);
+		glsDisable(GL_SCISSOR_TEST);
 
-	// Traverse the scene graph's nodes, preparing for the render
-	pushSym(th, "_RenderPrep");
+	// Traverse the scene graph's nodes, preparing for the render and queuing its shapes
+	renderqueue_begin();
+	transform_begin();
+	pushValue(th, pegsym.RenderPrep);
 	pushLocal(th, selfidx);
 	if (pushProperty(th, selfidx, "scene")==aNull) {
 		popValue(th);
@@ -259,15 +281,21 @@ int camera_render(Value th) {
 	// Invert camera's matrix so it transforms from world coordinates to camera
 	mat4Inverse(vmat, vmat);
 
-	// Render camera's (or world's) scene
-	pushSym(th, "_Render");
-	if (pushProperty(th, selfidx, "scene")==aNull) {
-		popValue(th);
-		pushProperty(th, worldidx, "scene");
+	// Cull queued shapes that lie outside the camera's view frustum,
+	// then pick the rest's level of detail by how tall they appear in the target
+	Value pmatv = pushProperty(th, selfidx, "pmatrix"); popValue(th);
+	if (isMat4(pmatv)) {
+		Mat4 vpmat;
+		mat4Mult(&vpmat, toMat4(pmatv), vmat);
+		renderqueue_cull(&vpmat);
+		Value lodsizev = pushProperty(th, selfidx, "lodSize"); popValue(th);
+		renderqueue_lod(vmat, toMat4(pmatv), (GLfloat) targetrect->h, isFloat(lodsizev)? toAfloat(lodsizev) : 300.0f);
 	}
-	pushLocal(th, selfidx);
-	pushValue(th, aNull); // Default for identity matrix
-	getCall(th, 3, 0);
+
+	// Render camera's (or world's) scene, drawing its queued shapes in sorted order
+	Value farv = pushProperty(th, selfidx, "far"); popValue(th);
+	renderqueue_sort(vmat, isFloat(farv)? toAfloat(farv) : 1000.0f);
+	renderqueue_submit(th, selfidx);
 
 	// Swap buffers to display the rendered target
 	if (targetv!=aNull) {
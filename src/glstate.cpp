@@ -0,0 +1,216 @@
+/** OpenGL state shadowing, so that redundant state changes are never issued
+ * @file
+ *
+ * All render code changes OpenGL state through these functions rather than directly.
+ * Each remembers what OpenGL was last told, and passes a call on only when it would
+ * change something. The shadow is forgotten (glsReset) whenever another context becomes current.
+ *
+ * This source file is part of the Pegasus3d browser.
+ * See Copyright Notice in pegasus3d.h
+*/
+
+#include "pegasus3d.h"
+#include "glstate.h"
+
+#define GLS_UNKNOWN 0xFFFFFFFF	//!< Shadow value when we do not know OpenGL's state
+#define GLS_MAXUNITS 32			//!< Number of texture units whose bindings are shadowed
+
+/** What we believe OpenGL's current state to be */
+struct GlState {
+	GLuint blend;		//!< Is GL_BLEND enabled?
+	GLuint depthtest;	//!< Is GL_DEPTH_TEST enabled?
+	GLuint scissortest;	//!< Is GL_SCISSOR_TEST enabled?
+	GLenum blendsrc;	//!< Blend function's source factor
+	GLenum blenddst;	//!< Blend function's destination factor
+	GLenum depthfunc;	//!< Depth comparison function
+	GLuint program;		//!< Current shader program
+	GLuint vao;			//!< Bound vertex array object
+	GLuint arraybuf;	//!< Bound GL_ARRAY_BUFFER
+	GLuint elembuf;		//!< Bound GL_ELEMENT_ARRAY_BUFFER (part of vao's state)
+	GLenum unit;		//!< Active texture unit
+	GLuint tex2d[GLS_MAXUNITS];		//!< GL_TEXTURE_2D bound to each unit
+	GLuint texcube[GLS_MAXUNITS];	//!< GL_TEXTURE_CUBE_MAP bound to each unit
+} gls;
+
+GlStateCounts glsFrameCounts;
+GlStateCounts glsLastCounts;
+
+/** Forget everything we believe about OpenGL's state, e.g., after a context switch */
+void glsReset(void) {
+	memset(&gls, 0xFF, sizeof(gls));
+}
+
+/** Roll the current frame's counts over into the last frame's counts */
+void glsFrameEnd(void) {
+	glsLastCounts = glsFrameCounts;
+	glsFrameCounts.issued = glsFrameCounts.suppressed = 0;
+}
+
+/** Return true (and count it as issued) if shadowed state must change to value */
+static bool glsChange(GLuint *shadow, GLuint value) {
+	if (*shadow == value) {
+		glsFrameCounts.suppressed++;
+		return false;
+	}
+	*shadow = value;
+	glsFrameCounts.issued++;
+	return true;
+}
+
+/** Point to the shadow for an enable/disable capability, or NULL if it is not shadowed */
+static GLuint *glsCap(GLenum cap) {
+	switch (cap) {
+	case GL_BLEND: return &gls.blend;
+	case GL_DEPTH_TEST: return &gls.depthtest;
+	case GL_SCISSOR_TEST: return &gls.scissortest;
+	default: return NULL;
+	}
+}
+
+/** glEnable */
+void glsEnable(GLenum cap) {
+	GLuint *shadow = glsCap(cap);
+	if (shadow==NULL) {
+		glsFrameCounts.issued++;
+		glEnable(cap);
+	}
+	else if (glsChange(shadow, GL_TRUE))
+		glEnable(cap);
+}
+
+/** glDisable */
+void glsDisable(GLenum cap) {
+	GLuint *shadow = glsCap(cap);
+	if (shadow==NULL) {
+		glsFrameCounts.issued++;
+		glDisable(cap);
+	}
+	else if (glsChange(shadow, GL_FALSE))
+		glDisable(cap);
+}
+
+/** glBlendFunc */
+void glsBlendFunc(GLenum sfactor, GLenum dfactor) {
+	if (gls.blendsrc == sfactor && gls.blenddst == dfactor) {
+		glsFrameCounts.suppressed++;
+		return;
+	}
+	gls.blendsrc = sfactor;
+	gls.blenddst = dfactor;
+	glsFrameCounts.issued++;
+	glBlendFunc(sfactor, dfactor);
+}
+
+/** glDepthFunc */
+void glsDepthFunc(GLenum func) {
+	if (glsChange(&gls.depthfunc, func))
+		glDepthFunc(func);
+}
+
+/** glUseProgram */
+void glsUseProgram(GLuint program) {
+	if (glsChange(&gls.program, program))
+		glUseProgram(program);
+}
+
+/** glBindVertexArray. The element buffer binding belongs to the vao, so we lose track of it. */
+void glsBindVertexArray(GLuint vao) {
+	if (glsChange(&gls.vao, vao)) {
+		glBindVertexArray(vao);
+		gls.elembuf = GLS_UNKNOWN;
+	}
+}
+
+/** glBindBuffer */
+void glsBindBuffer(GLenum target, GLuint buffer) {
+	GLuint *shadow = target==GL_ARRAY_BUFFER? &gls.arraybuf
+		: target==GL_ELEMENT_ARRAY_BUFFER? &gls.elembuf : NULL;
+	if (shadow==NULL) {
+		glsFrameCounts.issued++;
+		glBindBuffer(target, buffer);
+	}
+	else if (glsChange(shadow, buffer))
+		glBindBuffer(target, buffer);
+}
+
+/** glActiveTexture */
+void glsActiveTexture(GLenum unit) {
+	if (glsChange(&gls.unit, unit))
+		glActiveTexture(unit);
+}
+
+/** glBindTexture, on the active texture unit */
+void glsBindTexture(GLenum target, GLuint texture) {
+	GLuint unit = gls.unit - GL_TEXTURE0;
+	GLuint *shadow = unit>=GLS_MAXUNITS? NULL
+		: target==GL_TEXTURE_2D? &gls.tex2d[unit]
+		: target==GL_TEXTURE_CUBE_MAP? &gls.texcube[unit] : NULL;
+	if (shadow==NULL) {
+		glsFrameCounts.issued++;
+		glBindTexture(target, texture);
+	}
+	else if (glsChange(shadow, texture))
+		glBindTexture(target, texture);
+}
+
+/** glDeleteProgram. A deleted current program lingers until replaced, so stop trusting the shadow. */
+void glsDeleteProgram(GLuint program) {
+	if (program!=0 && program==gls.program)
+		gls.program = GLS_UNKNOWN;
+	glDeleteProgram(program);
+}
+
+/** glDeleteVertexArrays. Deleting the bound vao reverts the binding to 0. */
+void glsDeleteVertexArrays(GLsizei n, GLuint *vaos) {
+	for (GLsizei i=0; i<n; i++) {
+		if (vaos[i]!=0 && vaos[i]==gls.vao) {
+			gls.vao = 0;
+			gls.elembuf = 0;
+		}
+	}
+	glDeleteVertexArrays(n, vaos);
+}
+
+/** glDeleteBuffers. Deleting a bound buffer reverts the binding to 0. */
+void glsDeleteBuffers(GLsizei n, GLuint *buffers) {
+	for (GLsizei i=0; i<n; i++) {
+		if (buffers[i]==0) continue;
+		if (buffers[i]==gls.arraybuf) gls.arraybuf = 0;
+		if (buffers[i]==gls.elembuf) gls.elembuf = 0;
+	}
+	glDeleteBuffers(n, buffers);
+}
+
+/** glDeleteTextures. Deleting a bound texture reverts its binding to 0 on every unit. */
+void glsDeleteTextures(GLsizei n, GLuint *textures) {
+	for (GLsizei i=0; i<n; i++) {
+		if (textures[i]==0) continue;
+		for (int unit=0; unit<GLS_MAXUNITS; unit++) {
+			if (gls.tex2d[unit]==textures[i]) gls.tex2d[unit] = 0;
+			if (gls.texcube[unit]==textures[i]) gls.texcube[unit] = 0;
+		}
+	}
+	glDeleteTextures(n, textures);
+}
+
+/** Return two values: the number of state-changing OpenGL calls issued
+	and suppressed during the last completed frame */
+int glstate_counts(Value th) {
+	pushValue(th, anInt(glsLastCounts.issued));
+	pushValue(th, anInt(glsLastCounts.suppressed));
+	return 2;
+}
+
+/** Initialize the GlState type, which reports on OpenGL state filtering */
+void glstate_init(Value th) {
+	glsReset();
+	glsFrameCounts.issued = glsFrameCounts.suppressed = 0;
+	glsLastCounts = glsFrameCounts;
+
+	pushType(th, aNull, 2);
+		pushSym(th, "GlState");
+		popProperty(th, 0, "_name");
+		pushCMethod(th, glstate_counts);
+		popProperty(th, 0, "Counts");
+	popGloVar(th, "GlState");
+}
@@ -0,0 +1,42 @@
+/** OpenGL state shadowing, so that redundant state changes are never issued
+ * @file
+ *
+ * This source file is part of the Pegasus3d browser.
+ * See Copyright Notice in pegasus3d.h
+*/
+
+#ifndef glstate_h
+#define glstate_h 1
+
+// GLEW Headers - for OpenGL
+#define GL3_PROTOTYPES 1
+#include <GL/glew.h>
+
+/** Counts of state-changing OpenGL calls asked for, by whether they reached OpenGL */
+struct GlStateCounts {
+	unsigned int issued;		//!< Calls passed on to OpenGL
+	unsigned int suppressed;	//!< Calls dropped because the state was already set
+};
+
+extern GlStateCounts glsFrameCounts;	//!< Counts for the frame being rendered
+extern GlStateCounts glsLastCounts;		//!< Counts for the last completed frame
+
+void glsReset(void);
+void glsFrameEnd(void);
+
+void glsEnable(GLenum cap);
+void glsDisable(GLenum cap);
+void glsBlendFunc(GLenum sfactor, GLenum dfactor);
+void glsDepthFunc(GLenum func);
+void glsUseProgram(GLuint program);
+void glsBindVertexArray(GLuint vao);
+void glsBindBuffer(GLenum target, GLuint buffer);
+void glsActiveTexture(GLenum unit);
+void glsBindTexture(GLenum target, GLuint texture);
+
+void glsDeleteProgram(GLuint program);
+void glsDeleteVertexArrays(GLsizei n, GLuint *vaos);
+void glsDeleteBuffers(GLsizei n, GLuint *buffers);
+void glsDeleteTextures(GLsizei n, GLuint *textures);
+
+#endif
@@ -1,11 +1,17 @@
 /** Group definition and rendering
  * @file
  *
+ * A group has no _Render of its own. The camera draws only what the scene's nodes queue
+ * while it calls their _RenderPrep (see renderqueue.cpp), so each of a group's parts is
+ * drawn only if it queues itself there, never by being rendered in scene order.
+ *
  * This source file is part of the Pegasus3d browser.
  * See Copyright Notice in pegasus3d.h
 */
 
 #include "pegasus3d.h"
+#include "renderqueue.h"
+#include <string.h>
 
 /** Create a new group */
 int group_new(Value th) {
@@ -13,45 +19,65 @@ int group_new(Value th) {
 	return 1;
 }
 
-/** Recursively traverse a scene graph's group, preparing it for rendering */
+/** Get the group's cached draw list, creating it if this group does not have its own yet */
+RenderCache *group_getcache(Value th, int selfidx) {
+	Value cachev = getProperty(th, getLocal(th, selfidx), pegsym._drawlist);
+	if (cachev==aNull || ((RenderCache*) toHeader(cachev))->owner != getLocal(th, selfidx)) {
+		Value cachetype = pushProperty(th, selfidx, "_drawlisttype");
+		cachev = strHasFinalizer(pushCData(th, cachetype, DrawListValue, 0, sizeof(RenderCache))); // Is small enough to stick in header
+		RenderCache *cache = (RenderCache*) toHeader(cachev);
+		memset(cache, 0, sizeof(RenderCache));
+		cache->owner = getLocal(th, selfidx);
+		cache->camera = aNull;
+		popProperty(th, selfidx, "_drawlist");
+		popValue(th); // _drawlisttype
+	}
+	return (RenderCache*) toHeader(cachev);
+}
+
+/** Recursively traverse a scene graph's group, preparing it for rendering.
+	A "static" group replays the draws its subtree last queued, unless its parts or placements changed. */
 int group_renderprep(Value th) {
 	int selfidx = 0;
 	int cameraidx = 1;
 
-	Value nodematv = pushProperty(th, selfidx, "mmatrix");
+	Value self = getLocal(th, selfidx);
+	Value nodematv = getProperty(th, self, pegsym.mmatrix);
 
-	// Recursively traverse this node's parts
-	Value parts = pushProperty(th, selfidx, "parts");
+	// Recursively traverse this node's parts, bounding them together for culling
+	Value parts = getProperty(th, self, pegsym.parts);
+	if (renderqueue_recording)
+		renderqueue_recordparts(th, parts);
 	if (isArr(parts)) {
+		int span = renderqueue_opengroup();
+
+		// A static group (not within one being recorded) tries its cached draw list first
+		RenderCache *cache = NULL;
+		Value staticv = getProperty(th, self, pegsym.Static);
+		if (!isFalse(staticv) && renderqueue_recording == NULL) {
+			cache = group_getcache(th, selfidx);
+			if (renderqueue_replay(th, cache, getLocal(th, cameraidx))) {
+				renderqueue_closegroup(span);
+				return 0;
+			}
+			renderqueue_record(cache, getLocal(th, selfidx), getLocal(th, cameraidx));
+			renderqueue_recordparts(th, parts);
+		}
+
 		Aint sz = getSize(parts);
 		for (Aint i=0; i<sz; i++) {
-			pushSym(th, "_RenderPrep");
+			pushValue(th, pegsym.RenderPrep);
 			pushLocal(th, cameraidx);
 			pushValue(th, arrGet(th, parts, i));
 			pushValue(th, nodematv);
 			getCall(th, 3, 0);
 		}
-	}
-
-	return 0;
-}
-
-/** Render group using passed context (parm 1) */
-int group_render(Value th) {
-	int selfidx = 0;
-	int contextidx = 1;
-
-	// Render every part in group, in order
-	Value parts = pushProperty(th, selfidx, "parts");
-	if (isArr(parts)) {
-		Aint sz = getSize(parts);
-		for (Aint i=0; i<sz; i++) {
-			pushSym(th, "_Render");
-			pushValue(th, arrGet(th, parts, i));
-			pushLocal(th, contextidx);
-			pushProperty(th, selfidx, "mmatrix");
-			getCall(th, 3, 0);
+		if (cache) {
+			renderqueue_recordend(span);
+			renderqueue_pushrefs(th, cache);
+			popProperty(th, selfidx, "_drawrefs");
 		}
+		renderqueue_closegroup(span);
 	}
 
 	return 0;
@@ -66,9 +92,13 @@ void group_init(Value th) {
 		popProperty(th, 0, "_name");
 		pushCMethod(th, group_new);
 		popProperty(th, 0, "New");
-		pushCMethod(th, group_render);
-		popProperty(th, 0, "_Render");
 		pushCMethod(th, group_renderprep);
 		popProperty(th, 0, "_RenderPrep");
+		Value cachemixin = pushMixin(th, aNull, aNull, 4);
+			pushSym(th, "*DrawList");
+			popProperty(th, 1, "_name");
+			pushCMethod(th, renderqueue_closecache);
+			popProperty(th, 1, "_finalizer");
+		popProperty(th, 0, "_drawlisttype");
 	popGloVar(th, "Group");
 }
@@ -1,16 +1,172 @@
 /** Image buffer - contents from an image resource
  * @file
  *
+ * Decoding a large jpg or png takes long enough to stall the render loop, so images
+ * are decoded by a small pool of worker threads. Image.New returns at once with an
+ * empty image (0 by 0, marked as decoding) and queues a copy of the encoded contents.
+ * A worker decodes it, and the main loop's call to image_poll fills in the image's
+ * size and pixels once it is done. Until then, a texture using the image draws as
+ * if it had none.
+ *
+ * The number of worker threads, and so of decodes running at once, is bounded.
+ * Each decode is timed; Image.DecodeStats reports how many images were decoded,
+ * their total decode time and the longest one.
+ *
+ * When Image.compress is true (and the GPU supports S3TC), the worker also compresses
+ * the decoded pixels into BC1/BC3 blocks with a full mipmap chain (see texcomp.cpp),
+ * which then become the image's contents. Compressed results are cached on disk by a
+ * hash of the encoded contents, so an image already cached is not even decoded.
+ *
  * This source file is part of the Pegasus3d browser.
  * See Copyright Notice in pegasus3d.h
 */
 
 #include "pegasus3d.h"
+#include <stdlib.h>
+#include <string.h>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
-/** Create a new image, converting its contents to r/g/b values */
+#define IMAGE_MAXDECODERS 4		//!< Most worker threads decoding images at once
+
+GLenum texcomp_format(int comp);
+unsigned long long texcomp_hash(const unsigned char *data, int len);
+unsigned char *texcomp_compress(const unsigned char *pixels, int x, int y, int comp, int *nlevels, AuintIdx *size);
+unsigned char *texcomp_cacheload(unsigned long long hash, int *x, int *y, int *comp, int *nlevels, AuintIdx *size);
+void texcomp_cachesave(unsigned long long hash, int x, int y, int comp, int nlevels, const unsigned char *blocks, AuintIdx size);
+
+/** An image waiting to be, or just, decoded by a worker */
+struct ImageJob {
+	unsigned char *data;	//!< Copy of the encoded contents (freed once decoded)
+	int len;				//!< Length of the encoded contents
+	bool compress;			//!< Compress the decoded pixels?
+	unsigned char *pixels;	//!< Decoded pixels, or their compressed blocks (NULL if not decodable)
+	AuintIdx size;			//!< Bytes of pixels
+	int x;					//!< Decoded width
+	int y;					//!< Decoded height
+	int comp;				//!< Decoded bytes per pixel
+	int levels;				//!< Number of mipmap levels compressed (0 if not compressed)
+	bool cached;			//!< Were the compressed blocks read from the cache?
+	double ms;				//!< Milliseconds spent decoding (and compressing)
+	int slot;				//!< Index of the image in the list of those decoding
+	ImageJob *next;			//!< Next job in the same queue
+};
+
+SDL_mutex *image_lock;		//!< Guards the queues below
+SDL_cond *image_wake;		//!< Signalled when a job is queued, or when workers must quit
+ImageJob *image_todo;		//!< Jobs waiting for a worker, oldest first
+ImageJob *image_todotail;	//!< Last job waiting for a worker
+ImageJob *image_done;		//!< Jobs decoded, waiting for image_poll
+bool image_quitting;		//!< Have workers been told to quit?
+SDL_Thread *image_workers[IMAGE_MAXDECODERS];	//!< Worker threads
+int image_nworkers;			//!< Number of worker threads started
+
+Value image_decoding;		//!< List of the images being decoded (keeping them from being collected)
+int *image_freeslots;		//!< Stack of unused indices in image_decoding
+int image_nfreeslots;		//!< Number of unused indices
+int image_nslots;			//!< Number of indices ever used
+int image_npending;			//!< Number of images not yet delivered by image_poll
+
+unsigned int image_ndecoded;	//!< Number of images decoded
+double image_decodems;		//!< Total milliseconds spent decoding
+double image_longestms;		//!< Longest milliseconds spent decoding one image
+
+/** Decode (and perhaps compress) a job's image, freeing its encoded contents */
+static void image_decode(ImageJob *job) {
+	Uint64 start = SDL_GetPerformanceCounter();
+	job->levels = 0;
+	job->cached = false;
+	job->pixels = NULL;
+	unsigned long long hash = 0;
+	if (job->compress) {
+		hash = texcomp_hash(job->data, job->len);
+		job->pixels = texcomp_cacheload(hash, &job->x, &job->y, &job->comp, &job->levels, &job->size);
+		job->cached = job->pixels != NULL;
+	}
+	if (job->pixels == NULL) {
+		job->pixels = stbi_load_from_memory(job->data, job->len, &job->x, &job->y, &job->comp, 0);
+		job->size = job->comp * job->x * job->y;
+		if (job->pixels && job->compress) {
+			unsigned char *blocks = texcomp_compress(job->pixels, job->x, job->y, job->comp, &job->levels, &job->size);
+			stbi_image_free(job->pixels);
+			job->pixels = blocks;
+			texcomp_cachesave(hash, job->x, job->y, job->comp, job->levels, blocks, job->size);
+		}
+	}
+	job->ms = 1000.0 * (double)(SDL_GetPerformanceCounter() - start) / (double)SDL_GetPerformanceFrequency();
+	free(job->data);
+	job->data = NULL;
+}
+
+/** Worker thread: decode queued images until told to quit */
+static int image_worker(void *unused) {
+	SDL_LockMutex(image_lock);
+	for (;;) {
+		while (image_todo == NULL && !image_quitting)
+			SDL_CondWait(image_wake, image_lock);
+		if (image_quitting)
+			break;
+		ImageJob *job = image_todo;
+		if ((image_todo = job->next) == NULL)
+			image_todotail = NULL;
+		SDL_UnlockMutex(image_lock);
+
+		image_decode(job);
+
+		SDL_LockMutex(image_lock);
+		job->next = image_done;
+		image_done = job;
+	}
+	SDL_UnlockMutex(image_lock);
+	return 0;
+}
+
+/** Start the worker threads, the first time an image needs decoding.
+	One core is left to the render loop. */
+static void image_startworkers(void) {
+	int nworkers = SDL_GetCPUCount() - 1;
+	if (nworkers > IMAGE_MAXDECODERS)
+		nworkers = IMAGE_MAXDECODERS;
+	if (nworkers < 1)
+		nworkers = 1;
+	image_lock = SDL_CreateMutex();
+	image_wake = SDL_CreateCond();
+	image_quitting = false;
+	for (int i=0; i<nworkers; i++) {
+		if ((image_workers[image_nworkers] = SDL_CreateThread(image_worker, "ImageDecoder", NULL)) != NULL)
+			image_nworkers++;
+	}
+}
+
+/** Deliver a job's decoded pixels to its image */
+static void image_deliver(Value th, Value imagev, ImageJob *job) {
+	ImageHeader *imghdr = toImageHeader(imagev);
+	imghdr->decoding = 0;
+	if (job->pixels == NULL) {
+		vmLog("Could not decode image");
+		return;
+	}
+	imghdr->x = job->x;
+	imghdr->y = job->y;
+	imghdr->z = 0;
+	imghdr->nbytes = (unsigned char) job->comp;
+	imghdr->levels = (unsigned char) (job->levels? job->levels : 1);
+	imghdr->compressed = job->levels? texcomp_format(job->comp) : 0;
+
+	// Give decoded image data to AcornVM instead of copying lots of data into a newly allocated area
+	// AcornVM will free it when done, so we should not do so now
+	strSwapBuffer(th, imagev, (char*) job->pixels, job->size);
+
+	image_ndecoded++;
+	image_decodems += job->ms;
+	if (job->ms > image_longestms)
+		image_longestms = job->ms;
+	vmLog("%s %dx%d image in %.1f ms", job->cached? "Loaded cached" : job->levels? "Decoded and compressed" : "Decoded",
+		job->x, job->y, job->ms);
+}
+
+/** Create a new image, queuing its contents to be decoded into r/g/b values */
 int image_new(Value th) {
 	if (getTop(th)<2 || !isStr(getLocal(th,1)))
 	{
@@ -18,36 +174,120 @@ int image_new(Value th) {
 		return 1;
 	}
 
-	stbi_set_flip_vertically_on_load(true);
-
-	Value contents = getLocal(th,1);
-	const char* buffer = toStr(contents);
-	int len=getSize(contents);
-	int x, y, comp;
-	char *image = (char*) stbi_load_from_memory((const stbi_uc *)buffer, len, &x, &y, &comp, 0);
-	AuintIdx size = comp * x * y;
-
-	// Allocate buffers and populate header
+	// Allocate an empty image, to be filled in once decoded
 	Value imagev = pushCData(th, aNull, ImageValue, 0, sizeof(ImageHeader));
 	ImageHeader *imghdr = toImageHeader(imagev);
-	imghdr->x = x;
-	imghdr->y = y;
+	imghdr->x = 0;
+	imghdr->y = 0;
 	imghdr->z = 0;
-	imghdr->nbytes = (unsigned char) comp;
+	imghdr->nbytes = 0;
+	imghdr->decoding = 1;
+	imghdr->levels = 1;
+	imghdr->compressed = 0;
 
-	// Give decoded image data to AcornVM instead of copying lots of data into a newly allocated area
-	// AcornVM will free it when done, so we should not do so now
-	strSwapBuffer(th, imagev, image, size);
+	// Copy the contents for a worker, as the string may be collected before it is decoded
+	Value contents = getLocal(th,1);
+	ImageJob *job = (ImageJob *) malloc(sizeof(ImageJob));
+	job->len = getSize(contents);
+	job->data = (unsigned char *) malloc(job->len);
+	memcpy(job->data, toStr(contents), job->len);
+	job->next = NULL;
+	pushGloVar(th, "Image");
+	Value compressv = pushProperty(th, getTop(th) - 1, "compress");
+	job->compress = compressv == aTrue && GLEW_EXT_texture_compression_s3tc;
+	popValue(th);
+	popValue(th);
+
+	if (image_lock == NULL)
+		image_startworkers();
+
+	// Without workers, decode it now
+	if (image_nworkers == 0) {
+		image_decode(job);
+		image_deliver(th, imagev, job);
+		free(job);
+		return 1;
+	}
+
+	// Keep the image alive until delivered, then hand the job to a worker
+	if (image_nfreeslots > 0)
+		job->slot = image_freeslots[--image_nfreeslots];
+	else {
+		job->slot = image_nslots++;
+		image_freeslots = (int *) realloc(image_freeslots, image_nslots*sizeof(int));
+	}
+	arrSet(th, image_decoding, job->slot, imagev);
+	image_npending++;
+	SDL_LockMutex(image_lock);
+	if (image_todotail)
+		image_todotail->next = job;
+	else
+		image_todo = job;
+	image_todotail = job;
+	SDL_CondSignal(image_wake);
+	SDL_UnlockMutex(image_lock);
 	return 1;
 }
 
+/** Deliver every image decoded since the last poll (called by the main loop) */
+void image_poll(Value th) {
+	if (image_npending == 0)
+		return;
+	SDL_LockMutex(image_lock);
+	ImageJob *job = image_done;
+	image_done = NULL;
+	SDL_UnlockMutex(image_lock);
+	while (job) {
+		ImageJob *next = job->next;
+		image_deliver(th, arrGet(th, image_decoding, job->slot), job);
+		arrSet(th, image_decoding, job->slot, aNull);
+		image_freeslots[image_nfreeslots++] = job->slot;
+		image_npending--;
+		free(job);
+		job = next;
+	}
+}
+
+/** Stop the worker threads, abandoning any images not yet decoded */
+void image_close(void) {
+	if (image_lock == NULL)
+		return;
+	SDL_LockMutex(image_lock);
+	image_quitting = true;
+	SDL_CondBroadcast(image_wake);
+	SDL_UnlockMutex(image_lock);
+	for (int i=0; i<image_nworkers; i++)
+		SDL_WaitThread(image_workers[i], NULL);
+	image_nworkers = 0;
+	SDL_DestroyCond(image_wake);
+	SDL_DestroyMutex(image_lock);
+	image_lock = NULL;
+}
+
+/** Return three values: the number of images decoded, their total decoding time
+	and the longest any one took (both in milliseconds) */
+int image_decodestats(Value th) {
+	pushValue(th, anInt(image_ndecoded));
+	pushValue(th, aFloat((Afloat) image_decodems));
+	pushValue(th, aFloat((Afloat) image_longestms));
+	return 3;
+}
+
 /** Initialize Image type and plug into Resource */
 void image_init(Value th) {
-	Value Image = pushType(th, aNull, 2);
+	stbi_set_flip_vertically_on_load(true);
+
+	Value Image = pushType(th, aNull, 5);
 		pushSym(th, "Image");
 		popProperty(th, 0, "_name");
 		pushCMethod(th, image_new);
 		popProperty(th, 0, "New");
+		pushCMethod(th, image_decodestats);
+		popProperty(th, 0, "DecodeStats");
+		pushValue(th, aFalse);
+		popProperty(th, 0, "compress");
+		image_decoding = pushArray(th, aNull, 16);
+		popProperty(th, 0, "_decoding");
 	popGloVar(th, "Image");
 
 	// Register this type as Resource's 'acn' extension
@@ -63,4 +303,4 @@ void image_init(Value th) {
 			popTblSet(th, getTop(th) - 2, "png");
 		popValue(th);
 	popValue(th);
-}
\ No newline at end of file
+}
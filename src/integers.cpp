@@ -8,67 +8,173 @@
 #include "pegasus3d.h"
 #include <stdlib.h>
 
-/** Create a new Buffer with number of integers */
+/** Return the smallest integer member type able to hold every value up to maxval.
+	It is never narrower than 16 bits: integers are mostly drawn as vertex indices,
+	and many GPUs turn 8-bit indices into 16-bit ones on the CPU, draw after draw.
+	Each member type's largest value is kept for -1, the primitive restart index. */
+char integers_type(unsigned int maxval) {
+	return maxval < 0xFFFF? Uint16Nbr : Uint32Nbr;
+}
+
+/** Return the largest value a member type holds (which stands for -1) */
+static unsigned int integers_max(char mbrType) {
+	return mbrType==Uint8Nbr? 0xFFu : mbrType==Uint32Nbr? 0xFFFFFFFFu : 0xFFFFu;
+}
+
+/** Return the largest value a member type must hold to store an integer.
+	A negative integer counts down from the member type's largest value (so -1 is always
+	the largest, the usual primitive restart index), and needs room for its magnitude. */
+static unsigned int integers_need(Aint val) {
+	return val < 0? (unsigned int) -(val+1) : (unsigned int) val;
+}
+
+/** Return the wider of two member types */
+static char integers_wider(char type1, char type2) {
+	return integers_nbrsize(type1) >= integers_nbrsize(type2)? type1 : type2;
+}
+
+/** Return the number of bytes in each integer of the member type */
+AuintIdx integers_nbrsize(char mbrType) {
+	return mbrType==Uint8Nbr? sizeof(GLubyte) : mbrType==Uint32Nbr? sizeof(GLuint) : sizeof(GLushort);
+}
+
+/** Return the OpenGL type matching an integer member type (e.g., for glDrawElements) */
+GLenum integers_gltype(char mbrType) {
+	return mbrType==Uint8Nbr? GL_UNSIGNED_BYTE : mbrType==Uint32Nbr? GL_UNSIGNED_INT : GL_UNSIGNED_SHORT;
+}
+
+/** Read the integer at index i of an array of the member type */
+unsigned int integers_get(const void *ints, char mbrType, AuintIdx i) {
+	switch (mbrType) {
+	case Uint8Nbr: return ((const GLubyte *)ints)[i];
+	case Uint32Nbr: return ((const GLuint *)ints)[i];
+	default: return ((const GLushort *)ints)[i];
+	}
+}
+
+/** Write val as the integer at index i of an array of the member type */
+void integers_put(void *ints, char mbrType, AuintIdx i, unsigned int val) {
+	switch (mbrType) {
+	case Uint8Nbr: ((GLubyte *)ints)[i] = (GLubyte) val; break;
+	case Uint32Nbr: ((GLuint *)ints)[i] = val; break;
+	default: ((GLushort *)ints)[i] = (GLushort) val; break;
+	}
+}
+
+/** Widen every integer in an array to a larger member type, so it can hold bigger values.
+	The old type's largest value (-1, the primitive restart index) becomes the new type's. */
+static void integers_widen(Value th, Value arrv, char mbrType) {
+	ArrayHeader *hdr = toArrayHeader(arrv);
+	AuintIdx n = getSize(arrv) / integers_nbrsize(hdr->mbrType);
+	if (n > 0) {
+		void *ints = malloc(n*integers_nbrsize(mbrType));
+		unsigned int oldmax = integers_max(hdr->mbrType);
+		for (AuintIdx i=0; i<n; i++) {
+			unsigned int val = integers_get(toCData(arrv), hdr->mbrType, i);
+			integers_put(ints, mbrType, i, val==oldmax? integers_max(mbrType) : val);
+		}
+		strSwapBuffer(th, arrv, (char *) ints, n*integers_nbrsize(mbrType));
+		hdr = toArrayHeader(arrv);
+	}
+	hdr->mbrType = mbrType;
+	array_touch(hdr, 0, n*integers_nbrsize(mbrType));
+}
+
+/** Create a new Buffer with number of integers, or with the integers in a text.
+	An optional second parameter is the largest value it will hold, which decides
+	whether integers are stored in 16 or 32 bits. A text's integers are stored as
+	compactly as its largest value allows, but never narrower than that parameter asks.
+	A number of integers gets 16 bits without it. Appending a larger value later widens
+	the storage as needed. A negative integer is stored counting down from the largest
+	value the storage holds. That largest value is -1, the primitive restart index, and
+	stays so when the storage widens; other negatives keep the number they were stored as. */
 int integers_new(Value th) {
 	// Default parameter
 	if (getTop(th)<2)
 		pushValue(th, anInt(32));
 	Value parm1 = getLocal(th, 1);
-
-	AintIdx nStructs = 0;
-	if (isInt(parm1))
-		nStructs = toAint(parm1);
-	else if (isStr(parm1)) {
-		// number of floats is one more than the number of commas
-		const char *scanp = toStr(parm1);
-		while (*scanp) {
-			if (*scanp++==',') 
-				nStructs++;
-		}
-		nStructs++; 
-	}
+	AintIdx nStructs = isInt(parm1)? toAint(parm1) : 0;
+	bool hasmax = getTop(th)>=3 && isInt(getLocal(th, 2));
+	char mbrType = hasmax? integers_type(integers_need(toAint(getLocal(th, 2)))) : Uint16Nbr;
 
 	// Create the integer array
-	Value bufv = pushCData(th, pushProperty(th, 0, "traits"), ArrayValue, nStructs*sizeof(short), sizeof(ArrayHeader));
+	Value bufv = pushCData(th, pushProperty(th, 0, "traits"), ArrayValue, nStructs*integers_nbrsize(mbrType), sizeof(ArrayHeader));
 	ArrayHeader *hdr = toArrayHeader(bufv);
-	hdr->mbrType = Uint16Nbr;
+	hdr->mbrType = mbrType;
 	hdr->structSz = 1;
 	hdr->nStructs = nStructs;
+	array_newgen(hdr);
 
-	// Fill the array with integers converted from ascii
+	// Fill the array with integers converted from ascii in one pass,
+	// handing the filled buffer to AcornVM rather than appending integer by integer.
+	// Every integer after the first needs at least two characters, so the buffer never overflows.
 	if (isStr(parm1)) {
+		AuintIdx len = getSize(parm1);
+		GLuint *ints = (GLuint *) malloc((len/2+1)*sizeof(GLuint));
+		AuintIdx n = 0;
+		GLuint maxval = 0;
 		const char *scanp = toStr(parm1);
-		while (*scanp) {
-			int neg = 0;
-			if (*scanp=='-') {neg = 1; ++scanp;}
-			if (*scanp>='0' && *scanp<='9') {
-				Aint val = 0;
-			    for ( char c; ( c = *scanp ^ '0' ) <= 9; ++scanp ) 
-					val = val * 10 + c;
-				if (neg) val = -val;
-				short ival = val;
-				strAppend(th, bufv, (const char*)(&ival), sizeof(GLshort));
+		const char *endp = scanp + len;
+		while (scanp < endp) {
+			bool neg = false;
+			if (*scanp=='-' && scanp[1]>='0' && scanp[1]<='9') {neg = true; ++scanp;}
+			unsigned int digit = (unsigned char)*scanp - '0';
+			if (digit <= 9) {
+				GLuint val = 0;
+				do {
+					val = val <= (0xFFFFFFFFu - digit) / 10? val*10 + digit : 0xFFFFFFFFu; // saturate
+					digit = (unsigned char)*++scanp - '0';
+				} while (digit <= 9);
+				GLuint need = neg && val>0? val-1 : val;
+				if (need > maxval) maxval = need;
+				ints[n++] = neg? 0u - val : val;
 			}
 			else
 				scanp++;
 		}
+
+		// Narrow the integers in place to the chosen size: each is written no later than it is read
+		mbrType = hasmax? integers_wider(mbrType, integers_type(maxval)) : integers_type(maxval);
+		if (mbrType != Uint32Nbr)
+			for (AuintIdx i=0; i<n; i++)
+				integers_put(ints, mbrType, i, ints[i]);
+		if (n > 0) {
+			ints = (GLuint *) realloc(ints, n*integers_nbrsize(mbrType));
+			strSwapBuffer(th, bufv, (char *) ints, n*integers_nbrsize(mbrType));
+		}
+		else
+			free(ints);
+		hdr = toArrayHeader(bufv);
+		hdr->mbrType = mbrType;
+		hdr->nStructs = n;
 	}
 	return 1;
 }
 
-/* Append a single integer to the end of the array */
+/* Append a single integer to the end of the array, widening its storage if the integer needs it */
 int integers_append(Value th) {
 	if (getTop(th)<2)
 		return 1;
 	Value toadd = getLocal(th,1);
-	if (isInt(toadd)) {
-		short ival = (short) toAint(toadd);
-		strAppend(th, getLocal(th, 0), (const char*)(&ival), sizeof(GLshort));
-	}
+	Aint val;
+	if (isInt(toadd))
+		val = toAint(toadd);
 	else if (isFloat(toadd)) {
-		short ival = (short) toAfloat(toadd);
-		strAppend(th, getLocal(th, 0), (const char*)(&ival), sizeof(GLshort));
+		Afloat f = toAfloat(toadd);
+		val = f >= 2147483647.0f? 0x7FFFFFFF : f <= -2147483648.0f? -0x7FFFFFFF-1 : (Aint) f; // saturate
 	}
+	else
+		return 1;
+	Value arrv = getLocal(th, 0);
+	char mbrType = toArrayHeader(arrv)->mbrType;
+	char needType = integers_type(integers_need(val));
+	if (integers_nbrsize(needType) > integers_nbrsize(mbrType))
+		integers_widen(th, arrv, mbrType = needType);
+	AuintIdx oldsz = getSize(arrv);
+	GLuint ival;
+	integers_put(&ival, mbrType, 0, (unsigned int) val);
+	strAppend(th, arrv, (const char*)(&ival), integers_nbrsize(mbrType));
+	array_touch(toArrayHeader(arrv), oldsz, oldsz+integers_nbrsize(mbrType));
 	return 1;
 }
 
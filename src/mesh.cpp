@@ -0,0 +1,1039 @@
+/** Mesh - binary mesh container, loaded straight into a Shape's number arrays
+ * @file
+ *
+ * A .pmesh file holds a shape's vertex attribute and index streams already in the
+ * form Xyzs, Uvs, Colors and Integers keep them in memory, so loading one needs no
+ * tokenizing or number parsing: each stream is copied in a single block into its array.
+ * All numbers are little-endian:
+ *
+ * - Header (8 bytes): "PMSH", version (uint16, currently 1), number of streams (uint16)
+ * - Stream table: one 32-byte MeshStream entry per stream (see below)
+ * - Stream data: each stream's numbers, starting on a 4-byte boundary
+ *
+ * A stream's name is the shape property it becomes (e.g., "positions", "normals",
+ * "uvs", "indices"). Its mbrType and structSz are those of ArrayHeader.
+ *
+ * Shape's SaveMesh writes a shape's arrays out as a .pmesh file. Mesh stands in for
+ * Resource's 'file' scheme, so that a local .pmesh file is mapped into memory rather
+ * than first read into a string; any other file is handed on to the original scheme.
+ * AcornVM must own (and eventually free) the buffer behind every number array,
+ * so each stream is still copied once, from the mapped pages into its array.
+ *
+ * Also here are Shape's Optimize, which welds and reorders any shape's mesh for faster drawing,
+ * and MakeLods, which simplifies it into coarser levels of detail for drawing at a distance.
+ *
+ * This source file is part of the Pegasus3d browser.
+ * See Copyright Notice in pegasus3d.h
+*/
+
+#include "pegasus3d.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define MESH_VERSION 1
+#define MESH_MAXSTREAMS 16	//!< Most vertex attribute arrays a mesh may have
+
+/** Header at the start of a .pmesh file */
+struct MeshFileHeader {
+	char magic[4];			//!< "PMSH"
+	unsigned short version;	//!< Format version
+	unsigned short nStreams;	//!< Number of entries in the stream table that follows
+};
+
+/** Stream table entry describing one attribute or index stream */
+struct MeshStream {
+	char name[16];			//!< Shape property name, NUL-padded
+	unsigned char mbrType;	//!< ArrayHeader mbrType (PegCDataTypes value)
+	unsigned char structSz;	//!< How many numbers in a structure
+	unsigned short pad;		//!< Zero
+	unsigned int nStructs;	//!< Number of structures in the stream
+	unsigned int offset;	//!< Byte offset of the stream's data from the start of the file
+	unsigned int nbytes;	//!< Number of bytes of stream data
+};
+
+/** Find the type for a stream's numbers and the size of each number,
+	returning NULL for a member type no array type holds */
+static const char *mesh_arraytype(int mbrType, AuintIdx *nbrsz) {
+	switch (mbrType) {
+	case Vec2Value: *nbrsz = sizeof(GLfloat); return "Uvs";
+	case XyzValue: *nbrsz = sizeof(GLfloat); return "Xyzs";
+	case ColorValue: *nbrsz = sizeof(GLfloat); return "Colors";
+	case Uint8Nbr: case Uint16Nbr: case Uint32Nbr: *nbrsz = integers_nbrsize(mbrType); return "Integers";
+	default: return NULL;
+	}
+}
+
+/** Build a new Shape from the .pmesh contents of size bytes at data, pushing it
+	(or null if the contents are not a valid mesh). Each stream is copied into its
+	number array as one block. Returns 1. */
+static int mesh_build(Value th, const char *data, AuintIdx size) {
+	MeshFileHeader head;
+	if (size < sizeof(head)) {
+		pushValue(th, aNull);
+		return 1;
+	}
+	memcpy(&head, data, sizeof(head));
+	if (memcmp(head.magic, "PMSH", 4) != 0 || head.version != MESH_VERSION
+		|| sizeof(head) + head.nStreams*sizeof(MeshStream) > size) {
+		vmLog("Not a valid binary mesh");
+		pushValue(th, aNull);
+		return 1;
+	}
+
+	// Create the shape the streams become properties of
+	pushSym(th, "New");
+	pushGloVar(th, "Shape");
+	getCall(th, 1, 1);
+	int shapeidx = getTop(th) - 1;
+
+	for (unsigned int i=0; i<head.nStreams; i++) {
+		MeshStream strm;
+		memcpy(&strm, data + sizeof(head) + i*sizeof(MeshStream), sizeof(strm));
+		char name[sizeof(strm.name)+1];
+		memcpy(name, strm.name, sizeof(strm.name));
+		name[sizeof(strm.name)] = '\0';
+
+		// Skip any stream whose numbers are not what its description claims
+		AuintIdx nbrsz;
+		const char *typname = mesh_arraytype(strm.mbrType, &nbrsz);
+		if (typname == NULL || strm.structSz == 0 || strm.offset > size || strm.nbytes > size - strm.offset
+			|| strm.nbytes != (unsigned long long) strm.nStructs * strm.structSz * nbrsz) {
+			vmLog("Skipping malformed binary mesh stream %s", name);
+			continue;
+		}
+
+		// Create the number array and copy the whole stream into it at once
+		pushGloVar(th, typname);
+		Value traits = pushProperty(th, getTop(th) - 1, "traits");
+		Value bufv = pushCData(th, traits, ArrayValue, strm.nbytes, sizeof(ArrayHeader));
+		ArrayHeader *hdr = toArrayHeader(bufv);
+		hdr->mbrType = strm.mbrType;
+		hdr->structSz = strm.structSz;
+		hdr->nStructs = strm.nStructs;
+		array_newgen(hdr);
+		strAppend(th, bufv, data + strm.offset, strm.nbytes);
+		popProperty(th, shapeidx, name);
+		popValue(th); // traits
+		popValue(th); // array type
+	}
+	return 1;
+}
+
+/** Create a new Shape from the contents of a .pmesh resource.
+	A local file's Shape has already been built by mapping it (see mesh_fileget), and is returned as is. */
+int mesh_new(Value th) {
+	if (getTop(th)>=2 && isType(getLocal(th,1))) {
+		pushValue(th, getLocal(th,1));
+		return 1;
+	}
+	if (getTop(th)<2 || !isStr(getLocal(th,1))) {
+		pushValue(th, aNull);
+		return 1;
+	}
+	Value contents = getLocal(th, 1);
+	return mesh_build(th, toStr(contents), getSize(contents));
+}
+
+/** Get the file path of a path or file:// url, or NULL if it names a remote resource */
+static const char *mesh_localpath(const char *url) {
+	if (strncmp(url, "file://", 7) == 0)
+		return url + 7;
+	return strstr(url, "://")? NULL : url;
+}
+
+/** Push a new Shape built from the local .pmesh file at path (or null if it cannot be),
+	mapping the file into memory rather than reading it, so that its streams are copied
+	only once: from the file's pages into their number arrays. */
+static void mesh_mapfile(Value th, const char *path) {
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		vmLog("Cannot open mesh file %s", path);
+		pushValue(th, aNull);
+		return;
+	}
+	AuintIdx size = (AuintIdx) GetFileSize(file, NULL);
+	HANDLE mapping = size? CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+	const char *data = mapping? (const char *) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+	if (data == NULL) {
+		vmLog("Cannot map mesh file %s", path);
+		pushValue(th, aNull);
+	}
+	else {
+		mesh_build(th, data, size);
+		UnmapViewOfFile(data);
+	}
+	if (mapping)
+		CloseHandle(mapping);
+	CloseHandle(file);
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		vmLog("Cannot open mesh file %s", path);
+		pushValue(th, aNull);
+		return;
+	}
+	struct stat st;
+	AuintIdx size = fstat(fd, &st) == 0? (AuintIdx) st.st_size : 0;
+	void *data = size? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (data == MAP_FAILED) {
+		vmLog("Cannot map mesh file %s", path);
+		pushValue(th, aNull);
+		return;
+	}
+	mesh_build(th, (const char *) data, size);
+	munmap(data, size);
+#endif
+}
+
+/** Create a new Shape from a local .pmesh file (a path or file:// url), by mapping it */
+int mesh_map(Value th) {
+	if (getTop(th)<2 || !isStr(getLocal(th,1))) {
+		pushValue(th, aNull);
+		return 1;
+	}
+	const char *path = mesh_localpath(toStr(getLocal(th, 1)));
+	if (path == NULL) {
+		vmLog("Only local meshes can be mapped: %s", toStr(getLocal(th, 1)));
+		pushValue(th, aNull);
+		return 1;
+	}
+	mesh_mapfile(th, path);
+	return 1;
+}
+
+/** 'Get' for Resource's 'file' scheme: map a .pmesh file into a new Shape, passing it
+	to the callback (and on to Mesh.New) in place of the file's contents.
+	Any other file is got by the scheme Mesh stands in for. */
+int mesh_fileget(Value th) {
+	int nparms = getTop(th);
+	Value urlv = nparms>1? getLocal(th, 1) : aNull;
+	const char *url = isStr(urlv) || isSym(urlv)? toStr(urlv) : "";
+	size_t len = strlen(url);
+	const char *path = mesh_localpath(url);
+	if (len < 6 || strcmp(url + len - 6, ".pmesh") != 0 || path == NULL) {
+		pushSym(th, "Get");
+		if (pushProperty(th, 0, "_files") == aNull) {
+			vmLog("No file scheme to get %s", url);
+			return 0;
+		}
+		for (int i=1; i<nparms; i++)
+			pushValue(th, getLocal(th, i));
+		getCall(th, nparms, 1);
+		return 1;
+	}
+
+	mesh_mapfile(th, path);
+	Value shape = getFromTop(th, 0);
+	if (nparms > 2) {
+		pushValue(th, getLocal(th, 2));
+		pushValue(th, aNull);
+		pushValue(th, shape);
+		getCall(th, 2, 0);
+	}
+	return 1;
+}
+
+#define MESH_CACHESIZE 32		//!< Vertex cache size the triangle reordering scores against
+#define MESH_FIFOSIZE 16		//!< FIFO vertex cache size ACMR is measured against
+
+/** Average cache miss ratio: vertices transformed per triangle drawn, for a FIFO vertex cache
+	of cachesz entries (0.5 is ideal for a large grid, 3.0 is as bad as it gets) */
+static GLfloat mesh_acmr(const GLuint *indices, AuintIdx nindices, AuintIdx nverts, int cachesz) {
+	if (nindices < 3)
+		return 0.0f;
+	unsigned int *stamp = (unsigned int *) calloc(nverts, sizeof(unsigned int));
+	unsigned int misses = 0;
+	for (AuintIdx i=0; i<nindices; i++) {
+		// A vertex is in the cache if it was loaded within the last cachesz misses
+		GLuint v = indices[i];
+		if (stamp[v] == 0 || misses - stamp[v] + 1 > (unsigned int) cachesz)
+			stamp[v] = ++misses;
+	}
+	free(stamp);
+	return (GLfloat) misses / (GLfloat) (nindices/3);
+}
+
+/** Weld vertices whose bytes are identical in every attribute stream.
+	Fills remap with each vertex's new number, returning how many distinct vertices remain. */
+static AuintIdx mesh_weld(const char **streams, const AuintIdx *vsz, int nstreams, AuintIdx nverts, GLuint *remap) {
+	// Open-addressed hash table of first occurrences, at most half full
+	AuintIdx tblsz = 16;
+	while (tblsz < 2*nverts)
+		tblsz <<= 1;
+	GLuint *table = (GLuint *) malloc(tblsz*sizeof(GLuint));
+	memset(table, 0xFF, tblsz*sizeof(GLuint));
+	GLuint *newid = (GLuint *) malloc(nverts*sizeof(GLuint)); // New number of each first occurrence
+	AuintIdx nunique = 0;
+	for (AuintIdx v=0; v<nverts; v++) {
+		// FNV-1a hash over all of the vertex's attributes
+		unsigned int hash = 2166136261u;
+		for (int s=0; s<nstreams; s++) {
+			const unsigned char *p = (const unsigned char *) streams[s] + v*vsz[s];
+			for (AuintIdx b=0; b<vsz[s]; b++)
+				hash = (hash ^ p[b]) * 16777619u;
+		}
+
+		// Probe for an identical earlier vertex
+		AuintIdx slot = hash & (tblsz-1);
+		for (;;) {
+			GLuint other = table[slot];
+			if (other == 0xFFFFFFFF) {
+				table[slot] = v;
+				newid[v] = remap[v] = nunique++;
+				break;
+			}
+			int s;
+			for (s=0; s<nstreams; s++)
+				if (memcmp(streams[s] + v*vsz[s], streams[s] + other*vsz[s], vsz[s]))
+					break;
+			if (s == nstreams) {
+				remap[v] = newid[other];
+				break;
+			}
+			slot = (slot+1) & (tblsz-1);
+		}
+	}
+	free(newid);
+	free(table);
+	return nunique;
+}
+
+/** Score a vertex for triangle reordering, by its position in the simulated cache (-1 if absent)
+	and how many of its triangles are not yet drawn (Tom Forsyth's linear-speed vertex cache optimization) */
+static GLfloat mesh_vertscore(int cachepos, unsigned int remaining) {
+	if (remaining == 0)
+		return -1.0f;
+	GLfloat score = 0.0f;
+	if (cachepos >= 0) {
+		// The last triangle's vertices score the same, so it matters not which way it is drawn
+		if (cachepos < 3)
+			score = 0.75f;
+		else
+			score = pow(1.0f - (GLfloat)(cachepos-3) / (GLfloat)(MESH_CACHESIZE-3), 1.5f);
+	}
+	// Favor vertices with few triangles left, so lone triangles do not linger
+	return score + 2.0f / sqrt((GLfloat) remaining);
+}
+
+/** Reorder triangles so that each reuses as many recently transformed vertices as possible */
+static void mesh_reorder(const GLuint *indices, AuintIdx nindices, AuintIdx nverts, GLuint *out) {
+	AuintIdx ntris = nindices/3;
+
+	// Each vertex's triangles not yet drawn, as a slice of one shared array
+	unsigned int *remaining = (unsigned int *) calloc(nverts, sizeof(unsigned int));
+	AuintIdx *first = (AuintIdx *) malloc((nverts+1)*sizeof(AuintIdx));
+	AuintIdx *vtris = (AuintIdx *) malloc(3*ntris*sizeof(AuintIdx));
+	for (AuintIdx i=0; i<3*ntris; i++)
+		remaining[indices[i]]++;
+	first[0] = 0;
+	for (AuintIdx v=0; v<nverts; v++)
+		first[v+1] = first[v] + remaining[v];
+	unsigned int *filled = (unsigned int *) calloc(nverts, sizeof(unsigned int));
+	for (AuintIdx t=0; t<ntris; t++)
+		for (int c=0; c<3; c++) {
+			GLuint v = indices[3*t+c];
+			vtris[first[v] + filled[v]++] = t;
+		}
+	free(filled);
+
+	// Initial scores
+	int *cachepos = (int *) malloc(nverts*sizeof(int));
+	GLfloat *vscore = (GLfloat *) malloc(nverts*sizeof(GLfloat));
+	for (AuintIdx v=0; v<nverts; v++) {
+		cachepos[v] = -1;
+		vscore[v] = mesh_vertscore(-1, remaining[v]);
+	}
+	GLfloat *tscore = (GLfloat *) malloc(ntris*sizeof(GLfloat));
+	bool *drawn = (bool *) calloc(ntris, sizeof(bool));
+	for (AuintIdx t=0; t<ntris; t++)
+		tscore[t] = vscore[indices[3*t]] + vscore[indices[3*t+1]] + vscore[indices[3*t+2]];
+
+	GLuint cache[MESH_CACHESIZE+3];
+	int ncache = 0;
+	AuintIdx nextscan = 0;	// Triangles before this have all been drawn
+	AuintIdx best = 0;
+	GLfloat bestscore = -1.0f;
+	for (AuintIdx t=0; t<ntris; t++)
+		if (tscore[t] > bestscore) {bestscore = tscore[t]; best = t;}
+
+	for (AuintIdx n=0; n<ntris; n++) {
+		// Nothing in the cache worth drawing: start anew with the next undrawn triangle
+		if (bestscore < 0.0f) {
+			while (drawn[nextscan])
+				nextscan++;
+			best = nextscan;
+		}
+
+		// Draw the best triangle, removing it from its vertices' undrawn triangles
+		drawn[best] = true;
+		GLuint tv[3];
+		for (int c=0; c<3; c++) {
+			GLuint v = tv[c] = out[3*n+c] = indices[3*best+c];
+			AuintIdx *tris = &vtris[first[v]];
+			for (unsigned int i=0; i<remaining[v]; i++)
+				if (tris[i] == best) {
+					tris[i] = tris[--remaining[v]];
+					break;
+				}
+		}
+
+		// Move its vertices to the front of the cache, pushing the rest back
+		GLuint newcache[MESH_CACHESIZE+3];
+		int nnew = 0;
+		for (int c=0; c<3; c++)
+			newcache[nnew++] = tv[c];
+		for (int i=0; i<ncache; i++)
+			if (cache[i] != tv[0] && cache[i] != tv[1] && cache[i] != tv[2])
+				newcache[nnew++] = cache[i];
+
+		// Rescore the cache's vertices (and any pushed out), then their undrawn triangles
+		for (int i=0; i<nnew; i++) {
+			GLuint v = newcache[i];
+			cachepos[v] = i < MESH_CACHESIZE? i : -1;
+			vscore[v] = mesh_vertscore(cachepos[v], remaining[v]);
+		}
+		bestscore = -1.0f;
+		for (int i=0; i<nnew; i++) {
+			GLuint v = newcache[i];
+			AuintIdx *tris = &vtris[first[v]];
+			for (unsigned int j=0; j<remaining[v]; j++) {
+				AuintIdx t = tris[j];
+				tscore[t] = vscore[indices[3*t]] + vscore[indices[3*t+1]] + vscore[indices[3*t+2]];
+				if (tscore[t] > bestscore) {bestscore = tscore[t]; best = t;}
+			}
+		}
+		ncache = nnew < MESH_CACHESIZE? nnew : MESH_CACHESIZE;
+		memcpy(cache, newcache, ncache*sizeof(GLuint));
+	}
+
+	free(drawn);
+	free(tscore);
+	free(vscore);
+	free(cachepos);
+	free(vtris);
+	free(first);
+	free(remaining);
+}
+
+/** Vertex attributes always considered for welding, beyond those the shader names */
+static const char *mesh_attrnames[] = {"positions", "normals", "uvs", "colors"};
+
+/** Gather a shape's distinct vertex attribute arrays: the usual ones and any its shader names,
+	along with (if names is not NULL) the property name each was found under. Returns how many. */
+static int mesh_attrarrays(Value th, int selfidx, Value *streams, const char **names) {
+	int nstreams = 0;
+	int nnames = sizeof(mesh_attrnames)/sizeof(mesh_attrnames[0]);
+	Value shader = pushProperty(th, selfidx, "shader");
+	popValue(th);
+	Value attrlist = aNull;
+	if (shader != aNull) {
+		Value vertattsym = pushSym(th, "attributes");
+		attrlist = getProperty(th, shader, vertattsym);
+		popValue(th); // symbol
+	}
+	int nattrs = isArr(attrlist)? getSize(attrlist) : 0;
+	for (int i=0; i<nnames+nattrs && nstreams<MESH_MAXSTREAMS; i++) {
+		Value arrv;
+		const char *name;
+		if (i < nnames) {
+			name = mesh_attrnames[i];
+			arrv = pushProperty(th, selfidx, name);
+			popValue(th);
+		}
+		else {
+			Value attrsym = arrGet(th, attrlist, i-nnames);
+			name = toStr(attrsym);
+			arrv = getProperty(th, getLocal(th, selfidx), attrsym);
+		}
+		if (!isCDataType(arrv, ArrayValue))
+			continue;
+		int s;
+		for (s=0; s<nstreams && streams[s]!=arrv; s++);
+		if (s == nstreams) {
+			if (names)
+				names[nstreams] = name;
+			streams[nstreams++] = arrv;
+		}
+	}
+	return nstreams;
+}
+
+/** Renumber the vertices of every level of detail index array, using remap to map each original
+	vertex to its welded one and newnum each welded vertex to its final one.
+	Returns false if some level uses a vertex the optimized mesh no longer has. */
+static bool mesh_remaplods(Value th, Value lods, AuintIdx nverts, const GLuint *remap, const GLuint *newnum, char indxtype) {
+	AuintIdx nlods = getSize(lods);
+	for (AuintIdx l=0; l<nlods; l++) {
+		Value lodv = arrGet(th, lods, l);
+		if (!isCDataType(lodv, ArrayValue))
+			return false;
+		ArrayHeader *hdr = toArrayHeader(lodv);
+		AuintIdx n = getSize(lodv) / integers_nbrsize(hdr->mbrType);
+		if (hdr->nStructs < n)
+			n = hdr->nStructs;
+		void *indx = malloc(n>0? n*integers_nbrsize(indxtype) : 1);
+		for (AuintIdx i=0; i<n; i++) {
+			GLuint v = integers_get(toCData(lodv), hdr->mbrType, i);
+			if (v >= nverts || newnum[remap[v]] == 0xFFFFFFFF) {
+				free(indx);
+				return false;
+			}
+			integers_put(indx, indxtype, i, newnum[remap[v]]);
+		}
+		strSwapBuffer(th, lodv, (char *) indx, n*integers_nbrsize(indxtype));
+		hdr = toArrayHeader(lodv);
+		hdr->mbrType = indxtype;
+		hdr->nStructs = n;
+		array_touch(hdr, 0, n*integers_nbrsize(indxtype));
+	}
+	return true;
+}
+
+/** Optimize a shape's triangle mesh for drawing: weld vertices identical in every attribute,
+	reorder triangles for the post-transform vertex cache, then renumber vertices in the order
+	they are first drawn, for fetch locality. Run it after loading (or before SaveMesh).
+	Any levels of detail from MakeLods are renumbered to match, or set to null if some
+	level uses a vertex the full mesh does not draw (so MakeLods needs running again).
+	Returns a List of the average cache miss ratio (ACMR) before and after, or null if not possible. */
+int mesh_optimize(Value th) {
+	int selfidx = 0;
+	Value drawprop = pushGetActProp(th, selfidx, "_draw");
+	popValue(th);
+	if (isInt(drawprop) && toAint(drawprop) != GL_TRIANGLES) {
+		pushValue(th, aNull);
+		return 1;
+	}
+
+	// Gather the distinct vertex attribute arrays: the usual ones and any the shader names
+	Value streams[MESH_MAXSTREAMS];
+	int nstreams = mesh_attrarrays(th, selfidx, streams, NULL);
+	if (nstreams == 0) {
+		pushValue(th, aNull);
+		return 1;
+	}
+
+	// Vertices are those every attribute has
+	const char *data[MESH_MAXSTREAMS];
+	AuintIdx vsz[MESH_MAXSTREAMS];
+	AuintIdx nverts = 0;
+	for (int s=0; s<nstreams; s++) {
+		ArrayHeader *hdr = toArrayHeader(streams[s]);
+		data[s] = (const char *) toCData(streams[s]);
+		vsz[s] = array_structsize(hdr->mbrType, hdr->structSz);
+		AuintIdx n = vsz[s]? getSize(streams[s]) / vsz[s] : 0;
+		if (hdr->nStructs < n)
+			n = hdr->nStructs;
+		if (s == 0 || n < nverts)
+			nverts = n;
+	}
+
+	// Get the indices as 32-bit numbers (numbering the vertices in order if the shape has none)
+	Value indicesv = pushProperty(th, selfidx, "indices");
+	popValue(th);
+	bool hasindices = isCDataType(indicesv, ArrayValue);
+	AuintIdx nindices = hasindices? toArrayHeader(indicesv)->nStructs : nverts;
+	if (hasindices && getSize(indicesv) / integers_nbrsize(toArrayHeader(indicesv)->mbrType) < nindices)
+		nindices = getSize(indicesv) / integers_nbrsize(toArrayHeader(indicesv)->mbrType);
+	nindices -= nindices % 3;
+	if (nindices == 0 || nverts == 0) {
+		pushValue(th, aNull);
+		return 1;
+	}
+	GLuint *indices = (GLuint *) malloc(nindices*sizeof(GLuint));
+	for (AuintIdx i=0; i<nindices; i++) {
+		indices[i] = hasindices? integers_get(toCData(indicesv), toArrayHeader(indicesv)->mbrType, i) : i;
+		if (indices[i] >= nverts) {
+			vmLog("Cannot optimize a shape whose indices exceed its vertices");
+			free(indices);
+			pushValue(th, aNull);
+			return 1;
+		}
+	}
+	GLfloat acmrbefore = mesh_acmr(indices, nindices, nverts, MESH_FIFOSIZE);
+
+	// Weld, then reorder triangles
+	GLuint *remap = (GLuint *) malloc(nverts*sizeof(GLuint));
+	AuintIdx nwelded = mesh_weld(data, vsz, nstreams, nverts, remap);
+	for (AuintIdx i=0; i<nindices; i++)
+		indices[i] = remap[indices[i]];
+	GLuint *reordered = (GLuint *) malloc(nindices*sizeof(GLuint));
+	mesh_reorder(indices, nindices, nwelded, reordered);
+
+	// Renumber vertices in the order first drawn, remembering an original vertex for each
+	GLuint *source = (GLuint *) malloc(nwelded*sizeof(GLuint));
+	for (AuintIdx v=nverts; v-- > 0; )
+		source[remap[v]] = v;
+	GLuint *newnum = (GLuint *) malloc(nwelded*sizeof(GLuint)); // Welded vertex's final number
+	memset(newnum, 0xFF, nwelded*sizeof(GLuint));
+	GLuint *order = indices; // Reuse: final vertex's original vertex
+	AuintIdx nfinal = 0;
+	for (AuintIdx i=0; i<nindices; i++) {
+		GLuint w = reordered[i];
+		if (newnum[w] == 0xFFFFFFFF) {
+			newnum[w] = nfinal;
+			order[nfinal++] = source[w];
+		}
+		reordered[i] = newnum[w];
+	}
+	GLfloat acmrafter = mesh_acmr(reordered, nindices, nfinal, MESH_FIFOSIZE);
+
+	// Rebuild every attribute array in the new vertex order
+	for (int s=0; s<nstreams; s++) {
+		char *buf = (char *) malloc(nfinal*vsz[s]);
+		const char *from = (const char *) toCData(streams[s]);
+		for (AuintIdx v=0; v<nfinal; v++)
+			memcpy(buf + v*vsz[s], from + order[v]*vsz[s], vsz[s]);
+		strSwapBuffer(th, streams[s], buf, nfinal*vsz[s]);
+		ArrayHeader *hdr = toArrayHeader(streams[s]);
+		hdr->nStructs = nfinal;
+		array_touch(hdr, 0, nfinal*vsz[s]);
+	}
+
+	// Store the indices as compactly as the vertex count allows
+	char indxtype = integers_type(nfinal-1);
+	void *indx = malloc(nindices*integers_nbrsize(indxtype));
+	for (AuintIdx i=0; i<nindices; i++)
+		integers_put(indx, indxtype, i, reordered[i]);
+	if (hasindices) {
+		strSwapBuffer(th, indicesv, (char *) indx, nindices*integers_nbrsize(indxtype));
+		ArrayHeader *hdr = toArrayHeader(indicesv);
+		hdr->mbrType = indxtype;
+		hdr->nStructs = nindices;
+		array_touch(hdr, 0, nindices*integers_nbrsize(indxtype));
+	}
+	else {
+		array_adopt(th, "Integers", indxtype, 1, nindices, indx);
+		popProperty(th, selfidx, "indices");
+	}
+
+	// Levels of detail share the vertices, so renumber them the same way
+	Value lods = pushProperty(th, selfidx, "lods");
+	popValue(th);
+	if (isArr(lods) && !mesh_remaplods(th, lods, nverts, remap, newnum, indxtype)) {
+		pushValue(th, aNull);
+		popProperty(th, selfidx, "lods");
+	}
+	free(newnum);
+	free(source);
+	free(reordered);
+	free(remap);
+	free(indices);
+
+	Value result = pushArray(th, aNull, 2);
+	arrSet(th, result, 0, aFloat(acmrbefore));
+	arrSet(th, result, 1, aFloat(acmrafter));
+	return 1;
+}
+
+/** Symmetric 4x4 matrix summing the squared distances to a set of planes (a quadric error metric) */
+struct MeshQuadric {
+	double a2, ab, ac, ad, b2, bc, bd, c2, cd, d2;
+};
+
+/** A candidate collapse of one vertex onto another along an edge */
+struct MeshCollapse {
+	GLfloat cost;	//!< Quadric error introduced by the collapse
+	GLuint from;	//!< Vertex that goes away
+	GLuint to;		//!< Vertex it merges into
+};
+
+/** Add a weighted plane (a, b, c, d: ax+by+cz+d=0) to a quadric */
+static void mesh_addplane(MeshQuadric *q, double a, double b, double c, double d, double w) {
+	q->a2 += w*a*a; q->ab += w*a*b; q->ac += w*a*c; q->ad += w*a*d;
+	q->b2 += w*b*b; q->bc += w*b*c; q->bd += w*b*d;
+	q->c2 += w*c*c; q->cd += w*c*d; q->d2 += w*d*d;
+}
+
+/** Sum of the squared distances from a point to the planes of two quadrics */
+static GLfloat mesh_quadricerror(const MeshQuadric *q1, const MeshQuadric *q2, const Xyz *p) {
+	double x = p->x, y = p->y, z = p->z;
+	double err = 0.0;
+	for (int i=0; i<2; i++) {
+		const MeshQuadric *q = i==0? q1 : q2;
+		err += q->a2*x*x + 2*q->ab*x*y + 2*q->ac*x*z + 2*q->ad*x
+			+ q->b2*y*y + 2*q->bc*y*z + 2*q->bd*y
+			+ q->c2*z*z + 2*q->cd*z + q->d2;
+	}
+	return (GLfloat) (err < 0.0? 0.0 : err);
+}
+
+/** Compare two collapses' costs, for qsort */
+static int mesh_collapsecmp(const void *a, const void *b) {
+	GLfloat costa = ((const MeshCollapse *)a)->cost;
+	GLfloat costb = ((const MeshCollapse *)b)->cost;
+	return costa < costb? -1 : costa > costb? 1 : 0;
+}
+
+/** Compare two edge keys, for qsort */
+static int mesh_edgecmp(const void *a, const void *b) {
+	unsigned long long edgea = *(const unsigned long long *)a;
+	unsigned long long edgeb = *(const unsigned long long *)b;
+	return edgea < edgeb? -1 : edgea > edgeb? 1 : 0;
+}
+
+/** Unnormalized normal of the triangle p0, p1, p2 */
+static void mesh_trinormal(Xyz *n, const Xyz *p0, const Xyz *p1, const Xyz *p2) {
+	Xyz e1 = {p1->x-p0->x, p1->y-p0->y, p1->z-p0->z};
+	Xyz e2 = {p2->x-p0->x, p2->y-p0->y, p2->z-p0->z};
+	n->x = e1.y*e2.z - e1.z*e2.y;
+	n->y = e1.z*e2.x - e1.x*e2.z;
+	n->z = e1.x*e2.y - e1.y*e2.x;
+}
+
+/** Simplify a triangle list towards target triangles by collapsing edges, cheapest first,
+	where cost is the quadric error (Garland-Heckbert) of the merged vertex. Each collapse merges
+	one vertex into another, so the vertices themselves are untouched and every level of detail
+	can share them. Vertices on open edges (including uv and normal seams) never move, so no
+	cracks open. Writes the simplified indices to out, returning how many there are. */
+static AuintIdx mesh_simplify(const Xyz *pos, AuintIdx nverts, const GLuint *indices, AuintIdx nindices, AuintIdx target, GLuint *out) {
+	memcpy(out, indices, nindices*sizeof(GLuint));
+	AuintIdx ntris = nindices/3;
+
+	// Each vertex's quadric sums the planes of its triangles, weighted by area
+	MeshQuadric *quadrics = (MeshQuadric *) calloc(nverts, sizeof(MeshQuadric));
+	for (AuintIdx t=0; t<ntris; t++) {
+		const Xyz *p0 = &pos[out[3*t]];
+		Xyz n;
+		mesh_trinormal(&n, p0, &pos[out[3*t+1]], &pos[out[3*t+2]]);
+		double len = sqrt((double)n.x*n.x + (double)n.y*n.y + (double)n.z*n.z);
+		if (len == 0.0)
+			continue;
+		double a = n.x/len, b = n.y/len, c = n.z/len;
+		double d = -(a*p0->x + b*p0->y + c*p0->z);
+		for (int k=0; k<3; k++)
+			mesh_addplane(&quadrics[out[3*t+k]], a, b, c, d, 0.5*len);
+	}
+
+	// Lock vertices on any edge used by only one triangle
+	bool *locked = (bool *) calloc(nverts, sizeof(bool));
+	unsigned long long *edges = (unsigned long long *) malloc(3*ntris*sizeof(unsigned long long));
+	for (AuintIdx t=0; t<ntris; t++)
+		for (int k=0; k<3; k++) {
+			unsigned long long a = out[3*t+k], b = out[3*t+(k+1)%3];
+			edges[3*t+k] = a<b? (a<<32)|b : (b<<32)|a;
+		}
+	qsort(edges, 3*ntris, sizeof(unsigned long long), mesh_edgecmp);
+	for (AuintIdx i=0; i<3*ntris; ) {
+		AuintIdx j = i+1;
+		while (j<3*ntris && edges[j]==edges[i])
+			j++;
+		if (j-i == 1)
+			locked[edges[i]>>32] = locked[edges[i]&0xFFFFFFFF] = true;
+		i = j;
+	}
+	free(edges);
+
+	// Collapse in passes, each applying the cheapest collapses that do not interfere
+	GLuint *remap = (GLuint *) malloc(nverts*sizeof(GLuint));
+	for (AuintIdx v=0; v<nverts; v++)
+		remap[v] = v;
+	bool *touched = (bool *) malloc(nverts*sizeof(bool));
+	AuintIdx *first = (AuintIdx *) malloc((nverts+1)*sizeof(AuintIdx));
+	AuintIdx *vtris = (AuintIdx *) malloc(3*ntris*sizeof(AuintIdx));
+	MeshCollapse *collapses = (MeshCollapse *) malloc(6*ntris*sizeof(MeshCollapse));
+	while (ntris > target) {
+		// Each vertex's triangles
+		memset(first, 0, (nverts+1)*sizeof(AuintIdx));
+		for (AuintIdx i=0; i<3*ntris; i++)
+			first[out[i]+1]++;
+		for (AuintIdx v=0; v<nverts; v++)
+			first[v+1] += first[v];
+		for (AuintIdx t=0; t<ntris; t++)
+			for (int k=0; k<3; k++)
+				vtris[first[out[3*t+k]]++] = t;
+		for (AuintIdx v=nverts; v>0; v--)
+			first[v] = first[v-1];
+		first[0] = 0;
+
+		// Cost every collapse along every edge, in both directions
+		AuintIdx ncollapses = 0;
+		for (AuintIdx t=0; t<ntris; t++)
+			for (int k=0; k<3; k++) {
+				GLuint a = out[3*t+k], b = out[3*t+(k+1)%3];
+				if (!locked[a]) {
+					MeshCollapse *c = &collapses[ncollapses++];
+					c->from = a; c->to = b;
+					c->cost = mesh_quadricerror(&quadrics[a], &quadrics[b], &pos[b]);
+				}
+				if (!locked[b]) {
+					MeshCollapse *c = &collapses[ncollapses++];
+					c->from = b; c->to = a;
+					c->cost = mesh_quadricerror(&quadrics[a], &quadrics[b], &pos[a]);
+				}
+			}
+		qsort(collapses, ncollapses, sizeof(MeshCollapse), mesh_collapsecmp);
+
+		// Apply the cheapest, skipping any near an earlier one this pass or that would flip a triangle
+		memset(touched, 0, nverts*sizeof(bool));
+		AuintIdx removed = 0;
+		for (AuintIdx i=0; i<ncollapses && ntris-removed > target; i++) {
+			GLuint from = collapses[i].from, to = collapses[i].to;
+			if (touched[from] || touched[to])
+				continue;
+			bool flips = false;
+			AuintIdx vanish = 0;
+			for (AuintIdx j=first[from]; j<first[from+1] && !flips; j++) {
+				const GLuint *tri = &out[3*vtris[j]];
+				if (tri[0]==to || tri[1]==to || tri[2]==to) {
+					vanish++;
+					continue;
+				}
+				Xyz before, after;
+				Xyz p[3];
+				for (int k=0; k<3; k++)
+					p[k] = pos[tri[k]];
+				mesh_trinormal(&before, &p[0], &p[1], &p[2]);
+				for (int k=0; k<3; k++)
+					if (tri[k]==from)
+						p[k] = pos[to];
+				mesh_trinormal(&after, &p[0], &p[1], &p[2]);
+				flips = before.x*after.x + before.y*after.y + before.z*after.z <= 0.0f;
+			}
+			if (flips || vanish == 0)
+				continue;
+
+			// Collapse, keeping this pass's other collapses away from the triangles it changes
+			remap[from] = to;
+			MeshQuadric *qf = &quadrics[from], *qt = &quadrics[to];
+			qt->a2 += qf->a2; qt->ab += qf->ab; qt->ac += qf->ac; qt->ad += qf->ad;
+			qt->b2 += qf->b2; qt->bc += qf->bc; qt->bd += qf->bd;
+			qt->c2 += qf->c2; qt->cd += qf->cd; qt->d2 += qf->d2;
+			for (AuintIdx j=first[from]; j<first[from+1]; j++)
+				for (int k=0; k<3; k++)
+					touched[out[3*vtris[j]+k]] = true;
+			removed += vanish;
+		}
+		if (removed == 0)
+			break;
+
+		// Rewrite the indices, dropping triangles that collapsed away
+		AuintIdx kept = 0;
+		for (AuintIdx t=0; t<ntris; t++) {
+			GLuint a = remap[out[3*t]], b = remap[out[3*t+1]], c = remap[out[3*t+2]];
+			if (a==b || b==c || a==c)
+				continue;
+			out[3*kept] = a; out[3*kept+1] = b; out[3*kept+2] = c;
+			kept++;
+		}
+		ntris = kept;
+	}
+
+	free(collapses);
+	free(vtris);
+	free(first);
+	free(touched);
+	free(remap);
+	free(locked);
+	free(quadrics);
+	return 3*ntris;
+}
+
+#define MESH_MAXLODS 8		//!< Most levels of detail MakeLods generates
+
+/** Generate coarser levels of detail for a triangle-list shape: a List of Integers index arrays,
+	each with about half the triangles of the one before, sharing the shape's vertices.
+	The optional parameter is how many levels to make (default 3); fewer are made once the
+	mesh stops simplifying. The list is stored as the shape's "lods" and returned (null if not possible).
+	Optimize keeps the levels in step with its vertex renumbering (or drops them, if it cannot). */
+int mesh_makelods(Value th) {
+	int selfidx = 0;
+	int nlevels = getTop(th)>=2 && isInt(getLocal(th, 1))? toAint(getLocal(th, 1)) : 3;
+	if (nlevels > MESH_MAXLODS)
+		nlevels = MESH_MAXLODS;
+	Value drawprop = pushGetActProp(th, selfidx, "_draw");
+	popValue(th);
+	Value positions = pushProperty(th, selfidx, "positions");
+	popValue(th);
+	Value indicesv = pushProperty(th, selfidx, "indices");
+	popValue(th);
+	if ((isInt(drawprop) && toAint(drawprop) != GL_TRIANGLES) || nlevels < 1
+		|| !isCDataType(positions, ArrayValue) || !isCDataType(indicesv, ArrayValue)
+		|| (toArrayHeader(positions)->mbrType != XyzValue && toArrayHeader(positions)->mbrType != HalfNbr)) {
+		pushValue(th, aNull);
+		return 1;
+	}
+
+	// Get positions as floats and indices as 32-bit numbers
+	ArrayHeader *poshdr = toArrayHeader(positions);
+	AuintIdx nverts = getSize(positions) / array_structsize(poshdr->mbrType, 3);
+	Xyz *pos = (Xyz *) malloc(nverts*sizeof(Xyz));
+	if (poshdr->mbrType == HalfNbr) {
+		const GLushort *halfs = (const GLushort *) toCData(positions);
+		for (AuintIdx v=0; v<nverts; v++) {
+			pos[v].x = array_fromhalf(halfs[3*v]);
+			pos[v].y = array_fromhalf(halfs[3*v+1]);
+			pos[v].z = array_fromhalf(halfs[3*v+2]);
+		}
+	}
+	else
+		memcpy(pos, toCData(positions), nverts*sizeof(Xyz));
+	ArrayHeader *indxhdr = toArrayHeader(indicesv);
+	AuintIdx nindices = getSize(indicesv) / integers_nbrsize(indxhdr->mbrType);
+	if (indxhdr->nStructs < nindices)
+		nindices = indxhdr->nStructs;
+	nindices -= nindices % 3;
+	GLuint *indices = (GLuint *) malloc(nindices*sizeof(GLuint));
+	for (AuintIdx i=0; i<nindices; i++) {
+		indices[i] = integers_get(toCData(indicesv), indxhdr->mbrType, i);
+		if (indices[i] >= nverts) {
+			vmLog("Cannot simplify a shape whose indices exceed its vertices");
+			free(indices);
+			free(pos);
+			pushValue(th, aNull);
+			return 1;
+		}
+	}
+
+	// Simplify the full mesh to each level's target, stopping once it no longer shrinks much
+	char indxtype = integers_type(nverts? nverts-1 : 0);
+	GLuint *simplified = (GLuint *) malloc(nindices*sizeof(GLuint));
+	GLuint *ordered = (GLuint *) malloc(nindices*sizeof(GLuint));
+	Value lods = pushArray(th, aNull, nlevels);
+	AuintIdx prevn = nindices;
+	for (int level=0; level<nlevels; level++) {
+		AuintIdx n = mesh_simplify(pos, nverts, indices, nindices, (nindices/3) >> (level+1), simplified);
+		if (n == 0 || n > prevn - prevn/10)
+			break;
+		prevn = n;
+		mesh_reorder(simplified, n, nverts, ordered);
+		void *indx = malloc(n*integers_nbrsize(indxtype));
+		for (AuintIdx i=0; i<n; i++)
+			integers_put(indx, indxtype, i, ordered[i]);
+		arrSet(th, lods, level, array_adopt(th, "Integers", indxtype, 1, n, indx));
+		popValue(th);
+	}
+	free(ordered);
+	free(simplified);
+	free(indices);
+	free(pos);
+
+	pushValue(th, lods);
+	popProperty(th, selfidx, "lods");
+	return 1;
+}
+
+/** Save a shape's vertex attribute and index arrays to a local .pmesh file (a path or file:// url),
+	to be loaded later without any parsing. Quantized arrays are left out, as a .pmesh stream
+	cannot say which array type they belong to. Returns true if saved. */
+int mesh_save(Value th) {
+	int selfidx = 0;
+	const char *path = getTop(th)>=2 && isStr(getLocal(th,1))? mesh_localpath(toStr(getLocal(th,1))) : NULL;
+	if (path == NULL) {
+		pushValue(th, aFalse);
+		return 1;
+	}
+
+	// The arrays to save: every vertex attribute, then the indices
+	Value arrays[MESH_MAXSTREAMS+1];
+	const char *names[MESH_MAXSTREAMS+1];
+	int narrays = mesh_attrarrays(th, selfidx, arrays, names);
+	Value indicesv = pushProperty(th, selfidx, "indices");
+	popValue(th);
+	if (isCDataType(indicesv, ArrayValue)) {
+		names[narrays] = "indices";
+		arrays[narrays++] = indicesv;
+	}
+
+	// Describe the streams for those a .pmesh can hold
+	MeshStream strms[MESH_MAXSTREAMS+1];
+	const void *contents[MESH_MAXSTREAMS+1];
+	int nstreams = 0;
+	for (int i=0; i<narrays; i++) {
+		ArrayHeader *hdr = toArrayHeader(arrays[i]);
+		AuintIdx nbrsz;
+		if (mesh_arraytype(hdr->mbrType, &nbrsz) == NULL || strlen(names[i]) > sizeof(strms[0].name)) {
+			vmLog("Cannot save array %s in a binary mesh", names[i]);
+			continue;
+		}
+		MeshStream *strm = &strms[nstreams];
+		memset(strm, 0, sizeof(MeshStream));
+		strncpy(strm->name, names[i], sizeof(strm->name));
+		strm->mbrType = hdr->mbrType;
+		strm->structSz = hdr->structSz;
+		AuintIdx structsz = array_structsize(hdr->mbrType, hdr->structSz);
+		strm->nStructs = getSize(arrays[i]) / structsz;
+		if (hdr->nStructs < strm->nStructs)
+			strm->nStructs = hdr->nStructs;
+		strm->nbytes = strm->nStructs * structsz;
+		contents[nstreams++] = toCData(arrays[i]);
+	}
+
+	// Lay out their data after the stream table, each on a 4-byte boundary
+	unsigned int offset = sizeof(MeshFileHeader) + nstreams*sizeof(MeshStream);
+	for (int s=0; s<nstreams; s++) {
+		strms[s].offset = offset = (offset + 3) & ~3u;
+		offset += strms[s].nbytes;
+	}
+
+	FILE *file = fopen(path, "wb");
+	if (file == NULL) {
+		vmLog("Cannot create mesh file %s", path);
+		pushValue(th, aFalse);
+		return 1;
+	}
+	MeshFileHeader head;
+	memcpy(head.magic, "PMSH", 4);
+	head.version = MESH_VERSION;
+	head.nStreams = (unsigned short) nstreams;
+	bool ok = fwrite(&head, sizeof(head), 1, file) == 1
+		&& fwrite(strms, sizeof(MeshStream), nstreams, file) == (size_t) nstreams;
+	static const char zeros[4] = {0, 0, 0, 0};
+	unsigned int written = sizeof(MeshFileHeader) + nstreams*sizeof(MeshStream);
+	for (int s=0; s<nstreams && ok; s++) {
+		unsigned int npad = strms[s].offset - written;
+		ok = fwrite(zeros, 1, npad, file) == npad
+			&& fwrite(contents[s], 1, strms[s].nbytes, file) == strms[s].nbytes;
+		written = strms[s].offset + strms[s].nbytes;
+	}
+	if (fclose(file) != 0)
+		ok = false;
+	if (!ok)
+		vmLog("Could not write mesh file %s", path);
+	pushValue(th, ok? aTrue : aFalse);
+	return 1;
+}
+
+/** Initialize Mesh type and plug into Resource */
+void mesh_init(Value th) {
+	Value Mesh = pushType(th, aNull, 4);
+		pushSym(th, "Mesh");
+		popProperty(th, 0, "_name");
+		pushCMethod(th, mesh_new);
+		popProperty(th, 0, "New");
+		pushCMethod(th, mesh_map);
+		popProperty(th, 0, "Map");
+	popGloVar(th, "Mesh");
+
+	// Register this type as Resource's 'pmesh' extension
+	pushGloVar(th, "Resource");
+		pushProperty(th, getTop(th) - 1, "extensions");
+			pushValue(th, Mesh);
+			popTblSet(th, getTop(th) - 2, "pmesh");
+		popValue(th);
+
+		// Stand in for Resource's 'file' scheme, so that .pmesh files are mapped
+		pushProperty(th, getTop(th) - 1, "schemes");
+			pushType(th, aNull, 2);
+				pushSym(th, "MeshFile");
+				popProperty(th, getTop(th) - 2, "_name");
+				pushTblGet(th, getTop(th) - 2, "file");
+				popProperty(th, getTop(th) - 2, "_files");
+				pushCMethod(th, mesh_fileget);
+				popProperty(th, getTop(th) - 2, "Get");
+			popTblSet(th, getTop(th) - 2, "file");
+		popValue(th);
+	popValue(th);
+}
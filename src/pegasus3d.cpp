@@ -21,6 +21,7 @@ void resource_close(void);
 void resource_poll(void);
 
 // World type initializers
+void pegsym_init(Value th);
 void rect_init(Value th);
 void color_init(Value th);
 void xyz_init(Value th);
@@ -37,14 +38,21 @@ void shape_init(Value th);
 void light_init(Value th);
 void shader_init(Value th);
 void texture_init(Value th);
+void glstate_init(Value th);
 
 void http_init(Value th);
 void image_init(Value th);
+void mesh_init(Value th);
+void image_poll(Value th);
+void image_close(void);
 
 void test_init(Value th);
 
 /** Initialize World Types and environment global variables. */
 void initTypes(Value th) {
+	// Symbols used by hot paths, needed before any type
+	pegsym_init(th);
+
 	// Pure data types
 	rect_init(th);
 	color_init(th);
@@ -64,9 +72,11 @@ void initTypes(Value th) {
 	light_init(th);
 	shader_init(th);
 	texture_init(th);
+	glstate_init(th);
 
 	http_init(th);
 	image_init(th);
+	mesh_init(th);
 }
 
 /** Initialize $ to be a blank world */
@@ -131,6 +141,9 @@ int main(int argc, char *argv[])
 		// Perform any asynchronous Internet transfers as needed
 		resource_poll();
 
+		// Deliver any images decoded in the background
+		image_poll(th);
+
 		// Do next frame (passing dt)
 		pushSym(th, "nextFrame");
 		pushGloVar(th, "$");
@@ -146,6 +159,7 @@ int main(int argc, char *argv[])
 		isrunning = popValue(th);
 	}
 
+	image_close(); // Stop image decoding threads
 	vmClose(th); // Shutdown Acorn VM
 	window_destroyMainWindow();
 	SDL_Quit(); // Shutdown SDL2
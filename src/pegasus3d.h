@@ -70,14 +70,77 @@ enum PegCDataTypes {
 	ShaderValue,
 	WindowValue,
 	ImageValue,
+	ShapeBufValue,
+	BoundsValue,
+	DrawListValue,
+	TextureValue,
 
 	// Only needed in Array
 	FloatNbr,
 	Uint8Nbr,
 	Uint16Nbr,
-	Uint32Nbr
+	Uint32Nbr,
+
+	// Quantized vertex attribute numbers, for compact rendering
+	HalfNbr,			//!< 16-bit floating point
+	Unorm8Nbr,			//!< 8-bit unsigned, 0-255 standing for 0.0-1.0
+	Unorm16Nbr,			//!< 16-bit unsigned, 0-65535 standing for 0.0-1.0
+	Snorm1010102Nbr		//!< Whole Xyz packed into 32 bits: 10 signed bits each for x, y, z standing for -1.0-1.0
+};
+
+/** Symbols the render loop looks up for every node and shape, interned once at startup
+	so that hot paths need not hash and intern the same C strings frame after frame.
+	Members are in the same order as the names in symbols.cpp. */
+struct PegSym {
+	Value Render;		//!< "_Render"
+	Value RenderPrep;	//!< "_RenderPrep"
+	Value New;			//!< "New"
+	Value CalcMatrix;	//!< "CalcMatrix"
+	Value mmatrix;		//!< "mmatrix"
+	Value vmatrix;		//!< "vmatrix"
+	Value pmatrix;		//!< "pmatrix"
+	Value origin;		//!< "origin"
+	Value orientation;	//!< "orientation"
+	Value scale;		//!< "scale"
+	Value parts;		//!< "parts"
+	Value Static;		//!< "static"
+	Value shader;		//!< "shader"
+	Value transparent;	//!< "transparent"
+	Value instances;	//!< "instances"
+	Value positions;	//!< "positions"
+	Value indices;		//!< "indices"
+	Value attributes;	//!< "attributes"
+	Value interleave;	//!< "interleave"
+	Value lods;			//!< "lods"
+	Value _xform;		//!< "_xform"
+	Value _bounds;		//!< "_bounds"
+	Value _buffers;		//!< "_buffers"
+	Value _drawlist;	//!< "_drawlist"
+	Value _draw;		//!< "_draw"
+	Value _program;		//!< "_program"
+	Value _texName;		//!< "_texName"
 };
 
+extern PegSym pegsym;	//!< Pre-interned symbols
+
+void pegsym_frameend(void);
+
+// Define PEG_COUNTSYMS to count every VM call that interns a C string, frame by frame
+// (reported by Symbols.Interned), to see how many hot-path lookups remain
+#ifdef PEG_COUNTSYMS
+extern unsigned int pegsym_frameinterns;	//!< Interning calls during the frame being rendered
+#define pushSym(th, s) (pegsym_frameinterns++, avm::pushSym(th, s))
+#define pushProperty(th, idx, nm) (pegsym_frameinterns++, avm::pushProperty(th, idx, nm))
+#define popProperty(th, idx, nm) (pegsym_frameinterns++, avm::popProperty(th, idx, nm))
+#define pushGetActProp(th, idx, nm) (pegsym_frameinterns++, avm::pushGetActProp(th, idx, nm))
+#define pushGloVar(th, nm) (pegsym_frameinterns++, avm::pushGloVar(th, nm))
+#define popGloVar(th, nm) (pegsym_frameinterns++, avm::popGloVar(th, nm))
+#endif
+
+/** Vertex attribute location for a shader's per-instance model matrix, "imatrix".
+	Being a mat4, it fills this location and the three after it. */
+#define PEG_INSTANCEATTR 12
+
 /** Structure for an Xyz value */
 typedef struct Xyz {
 	GLfloat x;	//!< x
@@ -131,18 +194,50 @@ struct ArrayHeader {
 	AuintIdx nStructs;	//!< number of structures in the array
 	char mbrType;		//!< float/int and number of bytes in a number
 	char structSz;		//!< How many numbers in a structure
+	unsigned int gen;	//!< Generation stamp, renewed whenever contents change
+	unsigned int cleanGen;	//!< Generation when the dirty range was last cleared
+	AuintIdx dirtyLo;	//!< Byte offset of the first byte changed since cleanGen
+	AuintIdx dirtyHi;	//!< Byte offset just past the last byte changed since cleanGen
 };
 
 #define toArrayHeader(value) ((ArrayHeader*) toHeader(value)) //<! Point to value's ArrayHeader data
 
+void array_newgen(ArrayHeader *hdr);
+void array_touch(ArrayHeader *hdr, AuintIdx lo, AuintIdx hi);
+void array_clean(ArrayHeader *hdr);
+AuintIdx array_parsefloats(const char *text, AuintIdx len, GLfloat **floatsp);
+AuintIdx array_structsize(char mbrType, char structSz);
+GLushort array_tohalf(GLfloat f);
+GLfloat array_fromhalf(GLushort h);
+Value array_adopt(Value th, const char *typname, char mbrType, char structSz, AuintIdx nStructs, void *data);
+char integers_type(unsigned int maxval);
+AuintIdx integers_nbrsize(char mbrType);
+GLenum integers_gltype(char mbrType);
+unsigned int integers_get(const void *ints, char mbrType, AuintIdx i);
+void integers_put(void *ints, char mbrType, AuintIdx i, unsigned int val);
+
 /** Structure for an Image value's header */
 struct ImageHeader {
 	AuintIdx x;
 	AuintIdx y;
 	AuintIdx z;
 	unsigned char nbytes;
+	unsigned char decoding;	//!< Is it still being decoded (so x and y are 0 and it has no contents yet)?
+	unsigned char levels;	//!< Number of mipmap levels in its contents (1 unless compressed)
+	GLenum compressed;		//!< OpenGL compressed format of its contents (0 if raw pixels)
 };
 
 #define toImageHeader(value) ((ImageHeader*) toHeader(value)) //<! Point to value's ImageHeader data
 
+/** A Texture's OpenGL texture object (its "_texName"), deleted by a finalizer once unreferenced */
+struct TextureObj {
+	GLuint name;		//!< OpenGL texture name
+	GLenum mapping;		//!< GL_TEXTURE_2D or GL_TEXTURE_CUBE_MAP
+	bool loaded;		//!< Have all its images streamed in?
+	bool packed;		//!< Is it a region of a shared atlas (so not its own texture object)?
+	GLfloat rect[4];	//!< Where its image lies in the texture object: u and v offset, then u and v scale
+};
+
+#define toTextureObj(value) ((TextureObj*) toHeader(value)) //<! Point to value's TextureObj data
+
 #endif
\ No newline at end of file
@@ -7,6 +7,9 @@
 
 #include "pegasus3d.h"
 #include "xyzmath.h"
+#include "transform.h"
+
+Value placement_calcmeth;
 
 /** Calculate and return an object's world "mmatrix" from origin, orientation, scale,
 	relative to passed (parent's) world mmatrix */
@@ -18,9 +21,9 @@ int placement_calcmatrix(Value th) {
 
 	// Get storage location for object's world matrix (mmatrix),
 	// creating it if not found
-	Value mmatv = pushProperty(th, selfidx, "mmatrix");
+	Value mmatv = pushValue(th, getProperty(th, getLocal(th, selfidx), pegsym.mmatrix));
 	if (mmatv == aNull) {
-		pushSym(th, "New");
+		pushValue(th, pegsym.New);
 		pushGloVar(th, "Matrix4");
 		getCall(th, 1, 1);
 		mmatv = pushValue(th, getFromTop(th, 0));
@@ -30,9 +33,10 @@ int placement_calcmatrix(Value th) {
 
 	// Get origin, orientation and scale, then calculate mmatrix
 	Mat4 selfmat;
-	Value originv = pushProperty(th, selfidx, "origin"); popValue(th);
-	Value orientv = pushProperty(th, selfidx, "orientation"); popValue(th);
-	Value scalev = pushProperty(th, selfidx, "scale"); popValue(th);
+	Value self = getLocal(th, selfidx);
+	Value originv = getProperty(th, self, pegsym.origin);
+	Value orientv = getProperty(th, self, pegsym.orientation);
+	Value scalev = getProperty(th, self, pegsym.scale);
 	mat4Place(&selfmat, isXyz(originv)? toXyz(originv) : NULL,
 		isQuat(orientv)? toQuat(orientv) : NULL,
 		isXyz(scalev)? toXyz(scalev) : NULL);
@@ -102,7 +106,7 @@ void placement_init(Value th) {
 		popProperty(th, 0, "_name");
 		pushCMethod(th, placement_orient);
 		popProperty(th, 0, "OrientTo");
-		pushCMethod(th, placement_calcmatrix);
+		placement_calcmeth = pushCMethod(th, placement_calcmatrix);
 		popProperty(th, 0, "CalcMatrix");
 	popGloVar(th, "Placement");
 }
\ No newline at end of file
@@ -0,0 +1,567 @@
+/** Render queue: draws collected during _RenderPrep, then sorted and submitted in one pass
+ * @file
+ *
+ * Rather than drawing shapes in scene graph order, each shape queues itself while
+ * the camera prepares the scene. Once the camera's view matrix is known, the queue is
+ * sorted by a packed 64-bit key and every shape is drawn in that order:
+ *
+ * - Opaque shapes come first, roughly front-to-back (to cut overdraw), then by
+ *   shader program and texture (to cut state changes). Depth is bucketed coarsely
+ *   so that nearby shapes still group by program and texture.
+ * - Transparent shapes come last, strictly back-to-front, so they blend correctly.
+ *
+ * Before sorting, shapes whose world bounds lie wholly outside the camera's frustum
+ * are culled. Each group records the span of items queued beneath it, along with a
+ * box enclosing them all, so that a group outside the frustum rejects its whole
+ * subtree with one test, and a group wholly inside accepts it.
+ *
+ * A group marked "static" records what its subtree queued, and on later frames
+ * replays those items and spans without calling _RenderPrep on any of its nodes. The
+ * recording also notes every node visited, the transform slot and stamp of each placed
+ * one, and every group's parts. Before replaying, each placed node's world matrix is
+ * brought up to date and each parts list compared: any change means the subtree is
+ * traversed (and recorded) afresh. A static group promises that its shapes' shaders,
+ * vertices and instances stay put; only its parts lists and placements are watched
+ * (each replayed item's program and texture keys are still looked up afresh).
+ * A subtree holding anything other than groups and shapes (e.g., a light) is never
+ * replayed, as its _RenderPrep may do more than queue items.
+ *
+ * The queue is the only way anything in a scene is drawn: the camera calls _RenderPrep
+ * on the scene, never _Render. A scene node type that draws must queue itself from its
+ * _RenderPrep (as Shape does); queued items alone have their _Render called, at submit.
+ *
+ * Shapes with coarser levels of detail then pick one by how tall they appear on screen.
+ * The level each was last drawn at is kept in a small table keyed by the shape and the
+ * transform slot it was queued under, so the same shape in two groups keeps two levels.
+ *
+ * This source file is part of the Pegasus3d browser.
+ * See Copyright Notice in pegasus3d.h
+*/
+
+#include "pegasus3d.h"
+#include "xyzmath.h"
+#include "renderqueue.h"
+#include "transform.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+void shader_drawkeys(Value th, Value shader, Value shape, Value context, GLuint *program, GLuint *texture);
+
+#define RQ_OPAQUEDEPTHBITS 10	//!< Precision of an opaque shape's depth bucket
+#define RQ_BLENDDEPTHBITS 24	//!< Precision of a transparent shape's depth
+#define RQ_LODHYSTERESIS 0.15f	//!< How far (in halvings of screen size) past a level's bounds a shape must go to change level
+
+RenderItem *renderqueue;	//!< Draws queued for the camera being rendered
+int renderqueue_n;			//!< Number of queued draws
+int renderqueue_max;		//!< Number of draws allocated
+RenderSpan *renderspans;	//!< Group spans, in the order groups were entered
+int renderspans_n;			//!< Number of group spans
+int renderspans_max;		//!< Number of group spans allocated
+int renderqueue_drawlod;	//!< Level of detail the shape being drawn should use
+RenderCache *renderqueue_recording;	//!< Static group's draw list being recorded (NULL if none)
+int renderqueue_recnode;	//!< Entry of the node whose _RenderPrep is running while recording
+char *renderqueue_fate;		//!< Scratch space for each item's culling result
+int renderqueue_fatemax;	//!< Number of culling results allocated
+
+/** The level of detail a shape was last drawn at, where it is queued under a transform slot */
+struct RenderLod {
+	Value shape;		//!< Shape (aNull if the entry is free)
+	int slot;			//!< Transform slot it was queued under
+	int lod;			//!< Level of detail it was last drawn at
+	unsigned int frame;	//!< Queue submission it was last drawn in
+};
+
+RenderLod *renderlods;		//!< Open-addressed table of last levels of detail
+int renderlods_n;			//!< Number of entries in use
+int renderlods_max;			//!< Number of entries allocated (a power of 2)
+unsigned int renderlods_frame;	//!< Number of queue submissions so far
+
+#define RC_OTHER 0		//!< Node's _RenderPrep did something other than queue a shape or traverse parts
+#define RC_GROUP 1		//!< Node traversed its parts
+#define RC_SHAPE 2		//!< Node queued itself as a shape
+#define RC_SCRIPTED 4	//!< Node calculated its own world matrix, which only its CalcMatrix can redo
+
+/** Empty the queue, ready for a camera to prepare its scene */
+void renderqueue_begin(void) {
+	renderqueue_n = 0;
+	renderspans_n = 0;
+}
+
+/** Add a shape to the queue, returning its item so the caller can fill in sort details */
+RenderItem *renderqueue_add(Value shape, Mat4 *mmatrix) {
+	if (renderqueue_n >= renderqueue_max) {
+		renderqueue_max = renderqueue_max? 2*renderqueue_max : 256;
+		renderqueue = (RenderItem *) realloc(renderqueue, renderqueue_max*sizeof(RenderItem));
+	}
+	RenderItem *item = &renderqueue[renderqueue_n++];
+	item->shape = shape;
+	item->mmatrix = mmatrix;
+	item->program = 0;
+	item->texture = 0;
+	item->transparent = false;
+	item->bounded = false;
+	item->nlods = item->lod = item->lastlod = 0;
+	item->lodslot = transform_under(shape);
+	item->key = 0;
+	if (renderqueue_recording)
+		renderqueue_recording->nodes[renderqueue_recnode].kind |= RC_SHAPE;
+	return item;
+}
+
+/** Give an item world bounds, transforming its local bounding box (min, max)
+	and bounding sphere (center, radius) by its mmatrix */
+void renderqueue_bound(RenderItem *item, Xyz *min, Xyz *max, Xyz *center, GLfloat radius) {
+	Mat4 *m = item->mmatrix;
+	Xyz boxcenter, boxextent;
+	boxcenter.x = 0.5f*(max->x + min->x); boxextent.x = 0.5f*(max->x - min->x);
+	boxcenter.y = 0.5f*(max->y + min->y); boxextent.y = 0.5f*(max->y - min->y);
+	boxcenter.z = 0.5f*(max->z + min->z); boxextent.z = 0.5f*(max->z - min->z);
+	if (m == NULL) {
+		item->center = boxcenter;
+		item->extent = boxextent;
+		item->sphere = *center;
+		item->radius = radius;
+	}
+	else {
+		mat4MultBox(&item->center, &item->extent, m, &boxcenter, &boxextent);
+
+		// A sphere's radius grows by the largest scale along any axis
+		mat4MultVec(&item->sphere, m, center);
+		GLfloat sx = (*m)[0]*(*m)[0] + (*m)[1]*(*m)[1] + (*m)[ 2]*(*m)[ 2];
+		GLfloat sy = (*m)[4]*(*m)[4] + (*m)[5]*(*m)[5] + (*m)[ 6]*(*m)[ 6];
+		GLfloat sz = (*m)[8]*(*m)[8] + (*m)[9]*(*m)[9] + (*m)[10]*(*m)[10];
+		GLfloat smax = sx>sy? (sx>sz? sx : sz) : (sy>sz? sy : sz);
+		item->radius = radius * sqrt(smax);
+	}
+	item->bounded = true;
+}
+
+/** Start a group's span of items, returning its index for closing it */
+int renderqueue_opengroup(void) {
+	if (renderspans_n >= renderspans_max) {
+		renderspans_max = renderspans_max? 2*renderspans_max : 64;
+		renderspans = (RenderSpan *) realloc(renderspans, renderspans_max*sizeof(RenderSpan));
+	}
+	RenderSpan *span = &renderspans[renderspans_n];
+	span->first = renderqueue_n;
+	span->end = renderqueue_n;
+	span->bounded = false;
+	return renderspans_n++;
+}
+
+/** Finish a group's span, once all its parts have been queued, enclosing their bounds in one box */
+void renderqueue_closegroup(int spanidx) {
+	RenderSpan *span = &renderspans[spanidx];
+	span->end = renderqueue_n;
+	if (span->end == span->first)
+		return;
+	Xyz min, max;
+	for (int i=span->first; i<span->end; i++) {
+		RenderItem *item = &renderqueue[i];
+		if (!item->bounded)
+			return; // An unbounded part means the group can never be rejected as a whole
+		Xyz lo, hi;
+		xyzSub(&lo, &item->center, &item->extent);
+		xyzAdd(&hi, &item->center, &item->extent);
+		if (i==span->first) {
+			min = lo; max = hi;
+		}
+		else {
+			if (lo.x<min.x) min.x = lo.x;
+			if (hi.x>max.x) max.x = hi.x;
+			if (lo.y<min.y) min.y = lo.y;
+			if (hi.y>max.y) max.y = hi.y;
+			if (lo.z<min.z) min.z = lo.z;
+			if (hi.z>max.z) max.z = hi.z;
+		}
+	}
+	span->center.x = 0.5f*(max.x + min.x); span->extent.x = 0.5f*(max.x - min.x);
+	span->center.y = 0.5f*(max.y + min.y); span->extent.y = 0.5f*(max.y - min.y);
+	span->center.z = 0.5f*(max.z + min.z); span->extent.z = 0.5f*(max.z - min.z);
+	span->bounded = true;
+}
+
+/** Replay a static group's recorded draw list for the camera, appending its items and
+	nested spans to the queue. Returns false (and queues nothing) if the subtree's
+	parts lists or placements have changed since it was recorded. */
+bool renderqueue_replay(Value th, RenderCache *cache, Value camera) {
+	if (!cache->valid || cache->camera != camera)
+		return false;
+
+	// Bring each placed node's world matrix up to date, making sure none moved and no parts changed
+	for (int i=0; i<cache->nnodes; i++) {
+		RenderCacheNode *rn = &cache->nodes[i];
+		pushValue(th, rn->node);
+		int nodeidx = getTop(th) - 1;
+		int slot = rn->slot;
+		if (i == 0)
+			slot = transform_current;
+		else if (rn->placed) {
+			int parent = rn->parent;
+			while (parent > 0 && !cache->nodes[parent].placed)
+				parent = cache->nodes[parent].parent;
+			slot = transform_update(th, nodeidx, rn->unparented? -1 : cache->nodes[parent].slot, rn->slot);
+		}
+		bool same = slot == rn->slot && transform_stamp(slot) == rn->stamp;
+		if (same && rn->kind == RC_GROUP) {
+			Value parts = getProperty(th, rn->node, pegsym.parts);
+			same = parts == rn->parts && (!isArr(parts) || (int) getSize(parts) == rn->nparts);
+			for (int p=0; same && p<rn->nparts; p++)
+				same = arrGet(th, parts, p) == cache->parts[rn->partsfirst + p];
+		}
+		popValue(th);
+		if (!same) {
+			cache->valid = false;
+			return false;
+		}
+	}
+
+	// Queue the recorded items, with the level of detail each was last drawn at. Their program
+	// and texture keys are found afresh, as a program is compiled (and a texture created) on first
+	// render, after the recording, and a texture may be swapped for another at any time.
+	int first = renderqueue_n;
+	while (renderqueue_n + cache->nitems > renderqueue_max) {
+		renderqueue_max = renderqueue_max? 2*renderqueue_max : 256;
+		renderqueue = (RenderItem *) realloc(renderqueue, renderqueue_max*sizeof(RenderItem));
+	}
+	memcpy(&renderqueue[first], cache->items, cache->nitems*sizeof(RenderItem));
+	renderqueue_n += cache->nitems;
+	for (int i=first; i<renderqueue_n; i++) {
+		RenderItem *item = &renderqueue[i];
+		Value shader = getProperty(th, item->shape, pegsym.shader);
+		if (shader == aNull)
+			shader = getProperty(th, camera, pegsym.shader);
+		shader_drawkeys(th, shader, item->shape, camera, &item->program, &item->texture);
+		if (item->nlods > 0)
+			item->lod = item->lastlod = renderqueue_lastlod(item->shape, item->lodslot);
+	}
+	for (int s=0; s<cache->nspans; s++) {
+		RenderSpan *span = &renderspans[renderqueue_opengroup()];
+		*span = cache->spans[s];
+		span->first += first;
+		span->end += first;
+	}
+	return true;
+}
+
+/** Start recording a static group's draw list for the camera, as its subtree is traversed */
+void renderqueue_record(RenderCache *cache, Value group, Value camera) {
+	cache->camera = camera;
+	cache->nnodes = 0;
+	cache->nparts = 0;
+	renderqueue_recording = cache;
+	renderqueue_recnode = -1;
+	renderqueue_recordnode(group, true, false, false);
+}
+
+/** Note a node about to be prepared while recording, after its world matrix is brought up to date */
+void renderqueue_recordnode(Value node, bool placed, bool unparented, bool scripted) {
+	RenderCache *cache = renderqueue_recording;
+	if (cache->nnodes >= cache->maxnodes) {
+		cache->maxnodes = cache->maxnodes? 2*cache->maxnodes : 64;
+		cache->nodes = (RenderCacheNode *) realloc(cache->nodes, cache->maxnodes*sizeof(RenderCacheNode));
+	}
+	RenderCacheNode *rn = &cache->nodes[cache->nnodes];
+	rn->node = node;
+	rn->parent = renderqueue_recnode;
+	rn->placed = placed;
+	rn->unparented = unparented;
+	rn->kind = scripted? RC_SCRIPTED : RC_OTHER;
+	rn->slot = transform_current;
+	rn->stamp = transform_stamp(transform_current);
+	rn->parts = aNull;
+	rn->nparts = 0;
+	rn->partsfirst = 0;
+	renderqueue_recnode = cache->nnodes++;
+}
+
+/** Note the parts list of the group being prepared while recording */
+void renderqueue_recordparts(Value th, Value parts) {
+	RenderCache *cache = renderqueue_recording;
+	RenderCacheNode *rn = &cache->nodes[renderqueue_recnode];
+	rn->kind |= RC_GROUP;
+	rn->parts = parts;
+	if (!isArr(parts))
+		return;
+	rn->nparts = getSize(parts);
+	rn->partsfirst = cache->nparts;
+	if (cache->nparts + rn->nparts > cache->maxparts) {
+		cache->maxparts = 2*(cache->nparts + rn->nparts);
+		cache->parts = (Value *) realloc(cache->parts, cache->maxparts*sizeof(Value));
+	}
+	for (int p=0; p<rn->nparts; p++)
+		cache->parts[cache->nparts++] = arrGet(th, parts, p);
+}
+
+/** Finish recording, once the group's subtree (whose span is passed) has been traversed,
+	keeping a copy of everything queued beneath it */
+void renderqueue_recordend(int spanidx) {
+	RenderCache *cache = renderqueue_recording;
+	renderqueue_recording = NULL;
+	int first = renderspans[spanidx].first;
+	cache->nitems = renderqueue_n - first;
+	cache->items = (RenderItem *) realloc(cache->items, (cache->nitems>0? cache->nitems : 1)*sizeof(RenderItem));
+	memcpy(cache->items, &renderqueue[first], cache->nitems*sizeof(RenderItem));
+	cache->nspans = renderspans_n - spanidx - 1;
+	cache->spans = (RenderSpan *) realloc(cache->spans, (cache->nspans>0? cache->nspans : 1)*sizeof(RenderSpan));
+	for (int s=0; s<cache->nspans; s++) {
+		cache->spans[s] = renderspans[spanidx + 1 + s];
+		cache->spans[s].first -= first;
+		cache->spans[s].end -= first;
+	}
+
+	// Only a subtree of nothing but groups and shapes, placed by Placement, can be replayed
+	cache->valid = true;
+	for (int i=0; i<cache->nnodes; i++)
+		if (cache->nodes[i].kind == RC_OTHER || (cache->nodes[i].kind & RC_SCRIPTED))
+			cache->valid = false;
+}
+
+/** Push a list of every value a static group's draw list refers to: its camera, the nodes
+	and parts lists it visited, and the shapes it queued. The group holds the list, so that
+	none of them is collected (and its memory reused by a lookalike) while it may be replayed. */
+Value renderqueue_pushrefs(Value th, RenderCache *cache) {
+	Value refs = pushArray(th, aNull, 1 + 2*cache->nnodes + cache->nparts + cache->nitems);
+	AuintIdx n = 0;
+	arrSet(th, refs, n++, cache->camera);
+	for (int i=0; i<cache->nnodes; i++) {
+		arrSet(th, refs, n++, cache->nodes[i].node);
+		arrSet(th, refs, n++, cache->nodes[i].parts);
+	}
+	for (int p=0; p<cache->nparts; p++)
+		arrSet(th, refs, n++, cache->parts[p]);
+	for (int i=0; i<cache->nitems; i++)
+		arrSet(th, refs, n++, cache->items[i].shape);
+	return refs;
+}
+
+/** Free a static group's draw list (finalizer) */
+int renderqueue_closecache(Value cachev) {
+	RenderCache *cache = (RenderCache*) toHeader(cachev);
+	free(cache->items);
+	free(cache->spans);
+	free(cache->nodes);
+	free(cache->parts);
+	return 1;
+}
+
+#define RQ_OUTSIDE 0	//!< Bounds lie wholly outside the frustum
+#define RQ_INSIDE 1		//!< Bounds lie wholly inside the frustum
+#define RQ_CROSSING 2	//!< Bounds cross at least one frustum plane
+
+/** Classify a world box (center, extent) against the six normalized frustum planes */
+static int renderqueue_boxtest(GLfloat planes[6][4], Xyz *center, Xyz *extent) {
+	int result = RQ_INSIDE;
+	for (int p=0; p<6; p++) {
+		GLfloat *pl = planes[p];
+		GLfloat dist = pl[0]*center->x + pl[1]*center->y + pl[2]*center->z + pl[3];
+		GLfloat reach = fabs(pl[0])*extent->x + fabs(pl[1])*extent->y + fabs(pl[2])*extent->z;
+		if (dist + reach < 0.0f)
+			return RQ_OUTSIDE;
+		if (dist - reach < 0.0f)
+			result = RQ_CROSSING;
+	}
+	return result;
+}
+
+/** Classify a world sphere against the six normalized frustum planes */
+static int renderqueue_spheretest(GLfloat planes[6][4], Xyz *center, GLfloat radius) {
+	int result = RQ_INSIDE;
+	for (int p=0; p<6; p++) {
+		GLfloat *pl = planes[p];
+		GLfloat dist = pl[0]*center->x + pl[1]*center->y + pl[2]*center->z + pl[3];
+		if (dist < -radius)
+			return RQ_OUTSIDE;
+		if (dist < radius)
+			result = RQ_CROSSING;
+	}
+	return result;
+}
+
+/** Remove queued items whose bounds lie wholly outside the frustum of the
+	projection * view matrix, rejecting or accepting whole group spans where possible */
+void renderqueue_cull(Mat4 *vpmatrix) {
+	// Extract normalized left, right, bottom, top, near and far planes from the matrix's rows
+	GLfloat planes[6][4];
+	for (int p=0; p<6; p++) {
+		int row = p>>1;
+		GLfloat sign = (p&1)? -1.0f : 1.0f;
+		for (int col=0; col<4; col++)
+			planes[p][col] = (*vpmatrix)[4*col+3] + sign*(*vpmatrix)[4*col+row];
+		GLfloat len = sqrt(planes[p][0]*planes[p][0] + planes[p][1]*planes[p][1] + planes[p][2]*planes[p][2]);
+		if (len > 0.0f)
+			for (int col=0; col<4; col++)
+				planes[p][col] /= len;
+	}
+
+	// Decide each item's fate: spans (in pre-order) settle whole subtrees at once
+	if (renderqueue_n > renderqueue_fatemax) {
+		renderqueue_fatemax = renderqueue_max;
+		renderqueue_fate = (char *) realloc(renderqueue_fate, renderqueue_fatemax);
+	}
+	char *fate = renderqueue_fate;
+	memset(fate, RQ_CROSSING, renderqueue_n);
+	int settled = 0; // items before this index within an outer span are already decided
+	for (int s=0; s<renderspans_n; s++) {
+		RenderSpan *span = &renderspans[s];
+		if (span->first < settled || !span->bounded || span->first == span->end)
+			continue;
+		int result = renderqueue_boxtest(planes, &span->center, &span->extent);
+		if (result != RQ_CROSSING) {
+			memset(&fate[span->first], result, span->end - span->first);
+			settled = span->end;
+		}
+	}
+	for (int i=0; i<renderqueue_n; i++) {
+		RenderItem *item = &renderqueue[i];
+		if (fate[i] != RQ_CROSSING || !item->bounded)
+			continue;
+		if ((fate[i] = renderqueue_spheretest(planes, &item->sphere, item->radius)) == RQ_CROSSING)
+			fate[i] = renderqueue_boxtest(planes, &item->center, &item->extent);
+	}
+
+	// Keep only the visible items, in order
+	int kept = 0;
+	for (int i=0; i<renderqueue_n; i++) {
+		if (fate[i] != RQ_OUTSIDE)
+			renderqueue[kept++] = renderqueue[i];
+	}
+	renderqueue_n = kept;
+}
+
+/** Find the entry for a shape queued under a transform slot: its own, or the free one it would take */
+static RenderLod *renderqueue_findlod(Value shape, int slot) {
+	size_t hash = ((size_t) shape >> 3) * 31 + (unsigned int) slot;
+	for (int i = (int)(hash & (renderlods_max-1)); ; i = (i+1) & (renderlods_max-1)) {
+		RenderLod *entry = &renderlods[i];
+		if (entry->shape == aNull || (entry->shape == shape && entry->slot == slot))
+			return entry;
+	}
+}
+
+/** Return the level of detail a shape queued under a transform slot was last drawn at (0 if never) */
+int renderqueue_lastlod(Value shape, int slot) {
+	if (renderlods_n == 0)
+		return 0;
+	RenderLod *entry = renderqueue_findlod(shape, slot);
+	return entry->shape == aNull? 0 : entry->lod;
+}
+
+/** Remember the level of detail a shape queued under a transform slot is drawn at.
+	When the table fills, it is rebuilt twice as large without entries not drawn lately. */
+static void renderqueue_savelod(Value shape, int slot, int lod) {
+	if (2*(renderlods_n+1) > renderlods_max) {
+		RenderLod *old = renderlods;
+		int oldmax = renderlods_max;
+		renderlods_max = renderlods_max? 2*renderlods_max : 256;
+		renderlods = (RenderLod *) malloc(renderlods_max*sizeof(RenderLod));
+		for (int i=0; i<renderlods_max; i++)
+			renderlods[i].shape = aNull;
+		renderlods_n = 0;
+		for (int i=0; i<oldmax; i++) {
+			if (old[i].shape != aNull && old[i].frame + 2 >= renderlods_frame) {
+				*renderqueue_findlod(old[i].shape, old[i].slot) = old[i];
+				renderlods_n++;
+			}
+		}
+		free(old);
+	}
+	RenderLod *entry = renderqueue_findlod(shape, slot);
+	if (entry->shape == aNull) {
+		entry->shape = shape;
+		entry->slot = slot;
+		renderlods_n++;
+	}
+	entry->lod = lod;
+	entry->frame = renderlods_frame;
+}
+
+/** Choose each shape's level of detail from its bounding sphere's projected height in pixels.
+	A shape at least lodsize pixels tall is drawn at full detail; each level after that
+	serves shapes half as tall as the level before. To avoid popping back and forth,
+	a shape only changes level once it is well past the bounds of its current one. */
+void renderqueue_lod(Mat4 *vmatrix, Mat4 *pmatrix, GLfloat viewht, GLfloat lodsize) {
+	// Pixels per world unit, at unit distance for a perspective projection (fov gives pmatrix[5])
+	GLfloat pixelsperunit = 0.5f * viewht * (*pmatrix)[5];
+	bool perspective = (*pmatrix)[11] != 0.0f;
+	for (int i=0; i<renderqueue_n; i++) {
+		RenderItem *item = &renderqueue[i];
+		if (item->nlods == 0 || !item->bounded)
+			continue;
+		GLfloat pixels = 2.0f * item->radius * pixelsperunit;
+		if (perspective) {
+			Xyz eye;
+			mat4MultVec(&eye, vmatrix, &item->sphere);
+			GLfloat dist = sqrt(eye.x*eye.x + eye.y*eye.y + eye.z*eye.z);
+			if (dist <= item->radius) {
+				item->lod = 0;
+				continue;
+			}
+			pixels /= dist;
+		}
+
+		// How many halvings smaller than lodsize it looks, compared with its current level's range
+		GLfloat level = pixels > 0.0f? log(lodsize / pixels) / log(2.0f) : (GLfloat) item->nlods;
+		int lod = item->lastlod;
+		if (level >= lod + 1 + RQ_LODHYSTERESIS || level < lod - RQ_LODHYSTERESIS)
+			lod = level < 0.0f? 0 : (int) level;
+		item->lod = lod > item->nlods? item->nlods : lod;
+	}
+}
+
+/** Compare two items' sort keys, for qsort */
+static int renderqueue_cmp(const void *a, const void *b) {
+	unsigned long long keya = ((const RenderItem *)a)->key;
+	unsigned long long keyb = ((const RenderItem *)b)->key;
+	return keya < keyb? -1 : keya > keyb? 1 : 0;
+}
+
+/** Calculate every item's sort key using the camera's view matrix and far distance, then sort */
+void renderqueue_sort(Mat4 *vmatrix, GLfloat far) {
+	for (int i=0; i<renderqueue_n; i++) {
+		RenderItem *item = &renderqueue[i];
+
+		// Distance in front of the camera of the shape's origin, as a fraction of far
+		GLfloat depth = 0.0f;
+		if (item->mmatrix != NULL) {
+			Mat4 *m = item->mmatrix;
+			depth = -((*vmatrix)[2]*(*m)[12] + (*vmatrix)[6]*(*m)[13] + (*vmatrix)[10]*(*m)[14] + (*vmatrix)[14]) / far;
+			depth = depth<0.0f? 0.0f : depth>1.0f? 1.0f : depth;
+		}
+
+		// Opaque:      0 | depth (10) | program (16) | texture (16) | 0 (21)
+		// Transparent: 1 | far-to-near depth (24) | program (16) | texture (16) | 0 (7)
+		unsigned long long program = item->program & 0xFFFF;
+		unsigned long long texture = item->texture & 0xFFFF;
+		if (!item->transparent) {
+			unsigned long long bucket = (unsigned long long) (depth * ((1<<RQ_OPAQUEDEPTHBITS)-1));
+			item->key = (bucket << 53) | (program << 37) | (texture << 21);
+		}
+		else {
+			unsigned long long bucket = (unsigned long long) ((1.0f-depth) * ((1<<RQ_BLENDDEPTHBITS)-1));
+			item->key = (1ULL << 63) | (bucket << 39) | (program << 23) | (texture << 7);
+		}
+	}
+	qsort(renderqueue, renderqueue_n, sizeof(RenderItem), renderqueue_cmp);
+}
+
+/** Draw every queued shape in sorted order, using the camera as render context, then empty the queue */
+void renderqueue_submit(Value th, int contextidx) {
+	renderlods_frame++;
+	for (int i=0; i<renderqueue_n; i++) {
+		RenderItem *item = &renderqueue[i];
+
+		// Remember its level of detail, for the next frame's hysteresis
+		if (item->nlods > 0)
+			renderqueue_savelod(item->shape, item->lodslot, item->lod);
+
+		renderqueue_drawlod = item->lod;
+		pushValue(th, pegsym.Render);
+		pushValue(th, item->shape);
+		pushLocal(th, contextidx);
+		getCall(th, 2, 0);
+	}
+	renderqueue_drawlod = 0;
+	renderqueue_n = 0;
+}
@@ -0,0 +1,95 @@
+/** Render queue: draws collected during _RenderPrep, then sorted and submitted in one pass
+ * @file
+ *
+ * This source file is part of the Pegasus3d browser.
+ * See Copyright Notice in pegasus3d.h
+*/
+
+#ifndef renderqueue_h
+#define renderqueue_h 1
+
+extern int renderqueue_drawlod;	//!< Level of detail the shape being drawn should use
+
+/** A shape waiting to be drawn */
+struct RenderItem {
+	Value shape;		//!< Shape to draw
+	Mat4 *mmatrix;		//!< Shape's world matrix (NULL if none)
+	GLuint program;		//!< Shader program handle it will use (0 if not yet known)
+	GLuint texture;		//!< Texture name its first sampler will use (0 if none)
+	bool transparent;	//!< Does it blend with whatever is behind it?
+	bool bounded;		//!< Does it have world bounds (below) to cull with?
+	Xyz center;			//!< World center of its bounding box
+	Xyz extent;			//!< World half-size of its bounding box along each axis
+	Xyz sphere;			//!< World center of its bounding sphere
+	GLfloat radius;		//!< World radius of its bounding sphere
+	int nlods;			//!< Number of coarser levels of detail the shape has
+	int lod;			//!< Level of detail to draw at (0 is full detail)
+	int lastlod;		//!< Level of detail it was last drawn at
+	int lodslot;		//!< Transform slot it is queued under, which with the shape keys its last level of detail
+	unsigned long long key;	//!< Packed sort key
+};
+
+/** A group's span of consecutively queued items, for rejecting whole subtrees */
+struct RenderSpan {
+	int first;			//!< Index of the group's first queued item
+	int end;			//!< Index just past the group's last queued item
+	bool bounded;		//!< Do all its items have bounds?
+	Xyz center;			//!< World center of the box enclosing all its items
+	Xyz extent;			//!< World half-size of the box enclosing all its items
+};
+
+/** A node visited while recording a static group's subtree */
+struct RenderCacheNode {
+	Value node;			//!< The node
+	int parent;			//!< Entry of the part-owning node it was visited under (-1 for the group itself)
+	bool placed;		//!< Does it have its own slot in the transform table?
+	bool unparented;	//!< Was its world matrix calculated with no parent matrix?
+	char kind;			//!< What its _RenderPrep did (RC_ flags)
+	int slot;			//!< Its transform slot (or the nearest placed ancestor's)
+	unsigned int stamp;	//!< Generation stamp of that slot's world matrix
+	Value parts;		//!< Its parts list, if a group
+	int nparts;			//!< Number of parts it had
+	int partsfirst;		//!< Index of its first part in the cache's copy of all parts lists
+};
+
+/** A static group's cached draw list: the items and spans its subtree last queued,
+	and enough of the subtree's shape to tell when they are no longer valid.
+	The values it refers to are kept from being collected by the group's "_drawrefs" list. */
+struct RenderCache {
+	Value owner;		//!< Group the draw list belongs to
+	Value camera;		//!< Camera it was recorded for
+	bool valid;			//!< Can it be replayed?
+	RenderItem *items;	//!< Queued items, world bounds and all
+	int nitems;			//!< Number of queued items
+	RenderSpan *spans;	//!< Spans of nested groups, relative to the first item
+	int nspans;			//!< Number of nested spans
+	RenderCacheNode *nodes;	//!< Nodes visited, in traversal order (the group first)
+	int nnodes;			//!< Number of nodes visited
+	int maxnodes;		//!< Number of nodes allocated
+	Value *parts;		//!< Every visited group's parts, one list after the other
+	int nparts;			//!< Number of parts
+	int maxparts;		//!< Number of parts allocated
+};
+
+extern RenderCache *renderqueue_recording;	//!< Static group's draw list being recorded (NULL if none)
+extern int renderqueue_recnode;	//!< Entry of the node whose _RenderPrep is running while recording
+
+void renderqueue_begin(void);
+RenderItem *renderqueue_add(Value shape, Mat4 *mmatrix);
+void renderqueue_bound(RenderItem *item, Xyz *min, Xyz *max, Xyz *center, GLfloat radius);
+int renderqueue_opengroup(void);
+void renderqueue_closegroup(int span);
+void renderqueue_cull(Mat4 *vpmatrix);
+bool renderqueue_replay(Value th, RenderCache *cache, Value camera);
+void renderqueue_record(RenderCache *cache, Value group, Value camera);
+void renderqueue_recordnode(Value node, bool placed, bool unparented, bool scripted);
+void renderqueue_recordparts(Value th, Value parts);
+void renderqueue_recordend(int span);
+Value renderqueue_pushrefs(Value th, RenderCache *cache);
+int renderqueue_closecache(Value cachev);
+int renderqueue_lastlod(Value shape, int slot);
+void renderqueue_lod(Mat4 *vmatrix, Mat4 *pmatrix, GLfloat viewht, GLfloat lodsize);
+void renderqueue_sort(Mat4 *vmatrix, GLfloat far);
+void renderqueue_submit(Value th, int contextidx);
+
+#endif
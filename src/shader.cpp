@@ -7,17 +7,50 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "pegasus3d.h"
 #include "xyzmath.h"
+#include "glstate.h"
+
+#define SHADER_MAXSAMPLERS 16	//!< Most textures bound to one sampler array uniform
+
+void texture_newdraw(void);
 
 /** Structure for holding a ready-to-use shader program.
   We do this so that we can depend on a finalizer to delete
-  a program when it is no longer referenced. */
+  a program when it is no longer referenced.
+  Its data area holds the program's uniform binding plan (an array of UniformBinding). */
 struct ShaderPgm {
 	GLuint program;	//!< Handle for OpenGL shader program
+	bool instanced;	//!< Does it take a per-instance "imatrix" attribute?
+};
+
+/** Where a uniform's value comes from when a shape is rendered */
+enum UniformSource {
+	UniMvpMatrix,	//!< Calculated pmatrix * vmatrix * mmatrix
+	UniMvMatrix,	//!< Calculated vmatrix * mmatrix
+	UniMMatrix,		//!< Shape's mmatrix
+	UniContext,		//!< Render context's named property
+	UniTexRect,		//!< Region of its texture object used by the texture of the named sampler
+	UniProperty		//!< Shape's named property, otherwise the render context's
 };
 
+/** A uniform's binding, resolved once when the program is linked */
+struct UniformBinding {
+	Value name;		//!< Symbol for the property holding the uniform's value
+	GLint location;	//!< Uniform's location in the program
+	GLenum type;	//!< Uniform's GLSL type
+	GLint size;		//!< Number of elements, if the uniform is an array (else 1)
+	bool packable;	//!< For a sampler: does the program also take its "Rect", so it may sample an atlas?
+	int source;		//!< Where the uniform's value comes from (UniformSource)
+};
+
+/** Is this GLSL uniform type a texture sampler? */
+#define isSamplerType(type) \
+	((type)==GL_SAMPLER_2D || (type)==GL_SAMPLER_CUBE || (type)==GL_SAMPLER_1D || (type)==GL_SAMPLER_3D \
+	|| (type)==GL_SAMPLER_2D_ARRAY || (type)==GL_SAMPLER_2D_SHADOW)
+
 /** Compile a shader program */
 GLuint shader_compile(const char *shadersource, GLenum shadertype) {
 	int IsCompiled;
@@ -71,14 +104,15 @@ Value shader_make(Value th, Value pgmv) {
     glAttachShader(shaderprogram, vshader);
     glAttachShader(shaderprogram, fshader);
 
-	// Bind "attributes" in listed order.
+	// Bind "attributes" in listed order, and any per-instance matrix after them
 	Value inlist = pushProperty(th, selfidx, "attributes");
 	if (isArr(inlist)) {
-		for (AuintIdx i=0; i < getSize(inlist); i++) {
+		for (AuintIdx i=0; i < getSize(inlist) && i < PEG_INSTANCEATTR; i++) {
 			glBindAttribLocation(shaderprogram, i, toStr(arrGet(th, inlist, i)));
 		}
 	}
 	popValue(th);
+	glBindAttribLocation(shaderprogram, PEG_INSTANCEATTR, "imatrix");
 
     // Link the program, then upload it to the GPU.
     glLinkProgram(shaderprogram);
@@ -101,16 +135,76 @@ Value shader_make(Value th, Value pgmv) {
        return aNull;
     }
 
-	// Remember compiled program, then return as success
+	// Remember compiled program
 	ShaderPgm* p = (ShaderPgm*) toHeader(pgmv);
 	p->program = shaderprogram;
+	p->instanced = glGetAttribLocation(shaderprogram, "imatrix") == PEG_INSTANCEATTR;
+
+	// Resolve each listed uniform's location, type and value source into the binding plan.
+	// Uniforms the linker optimized away get no binding.
+	Value uniformlist = pushProperty(th, selfidx, "uniforms"); popValue(th);
+	if (isArr(uniformlist)) {
+		for (AuintIdx i=0; i < getSize(uniformlist); i++) {
+			Value uninamev = arrGet(th, uniformlist, i);
+			if (!isSym(uninamev)) continue;
+			const char *uninamestr = toStr(uninamev);
+			UniformBinding binding;
+			if ((binding.location = glGetUniformLocation(shaderprogram, uninamestr)) < 0)
+				continue;
+			GLuint uniindex;
+			GLint unitype = 0;
+			GLint unisize = 1;
+			glGetUniformIndices(shaderprogram, 1, &uninamestr, &uniindex);
+			if (uniindex != GL_INVALID_INDEX) {
+				glGetActiveUniformsiv(shaderprogram, 1, &uniindex, GL_UNIFORM_TYPE, &unitype);
+				glGetActiveUniformsiv(shaderprogram, 1, &uniindex, GL_UNIFORM_SIZE, &unisize);
+			}
+			binding.type = unitype;
+			binding.size = unisize;
+			binding.packable = false;
+			size_t uninamelen = strlen(uninamestr);
+			binding.name = uninamev;
+			if (0==strcmp("mvpmatrix", uninamestr))
+				binding.source = UniMvpMatrix;
+			else if (0==strcmp("mvmatrix", uninamestr))
+				binding.source = UniMvMatrix;
+			else if (0==strcmp("mmatrix", uninamestr))
+				binding.source = UniMMatrix;
+			else if (0==strcmp("cameraOrigin", uninamestr)) {
+				binding.source = UniContext;
+				binding.name = pushSym(th, "origin"); popValue(th);
+			}
+			else if (unitype == GL_FLOAT_VEC4 && uninamelen > 4 && uninamelen < 68 && 0==strcmp("Rect", uninamestr + uninamelen - 4)) {
+				// "texRect" gives the region of the texture object that sampler "tex"'s texture uses
+				char samplername[64];
+				memcpy(samplername, uninamestr, uninamelen - 4);
+				samplername[uninamelen - 4] = '\0';
+				binding.source = UniTexRect;
+				binding.name = pushSym(th, samplername); popValue(th);
+			}
+			else
+				binding.source = UniProperty;
+			strAppend(th, pgmv, (const char*)&binding, sizeof(UniformBinding));
+		}
+
+		// A sampler whose region is passed along may have its textures packed into an atlas
+		UniformBinding *bindings = (UniformBinding*) toCData(pgmv);
+		AuintIdx nbindings = getSize(pgmv)/sizeof(UniformBinding);
+		for (AuintIdx i=0; i<nbindings; i++) {
+			if (bindings[i].source != UniTexRect)
+				continue;
+			for (AuintIdx j=0; j<nbindings; j++)
+				if (bindings[j].name == bindings[i].name && isSamplerType(bindings[j].type) && bindings[j].size == 1)
+					bindings[j].packable = true;
+		}
+	}
 	return pgmv;
 }
 
 /** Close out a shader that is no longer referenced anywhere */
 int shader_closepgm(Value shaderpgm) {
 	ShaderPgm *pgm = (ShaderPgm*) toHeader(shaderpgm);
-	glDeleteProgram(pgm->program);
+	glsDeleteProgram(pgm->program);
 	return 1;
 }
 
@@ -120,6 +214,56 @@ int shader_new(Value th) {
 	return 1;
 }
 
+/** Find what drawing a shape with this shader will bind, for sorting draws:
+	the shader's program handle and the texture name its first sampler uses.
+	Either is 0 if not yet known (e.g., before the first render). */
+void shader_drawkeys(Value th, Value shader, Value shape, Value context, GLuint *program, GLuint *texture) {
+	*program = *texture = 0;
+	if (shader == aNull)
+		return;
+	Value pgmv = getProperty(th, shader, pegsym._program);
+	if (!isCData(pgmv))
+		return;
+	*program = ((ShaderPgm*) toHeader(pgmv))->program;
+
+	UniformBinding *binding = (UniformBinding*) toCData(pgmv);
+	UniformBinding *bindingend = binding + getSize(pgmv)/sizeof(UniformBinding);
+	for (; binding < bindingend; binding++) {
+		if (!isSamplerType(binding->type))
+			continue;
+		Value unival = getProperty(th, shape, binding->name);
+		if (unival == aNull)
+			unival = getProperty(th, context, binding->name);
+		if (isType(unival)) {
+			Value texobj = getProperty(th, unival, pegsym._texName);
+			if (isCDataType(texobj, TextureValue))
+				*texture = toTextureObj(texobj)->name;
+		}
+		return;
+	}
+}
+
+/** Does the shader's compiled program take a per-instance "imatrix" attribute,
+	so that a shape's "instances" can be drawn with it in one call? */
+bool shader_instanced(Value th, Value shader) {
+	if (shader == aNull)
+		return false;
+	Value pgmv = getProperty(th, shader, pegsym._program);
+	return isCData(pgmv) && ((ShaderPgm*) toHeader(pgmv))->instanced;
+}
+
+/** Render a texture, binding it to a texture unit for this draw, and return the unit's number.
+	Only a texture whose region is passed to the shader may be packed into an atlas. */
+static GLint shader_textureunit(Value th, Value texture, int contextidx, bool packable) {
+	pushValue(th, pegsym.Render);
+	pushValue(th, texture);
+	pushLocal(th, contextidx);
+	pushValue(th, packable? aTrue : aFalse);
+	getCall(th, 3, 1);
+	Value unit = popValue(th);
+	return isInt(unit)? toAint(unit) : 0;
+}
+
 /** Render the shader, retrieving uniforms from context as parameter 1 */
 int shader_render(Value th) {
 	int selfidx = 0;
@@ -127,7 +271,7 @@ int shader_render(Value th) {
 	int shapeidx = 2;
 
 	// Get compiled shader, if it exists
-	Value pgmv = pushProperty(th, selfidx, "_program");
+	Value pgmv = getProperty(th, getLocal(th, selfidx), pegsym._program);
 	if (pgmv==aNull) {
 		// If it does not exist, compile and bind it based on info
 		Value pgmtype = pushProperty(th, selfidx, "_compiledtype");
@@ -141,86 +285,87 @@ int shader_render(Value th) {
 	/* Load the shader into the rendering pipeline */
 	if (pgmv != aNull) {
 		ShaderPgm *pgmdata = (ShaderPgm*) toHeader(pgmv);
-		glUseProgram(pgmdata->program);
+		glsUseProgram(pgmdata->program);
 
 		// Calculate mvpmatrix = pmatrix * (mvmatrix = vmatrix * mmatrix)
-		Mat4 *mmatrix = (Mat4*) toHeader(pushProperty(th, shapeidx, "mmatrix")); popValue(th);
-		Mat4 *vmatrix = (Mat4*) toHeader(pushProperty(th, contextidx, "vmatrix")); popValue(th);
-		Mat4 *pmatrix = (Mat4*) toHeader(pushProperty(th, contextidx, "pmatrix")); popValue(th);
+		Mat4 *mmatrix = (Mat4*) toHeader(getProperty(th, getLocal(th, shapeidx), pegsym.mmatrix));
+		Mat4 *vmatrix = (Mat4*) toHeader(getProperty(th, getLocal(th, contextidx), pegsym.vmatrix));
+		Mat4 *pmatrix = (Mat4*) toHeader(getProperty(th, getLocal(th, contextidx), pegsym.pmatrix));
 		Mat4 mvpmatrix, mvmatrix;
 		mat4Mult(&mvmatrix, vmatrix, mmatrix);
 		mat4Mult(&mvpmatrix, pmatrix, &mvmatrix);
 
-		// Load all the shader's named "uniform" values from the shape or context
-		Value uniformlist = pushProperty(th, selfidx, "uniforms"); popValue(th);
-		if (isArr(uniformlist)) {
-			for (AuintIdx i=0; i < getSize(uniformlist); i++) {
-				Value uninamev = arrGet(th, uniformlist, i);
-				if (!isSym(uninamev)) continue;
-
-				// Is the uniform a matrix we just calculated?
-				const char *uninamestr = toStr(uninamev);
-				if (0==strcmp("mvpmatrix", uninamestr)) {
-					glUniformMatrix4fv(glGetUniformLocation(pgmdata->program, uninamestr), 1, GL_FALSE, (GLfloat *)&mvpmatrix);
-					continue;
-				}
-				else if (0==strcmp("mvmatrix", uninamestr)) {
-					glUniformMatrix4fv(glGetUniformLocation(pgmdata->program, uninamestr), 1, GL_FALSE, (GLfloat *)&mvmatrix);
-					continue;
-				}
-				else if (0==strcmp("mmatrix", uninamestr)) {
-					glUniformMatrix4fv(glGetUniformLocation(pgmdata->program, uninamestr), 1, GL_FALSE, (GLfloat *)mmatrix);
-					continue;
-				}
+		// Texture units claimed by earlier draws may be reused for this one's samplers
+		texture_newdraw();
 
-				// Get and process a uniform value from the shape or render context
-				Value unival;
-				if (0==strcmp("cameraOrigin", uninamestr)) {
-					unival = pushProperty(th, contextidx, "origin"); popValue(th);
-				}
-				else {
-					unival = getProperty(th, getLocal(th, shapeidx), uninamev);
-					if (unival == aNull)
-						unival = getProperty(th, getLocal(th, contextidx), uninamev);
+		// Load all the shader's uniform values, as planned when the program was linked
+		UniformBinding *binding = (UniformBinding*) toCData(pgmv);
+		UniformBinding *bindingend = binding + getSize(pgmv)/sizeof(UniformBinding);
+		for (; binding < bindingend; binding++) {
+			GLint loc = binding->location;
+
+			// Get and process a uniform value from the shape or render context
+			Value unival;
+			switch (binding->source) {
+			case UniMvpMatrix: glUniformMatrix4fv(loc, 1, GL_FALSE, (GLfloat *)&mvpmatrix); continue;
+			case UniMvMatrix: glUniformMatrix4fv(loc, 1, GL_FALSE, (GLfloat *)&mvmatrix); continue;
+			case UniMMatrix: glUniformMatrix4fv(loc, 1, GL_FALSE, (GLfloat *)mmatrix); continue;
+			case UniContext:
+				unival = getProperty(th, getLocal(th, contextidx), binding->name);
+				break;
+			case UniTexRect:
+				unival = getProperty(th, getLocal(th, shapeidx), binding->name);
+				if (unival == aNull)
+					unival = getProperty(th, getLocal(th, contextidx), binding->name);
+				if (isType(unival) && isCDataType(unival = getProperty(th, unival, pegsym._texName), TextureValue))
+					glUniform4fv(loc, 1, toTextureObj(unival)->rect);
+				else
+					glUniform4f(loc, 0.0f, 0.0f, 1.0f, 1.0f);
+				continue;
+			default:
+				unival = getProperty(th, getLocal(th, shapeidx), binding->name);
+				if (unival == aNull)
+					unival = getProperty(th, getLocal(th, contextidx), binding->name);
+			}
+
+			if (isFloat(unival))
+				glUniform1f(loc, toAfloat(unival));
+			else if (isInt(unival))
+				glUniform1i(loc, toAint(unival));
+			else if (isCData(unival)) {
+				switch(getCDataType(unival)) {
+				case Mat2Value: glUniformMatrix2fv(loc, 1, GL_FALSE, (GLfloat *) toHeader(unival)); break;
+				case Mat3Value: glUniformMatrix3fv(loc, 1, GL_FALSE, (GLfloat *) toHeader(unival)); break;
+				case Mat4Value: glUniformMatrix4fv(loc, 1, GL_FALSE, (GLfloat *) toHeader(unival)); break;
+				//case PegUint32: glUniform1iv(loc, univalhdr->nStructs, (GLint *) toCData(unival)); break;
+				case FloatNbr: glUniform1fv(loc, 1, (GLfloat *) toCData(unival)); break;
+				case Vec2Value: glUniform2fv(loc, 1, (GLfloat *) toHeader(unival)); break;
+				case XyzValue: glUniform3fv(loc, 1, (GLfloat *) toHeader(unival)); break;
+				case ColorValue: case QuatValue:
+					glUniform4fv(loc, 1, (GLfloat *) toHeader(unival)); break;
+				default: 
+					assert(false && "Unsupported uniform type!!!");
 				}
-				if (isFloat(unival))
-					glUniform1f(glGetUniformLocation(pgmdata->program, uninamestr), toAfloat(unival));
-				else if (isInt(unival))
-					glUniform1i(glGetUniformLocation(pgmdata->program, uninamestr), toAint(unival));
-				else if (isCData(unival)) {
-					switch(getCDataType(unival)) {
-					case Mat2Value: glUniformMatrix2fv(glGetUniformLocation(pgmdata->program, uninamestr), 1, GL_FALSE, (GLfloat *) toHeader(unival)); break;
-					case Mat3Value: glUniformMatrix3fv(glGetUniformLocation(pgmdata->program, uninamestr), 1, GL_FALSE, (GLfloat *) toHeader(unival)); break;
-					case Mat4Value: 
-						glUniformMatrix4fv(glGetUniformLocation(pgmdata->program, uninamestr), 1, GL_FALSE, (GLfloat *) toHeader(unival)); break;
-					//case PegUint32: glUniform1iv(glGetUniformLocation(pgmdata->program, uninamestr), univalhdr->nStructs, (GLint *) toCData(unival)); break;
-					case FloatNbr: glUniform1fv(glGetUniformLocation(pgmdata->program, uninamestr), 1, (GLfloat *) toCData(unival)); break;
-					case Vec2Value: glUniform2fv(glGetUniformLocation(pgmdata->program, uninamestr), 1, (GLfloat *) toHeader(unival)); break;
-					case XyzValue: glUniform3fv(glGetUniformLocation(pgmdata->program, uninamestr), 1, (GLfloat *) toHeader(unival)); break;
-					case ColorValue: case QuatValue:
-						glUniform4fv(glGetUniformLocation(pgmdata->program, uninamestr), 1, (GLfloat *) toHeader(unival)); break;
-					default: 
-						//const char *x = toStr(uninamev);
-						assert(false && "Unsupported uniform type!!!");
-					}
-				} else if (isType(unival)) {
-					pushSym(th, "name");
-					Value name = getProperty(th, unival, getFromTop(th, 0));
-					popValue(th);
-					// If it is a texture, render it to get its texture unit value
-					if (isEqStr(name, "Texture")) {
-						pushSym(th, "_Render");
-						pushValue(th, unival);
-						pushLocal(th, contextidx);
-						getCall(th, 2, 1);
-						glUniform1i(glGetUniformLocation(pgmdata->program, uninamestr), toAint(popValue(th)));
-					}
+			}
+			// If a sampler is given a texture, render it to get its texture unit value
+			else if (isSamplerType(binding->type) && isType(unival))
+				glUniform1i(loc, shader_textureunit(th, unival, contextidx, binding->packable));
+			// A sampler array may be given a list of textures, one per element
+			else if (isSamplerType(binding->type) && isArr(unival)) {
+				GLint units[SHADER_MAXSAMPLERS];
+				AuintIdx n = getSize(unival);
+				if (n > (AuintIdx) binding->size) n = binding->size;
+				if (n > SHADER_MAXSAMPLERS) n = SHADER_MAXSAMPLERS;
+				for (AuintIdx i=0; i<n; i++) {
+					Value texture = arrGet(th, unival, i);
+					units[i] = isType(texture)? shader_textureunit(th, texture, contextidx, false) : 0;
 				}
+				glUniform1iv(loc, n, units);
 			}
 		}
 	}
 	else
-		glUseProgram(0);
+		glsUseProgram(0);
 
 	return 0;
 }
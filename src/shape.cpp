@@ -6,7 +6,149 @@
 */
 #include "pegasus3d.h"
 #include "xyzmath.h"
+#include "glstate.h"
+#include "renderqueue.h"
 #include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** Maximum number of coarser levels of detail a shape may be drawn at */
+#define SHAPE_MAXLODS 8
+
+/** Give the shape on top of the stack its vertex attribute arrays and index array,
+	adopting the filled buffers (any of which may be NULL) without copying them */
+static void shape_adoptbuffers(Value th, int shapeidx, AuintIdx nverts, GLfloat *pos, GLfloat *norm, GLfloat *uv,
+	AuintIdx nindices, char indxtype, void *indx) {
+	if (pos) {
+		array_adopt(th, "Xyzs", XyzValue, 3, nverts, pos);
+		popProperty(th, shapeidx, "positions");
+	}
+	if (norm) {
+		array_adopt(th, "Xyzs", XyzValue, 3, nverts, norm);
+		popProperty(th, shapeidx, "normals");
+	}
+	if (uv) {
+		array_adopt(th, "Uvs", Vec2Value, 2, nverts, uv);
+		popProperty(th, shapeidx, "uvs");
+	}
+	if (indx) {
+		array_adopt(th, "Integers", indxtype, 1, nindices, indx);
+		popProperty(th, shapeidx, "indices");
+	}
+}
+
+/** Fewest vertices a generated mesh needs before its rows are filled on several threads.
+	Below this, filling takes less time than starting threads. */
+#define SHAPE_THREADVERTS 65536
+/** Most threads a generated mesh's rows are split across */
+#define SHAPE_MAXTHREADS 8
+
+/** A generated mesh's parameters and the buffers its rows are filled into */
+struct ShapeGen {
+	void (*fillrows)(ShapeGen *gen, int first, int end);	//!< Fills rows first to end-1
+	int nsegments;		//!< Number of segments along each row
+	GLfloat size;		//!< Sphere's radius, or plane's uv repeat
+	GLfloat *pos;		//!< Positions buffer
+	GLfloat *norm;		//!< Normals buffer
+	GLfloat *uv;		//!< Uvs buffer
+	void *indx;			//!< Indices buffer
+	char indxtype;		//!< Type of each index
+};
+
+/** A thread's share of a generated mesh's rows */
+struct ShapeGenPart {
+	ShapeGen *gen;		//!< Mesh being generated
+	int first;			//!< First row to fill
+	int end;			//!< Row just past the last one to fill
+};
+
+/** Thread entry: fill one share of a generated mesh's rows */
+static int shape_genworker(void *partp) {
+	ShapeGenPart *part = (ShapeGenPart *) partp;
+	part->gen->fillrows(part->gen, part->first, part->end);
+	return 0;
+}
+
+/** Fill a generated mesh's nrows rows. A large mesh's rows are split across several threads,
+	which is safe as each row writes only to buffer positions that follow from its number. */
+static void shape_genrows(ShapeGen *gen, int nrows, AuintIdx nverts) {
+	int nparts = nverts < SHAPE_THREADVERTS? 1 : SDL_GetCPUCount();
+	if (nparts > SHAPE_MAXTHREADS)
+		nparts = SHAPE_MAXTHREADS;
+	if (nparts > nrows)
+		nparts = nrows;
+	if (nparts <= 1) {
+		gen->fillrows(gen, 0, nrows);
+		return;
+	}
+
+	// Start a thread for every share but the first, which this thread fills.
+	// A share whose thread cannot be started is filled here too.
+	ShapeGenPart parts[SHAPE_MAXTHREADS];
+	SDL_Thread *threads[SHAPE_MAXTHREADS];
+	for (int p=0; p<nparts; p++) {
+		parts[p].gen = gen;
+		parts[p].first = (int) ((long long) nrows * p / nparts);
+		parts[p].end = (int) ((long long) nrows * (p+1) / nparts);
+		threads[p] = p>0? SDL_CreateThread(shape_genworker, "ShapeGen", &parts[p]) : NULL;
+	}
+	for (int p=0; p<nparts; p++) {
+		if (threads[p] == NULL)
+			shape_genworker(&parts[p]);
+	}
+	for (int p=1; p<nparts; p++) {
+		if (threads[p])
+			SDL_WaitThread(threads[p], NULL);
+	}
+}
+
+/** Fill a sphere's rings first+1 to end: each ring's vertices, around the circle,
+	and the triangles joining it to the ring (or pole) above */
+static void shape_sphererings(ShapeGen *gen, int first, int end) {
+	int nsegments = gen->nsegments;
+	GLfloat radius = gen->size;
+	GLfloat *pos = gen->pos, *norm = gen->norm, *uv = gen->uv;
+	void *indx = gen->indx;
+	char indxtype = gen->indxtype;
+	int ringsz = nsegments+1;
+	for (int i=first+1; i<=end; i++) {
+		GLfloat mang = (GLfloat)M_PI * ((GLfloat)i) / ((GLfloat)(nsegments));
+		GLfloat y = cos(mang);
+		GLfloat ringr = sin(mang);
+		GLfloat v = (GLfloat)(nsegments-i)/(GLfloat)nsegments;
+		AuintIdx ring = (i-1)*ringsz + 1;
+		for (int j=0; j<=nsegments; j++) {
+			GLfloat nang = 2.0f * (GLfloat)M_PI * ((GLfloat)j) / ((GLfloat)nsegments);
+			GLfloat x = j<nsegments? -cos(nang)*ringr : -ringr;
+			GLfloat z = j<nsegments? sin(nang)*ringr : 0.0f;
+			AuintIdx vert = ring + j;
+			norm[3*vert] = x; norm[3*vert+1] = y; norm[3*vert+2] = z;
+			pos[3*vert] = x*radius; pos[3*vert+1] = y*radius; pos[3*vert+2] = z*radius;
+			uv[2*vert] = (GLfloat)j/(GLfloat)nsegments;
+			uv[2*vert+1] = v;
+		}
+
+		// Generate one triangle per segment next to the top pole, two per segment elsewhere
+		for (int j=0; j<nsegments; j++) {
+			if (i==1) {
+				AuintIdx at = 3*j;
+				integers_put(indx, indxtype, at, 0);
+				integers_put(indx, indxtype, at+1, ring+j+1);
+				integers_put(indx, indxtype, at+2, ring+j);
+			} else {
+				AuintIdx at = 3*nsegments + 6*((i-2)*nsegments + j);
+				AuintIdx v0 = ring-ringsz+j;
+				AuintIdx v3 = ring+j;
+				integers_put(indx, indxtype, at, v0);
+				integers_put(indx, indxtype, at+1, v3+1);
+				integers_put(indx, indxtype, at+2, v3);
+				integers_put(indx, indxtype, at+3, v0);
+				integers_put(indx, indxtype, at+4, v0+1);
+				integers_put(indx, indxtype, at+5, v3+1);
+			}
+		}
+	}
+}
 
 /** Generate a sphere shape centered at (0,0,0), passing radius and nsegments.
 	The geometry is via longitude and latitude divisions. 
@@ -16,140 +158,94 @@ int shape_sphere(Value th) {
 	// Obtain and validate parameters
 	float radius = getTop(th)>=2 && isFloat(getLocal(th, 1))? toAfloat(getLocal(th,1)) : 1.0f;
 	int nsegments = getTop(th)>=3 && isInt(getLocal(th, 2))? toAint(getLocal(th,2)) : 15;
-	int nverts = (nsegments+1) * (nsegments-2) + 2;
-	int nindices = 6*nsegments*nsegments;
-	if (nsegments<=2 || nverts>=65536) {
+	if (nsegments<=2) {
 		pushValue(th, aNull);
 		return 1;
 	}
 
-	// Push a new Shape on the stack and give it buffer properties
+	// A pole vertex at top and bottom, with nsegments-1 latitude rings between.
+	// Each ring repeats its first vertex at the end, so u can reach 1 at the seam.
+	int ringsz = nsegments+1;
+	AuintIdx nverts = (nsegments-1) * ringsz + 2;
+	AuintIdx nindices = 6*nsegments*(nsegments-1);
+	AuintIdx bottom = nverts-1;
+
+	// Allocate every buffer at its exact size up front, for filling in place
+	char indxtype = integers_type(nverts-1);
+	GLfloat *pos = (GLfloat *) malloc(nverts*3*sizeof(GLfloat));
+	GLfloat *norm = (GLfloat *) malloc(nverts*3*sizeof(GLfloat));
+	GLfloat *uv = (GLfloat *) malloc(nverts*2*sizeof(GLfloat));
+	void *indx = malloc(nindices*integers_nbrsize(indxtype));
+
+	// Top and bottom pole vertices
+	pos[0] = 0.f; pos[1] = radius; pos[2] = 0.f;
+	norm[0] = 0.f; norm[1] = 1.f; norm[2] = 0.f;
+	uv[0] = 0.f; uv[1] = 1.f;
+	pos[3*bottom] = 0.f; pos[3*bottom+1] = -radius; pos[3*bottom+2] = 0.f;
+	norm[3*bottom] = 0.f; norm[3*bottom+1] = -1.f; norm[3*bottom+2] = 0.f;
+	uv[2*bottom] = 0.f; uv[2*bottom+1] = 0.f;
+
+	// Each ring's vertices, and the triangles joining it to the ring (or pole) above
+	ShapeGen gen = {shape_sphererings, nsegments, radius, pos, norm, uv, indx, indxtype};
+	shape_genrows(&gen, nsegments-1, nverts);
+
+	// Triangles joining the last ring to the bottom pole
+	AuintIdx lastring = (nsegments-2)*ringsz + 1;
+	for (int j=0; j<nsegments; j++) {
+		AuintIdx at = nindices - 3*nsegments + 3*j;
+		integers_put(indx, indxtype, at, lastring+j);
+		integers_put(indx, indxtype, at+1, lastring+j+1);
+		integers_put(indx, indxtype, at+2, bottom);
+	}
+
+	// Push a new Shape on the stack and give it the filled buffers
 	int sphereidx = getTop(th);
 	pushSym(th, "New");
 	pushGloVar(th, "Shape");
 	getCall(th, 1, 1);
-	pushSym(th, "New");
-	pushGloVar(th, "Xyzs");
-	pushValue(th, anInt(nverts));
-	getCall(th, 2, 1);
-	Value posval = getFromTop(th, 0);
-	popProperty(th, sphereidx, "positions");
-	pushSym(th, "New");
-	pushGloVar(th, "Xyzs");
-	pushValue(th, anInt(nverts));
-	getCall(th, 2, 1);
-	Value normval = getFromTop(th, 0);
-	popProperty(th, sphereidx, "normals");
-	pushSym(th, "New");
-	pushGloVar(th, "Uvs");
-	pushValue(th, anInt(nverts));
-	getCall(th, 2, 1);
-	Value uvval = getFromTop(th, 0);
-	popProperty(th, sphereidx, "uvs");
-	pushSym(th, "New");
-	pushGloVar(th, "Integers");
-	pushValue(th, anInt(nindices));
-	getCall(th, 2, 1);
-	Value indxval = getFromTop(th, 0);
-	popProperty(th, sphereidx, "indices");
-
-    // Top pole vertex
-	GLfloat zero = 0.f;
-	GLfloat one = 1.f;
-	strAppend(th, posval, (const char*)(&zero), sizeof(GLfloat));
-	strAppend(th, posval, (const char*)(&radius), sizeof(GLfloat));
-	strAppend(th, posval, (const char*)(&zero), sizeof(GLfloat));
-	strAppend(th, normval, (const char*)(&zero), sizeof(GLfloat));
-	strAppend(th, normval, (const char*)(&one), sizeof(GLfloat));
-	strAppend(th, normval, (const char*)(&zero), sizeof(GLfloat));
-	strAppend(th, uvval, (const char*)(&zero), sizeof(GLfloat));
-	strAppend(th, uvval, (const char*)(&one), sizeof(GLfloat));
-
-    // each vertex,  vertically and then around the circle
-	int v0, v1, v2, v3;
-	for (int i=1; i<nsegments; i++) {
-		GLfloat mang = (GLfloat)M_PI * ((GLfloat)i) / ((GLfloat)(nsegments));
-		for (int j=0; j<nsegments; j++) {
-			GLfloat nang = 2.0f * (GLfloat)M_PI * ((GLfloat)j) / ((GLfloat)nsegments); 
-			GLfloat x = -cos(nang)*sin(mang);
-			GLfloat y = cos(mang);
-			GLfloat z = sin(nang)*sin(mang);
-
-			strAppend(th, normval, (const char*)(&x), sizeof(GLfloat));
-			strAppend(th, normval, (const char*)(&y), sizeof(GLfloat));
-			strAppend(th, normval, (const char*)(&z), sizeof(GLfloat));
-			x *= radius;
-			y *= radius;
-			z *= radius;
-			strAppend(th, posval, (const char*)(&x), sizeof(GLfloat));
-			strAppend(th, posval, (const char*)(&y), sizeof(GLfloat));
-			strAppend(th, posval, (const char*)(&z), sizeof(GLfloat));
-			GLfloat uv1 = (GLfloat)j/(GLfloat)nsegments;
-			GLfloat uv2 = (GLfloat)(nsegments-i)/(GLfloat)nsegments;
-			strAppend(th, uvval, (const char*)(&uv1), sizeof(GLfloat));
-			strAppend(th, uvval, (const char*)(&uv2), sizeof(GLfloat));
-
-			// Generate two triangles per segment
-			if (i==1) {
-				v0 = 0;
-				v1 = j+2;
-				v2 = j+1;
-				strAppend(th, indxval, (const char*)(&v0), sizeof(unsigned short));
-				strAppend(th, indxval, (const char*)(&v1), sizeof(unsigned short));
-				strAppend(th, indxval, (const char*)(&v2), sizeof(unsigned short));
-			} else {
-				v0 = ((i-2)*nsegments)+j+1;
-				v1 = ((i-2)*nsegments)+(j+2);
-				v2 = ((i-1)*nsegments)+(j+2);
-				v3 = ((i-1)*nsegments)+j+1;
-				strAppend(th, indxval, (const char*)(&v0), sizeof(unsigned short));
-				strAppend(th, indxval, (const char*)(&v2), sizeof(unsigned short));
-				strAppend(th, indxval, (const char*)(&v3), sizeof(unsigned short));
-				strAppend(th, indxval, (const char*)(&v0), sizeof(unsigned short));
-				strAppend(th, indxval, (const char*)(&v1), sizeof(unsigned short));
-				strAppend(th, indxval, (const char*)(&v2), sizeof(unsigned short));
-			}
+	shape_adoptbuffers(th, sphereidx, nverts, pos, norm, uv, nindices, indxtype, indx);
+	return 1;
+}
+
+/** Fill a plane's rows first to end-1: each row of vertices, and the triangles joining it to the row before */
+static void shape_planerows(ShapeGen *gen, int first, int end) {
+	int nsegments = gen->nsegments;
+	GLfloat uvrepeat = gen->size;
+	GLfloat *pos = gen->pos, *norm = gen->norm, *uv = gen->uv;
+	void *indx = gen->indx;
+	char indxtype = gen->indxtype;
+	int rowsz = nsegments+1;
+	for (int segz=first; segz<end; segz++) {
+		GLfloat z = 2.0f * (GLfloat)segz/(GLfloat)nsegments - 1.0f;
+		GLfloat v = uvrepeat * (1.0f - (GLfloat)segz/(GLfloat)nsegments);
+		AuintIdx row = segz*rowsz;
+		for (int segx=0; segx<=nsegments; segx++) {
+			AuintIdx vert = row + segx;
+			pos[3*vert] = 2.0f * (GLfloat)segx/(GLfloat)nsegments - 1.0f;
+			pos[3*vert+1] = 0.0f;
+			pos[3*vert+2] = z;
+			norm[3*vert] = 0.0f;
+			norm[3*vert+1] = 1.0f;
+			norm[3*vert+2] = 0.0f;
+			uv[2*vert] = uvrepeat * (GLfloat)segx/(GLfloat)nsegments;
+			uv[2*vert+1] = v;
 		}
-		GLfloat x = -sin(mang);
-		GLfloat y = cos(mang);
-		GLfloat z = 0.0f;
-		strAppend(th, normval, (const char*)(&x), sizeof(GLfloat));
-		strAppend(th, normval, (const char*)(&y), sizeof(GLfloat));
-		strAppend(th, normval, (const char*)(&z), sizeof(GLfloat));
-		x *= radius;
-		y *= radius;
-		z *= radius;
-		strAppend(th, posval, (const char*)(&x), sizeof(GLfloat));
-		strAppend(th, posval, (const char*)(&y), sizeof(GLfloat));
-		strAppend(th, posval, (const char*)(&z), sizeof(GLfloat));
-		GLfloat uv1 = 1.0f;
-		GLfloat uv2 = (GLfloat)(nsegments-i)/(GLfloat)nsegments;
-		strAppend(th, uvval, (const char*)(&uv1), sizeof(GLfloat));
-		strAppend(th, uvval, (const char*)(&uv2), sizeof(GLfloat));
-	}
-
-	// Bottom pole vertex
-	strAppend(th, uvval, (const char*)(&zero), sizeof(GLfloat));
-	strAppend(th, uvval, (const char*)(&zero), sizeof(GLfloat));
-	radius = -radius;
-	one = -one;
-	strAppend(th, posval, (const char*)(&zero), sizeof(GLfloat));
-	strAppend(th, posval, (const char*)(&radius), sizeof(GLfloat));
-	strAppend(th, posval, (const char*)(&zero), sizeof(GLfloat));
-	strAppend(th, normval, (const char*)(&zero), sizeof(GLfloat));
-	strAppend(th, normval, (const char*)(&one), sizeof(GLfloat));
-	strAppend(th, normval, (const char*)(&zero), sizeof(GLfloat));
 
-	for (int j=0; j<nsegments; j++) {
-		v0 = ((nsegments-2)*nsegments)+j+1;
-		v1 = (j==nsegments-1)? ((nsegments-2)*nsegments)+1 : ((nsegments-2)*nsegments)+j+2;
-		v2 = ((nsegments-1)*nsegments)+1;
-		strAppend(th, indxval, (const char*)(&v0), sizeof(unsigned short));
-		strAppend(th, indxval, (const char*)(&v1), sizeof(unsigned short));
-		strAppend(th, indxval, (const char*)(&v2), sizeof(unsigned short));
+		// Generate two triangles per segment
+		if (segz>0) {
+			for (int segx=1; segx<=nsegments; segx++) {
+				AuintIdx at = 6*((segz-1)*nsegments + segx-1);
+				AuintIdx v0 = row-rowsz+segx-1;
+				AuintIdx v3 = row+segx-1;
+				integers_put(indx, indxtype, at, v0);
+				integers_put(indx, indxtype, at+1, v3+1);
+				integers_put(indx, indxtype, at+2, v3);
+				integers_put(indx, indxtype, at+3, v0);
+				integers_put(indx, indxtype, at+4, v0+1);
+				integers_put(indx, indxtype, at+5, v3+1);
+			}
+		}
 	}
-
-	return 1;
 }
 
 /** Generate a plane surface shape centered on (0,0,0), passing nsegments.
@@ -160,77 +256,31 @@ int shape_plane(Value th) {
 	// Obtain and validate parameters
 	int nsegments = getTop(th)>=2 && isInt(getLocal(th, 1))? toAint(getLocal(th,1)) : 1;
 	GLfloat uvrepeat = getTop(th)>=3 && isFloat(getLocal(th, 2))? toAfloat(getLocal(th,2)) : 1.0f;
-	int nverts = (nsegments+1) * (nsegments+1);
-	int nindices = 6*nsegments*nsegments;
-	if (nsegments<1 || nverts>=65536) {
+	if (nsegments<1) {
 		pushValue(th, aNull);
 		return 1;
 	}
-
-	// Push a new Shape on the stack and give it buffer properties
+	int rowsz = nsegments+1;
+	AuintIdx nverts = rowsz * rowsz;
+	AuintIdx nindices = 6*nsegments*nsegments;
+
+	// Allocate every buffer at its exact size up front, for filling in place
+	char indxtype = integers_type(nverts-1);
+	GLfloat *pos = (GLfloat *) malloc(nverts*3*sizeof(GLfloat));
+	GLfloat *norm = (GLfloat *) malloc(nverts*3*sizeof(GLfloat));
+	GLfloat *uv = (GLfloat *) malloc(nverts*2*sizeof(GLfloat));
+	void *indx = malloc(nindices*integers_nbrsize(indxtype));
+
+	// Each row of vertices, and the triangles joining it to the row before
+	ShapeGen gen = {shape_planerows, nsegments, uvrepeat, pos, norm, uv, indx, indxtype};
+	shape_genrows(&gen, nsegments+1, nverts);
+
+	// Push a new Shape on the stack and give it the filled buffers
 	int planeidx = getTop(th);
 	pushSym(th, "New");
 	pushGloVar(th, "Shape");
 	getCall(th, 1, 1);
-	pushSym(th, "New");
-	pushGloVar(th, "Xyzs");
-	pushValue(th, anInt(nverts));
-	getCall(th, 2, 1);
-	Value posval = getFromTop(th, 0);
-	popProperty(th, planeidx, "positions");
-	pushSym(th, "New");
-	pushGloVar(th, "Xyzs");
-	pushValue(th, anInt(nverts));
-	getCall(th, 2, 1);
-	Value normval = getFromTop(th, 0);
-	popProperty(th, planeidx, "normals");
-	pushSym(th, "New");
-	pushGloVar(th, "Uvs");
-	pushValue(th, anInt(nverts));
-	getCall(th, 2, 1);
-	Value uvval = getFromTop(th, 0);
-	popProperty(th, planeidx, "uvs");
-	pushSym(th, "New");
-	pushGloVar(th, "Integers");
-	pushValue(th, anInt(nindices));
-	getCall(th, 2, 1);
-	Value indxval = getFromTop(th, 0);
-	popProperty(th, planeidx, "indices");
-
-    // each vertex,  vertically and then horizontally
-	int v0, v1, v2, v3;
-	GLfloat zero = 0.0f;
-	GLfloat one = 1.0f;
-	for (int segz=0; segz<=nsegments; segz++) {
-		for (int segx=0; segx<=nsegments; segx++) {
-			GLfloat x = 2.0f * (GLfloat)segx/(GLfloat)nsegments - 1.0f;
-			GLfloat z = 2.0f * (GLfloat)segz/(GLfloat)nsegments - 1.0f;
-			strAppend(th, posval, (const char*)(&x), sizeof(GLfloat));
-			strAppend(th, posval, (const char*)(&zero), sizeof(GLfloat));
-			strAppend(th, posval, (const char*)(&z), sizeof(GLfloat));
-			strAppend(th, normval, (const char*)(&zero), sizeof(GLfloat));
-			strAppend(th, normval, (const char*)(&one), sizeof(GLfloat));
-			strAppend(th, normval, (const char*)(&zero), sizeof(GLfloat));
-			GLfloat uv1 = uvrepeat * (GLfloat)segx/(GLfloat)nsegments;
-			GLfloat uv2 = uvrepeat * (1.0f - (GLfloat)segz/(GLfloat)nsegments);
-			strAppend(th, uvval, (const char*)(&uv1), sizeof(GLfloat));
-			strAppend(th, uvval, (const char*)(&uv2), sizeof(GLfloat));
-
-			// Generate two triangles per segment
-			if (segx>0 && segz>0) {
-				v0 = ((segz-1)*(nsegments+1))+segx-1;
-				v1 = ((segz-1)*(nsegments+1))+segx;
-				v2 = (segz*(nsegments+1))+segx;
-				v3 = (segz*(nsegments+1))+segx-1;
-				strAppend(th, indxval, (const char*)(&v0), sizeof(unsigned short));
-				strAppend(th, indxval, (const char*)(&v2), sizeof(unsigned short));
-				strAppend(th, indxval, (const char*)(&v3), sizeof(unsigned short));
-				strAppend(th, indxval, (const char*)(&v0), sizeof(unsigned short));
-				strAppend(th, indxval, (const char*)(&v1), sizeof(unsigned short));
-				strAppend(th, indxval, (const char*)(&v2), sizeof(unsigned short));
-			}
-		}
-	}
+	shape_adoptbuffers(th, planeidx, nverts, pos, norm, uv, nindices, indxtype, indx);
 	return 1;
 }
 
@@ -242,37 +292,30 @@ const GLfloat cube_positions[] = {
 	-1., -1., -1.,  -1., 1., -1.,  -1., 1., 1.,  -1., -1., 1.,
 	1., -1., -1.,  1., 1., -1.,  1., 1., 1.,  1., -1., 1.
 };
-const char cube_indices[] = 
-	"0,1,2, 0,2,3, 4,5,6, 4,6,7, 8,9,10, 8,10,11, 12,13,14, 12,14,15, 16,17,18, 16,18,19, 20,21,22, 20,22,23";
+const GLushort cube_indices[] = {
+	0,1,2, 0,2,3, 4,5,6, 4,6,7, 8,9,10, 8,10,11, 12,13,14, 12,14,15, 16,17,18, 16,18,19, 20,21,22, 20,22,23
+};
 
 /** Generate a cube centered at 0.0.0. Parameter specifies its size. It has no uvs or normals. */
 int shape_cube(Value th) {
 	// Obtain and validate parameters
 	GLfloat cubesize = getTop(th)>=2 && isFloat(getLocal(th, 1))? toAfloat(getLocal(th,1)) : 1.0f;
-	int nverts = 72;
+	AuintIdx nverts = sizeof(cube_positions) / (3*sizeof(GLfloat));
+	AuintIdx nindices = sizeof(cube_indices) / sizeof(GLushort);
 
-	// Push a new Shape on the stack and give it buffer properties
+	// Fill exactly-sized buffers
+	GLfloat *pos = (GLfloat *) malloc(sizeof(cube_positions));
+	for (AuintIdx v = 0; v<3*nverts; v++)
+		pos[v] = cubesize * cube_positions[v];
+	GLushort *indx = (GLushort *) malloc(sizeof(cube_indices));
+	memcpy(indx, cube_indices, sizeof(cube_indices));
+
+	// Push a new Shape on the stack and give it the filled buffers
 	int cubeidx = getTop(th);
 	pushSym(th, "New");
 	pushGloVar(th, "Shape");
 	getCall(th, 1, 1);
-	pushSym(th, "New");
-	pushGloVar(th, "Xyzs");
-	pushValue(th, anInt(nverts));
-	getCall(th, 2, 1);
-	Value posval = getFromTop(th, 0);
-	popProperty(th, cubeidx, "positions");
-	pushSym(th, "New");
-	pushGloVar(th, "Integers");
-	pushString(th, aNull, cube_indices);
-	getCall(th, 2, 1);
-	popProperty(th, cubeidx, "indices");
-
-	for (int v = 0; v<nverts; v++) {
-		GLfloat pos = cubesize * cube_positions[v];
-		strAppend(th, posval, (const char*)(&pos), sizeof(GLfloat));
-	}
-
+	shape_adoptbuffers(th, cubeidx, nverts, pos, NULL, NULL, nindices, Uint16Nbr, indx);
 	return 1;
 }
 
@@ -315,118 +358,576 @@ int shape_new(Value th) {
 	return 1;
 }
 
-/** Prepare a shape for rendering */
+void shader_drawkeys(Value th, Value shader, Value shape, Value context, GLuint *program, GLuint *texture);
+bool shader_instanced(Value th, Value shader);
+int mesh_optimize(Value th);
+int mesh_makelods(Value th);
+int mesh_save(Value th);
+
+/** Structure for a shape's local bounds, kept until its positions change */
+struct ShapeBounds {
+	Value src;			//!< Positions array the bounds were computed from
+	unsigned int gen;	//!< Positions' generation stamp when computed
+	Xyz min;			//!< Smallest x, y and z of any vertex
+	Xyz max;			//!< Largest x, y and z of any vertex
+	Xyz center;			//!< Center of the bounding sphere
+	GLfloat radius;		//!< Radius of the bounding sphere
+};
+
+/** Get the i-th vertex position from positions of the member type (floats or half floats) */
+static void shape_getpos(const void *verts, char mbrType, AuintIdx i, Xyz *pos) {
+	if (mbrType == HalfNbr) {
+		const GLushort *halfs = (const GLushort *) verts + 3*i;
+		pos->x = array_fromhalf(halfs[0]);
+		pos->y = array_fromhalf(halfs[1]);
+		pos->z = array_fromhalf(halfs[2]);
+	}
+	else
+		*pos = ((const Xyz *) verts)[i];
+}
+
+/** Get the shape's local bounds, recomputing them if its positions have changed.
+	Returns NULL if the shape has no positions to bound. */
+ShapeBounds *shape_getbounds(Value th, int selfidx) {
+	Value positions = getProperty(th, getLocal(th, selfidx), pegsym.positions);
+	if (!isCDataType(positions, ArrayValue))
+		return NULL;
+	ArrayHeader *poshdr = toArrayHeader(positions);
+	if (poshdr->mbrType != XyzValue && poshdr->mbrType != HalfNbr)
+		return NULL;
+	AuintIdx nverts = getSize(positions) / array_structsize(poshdr->mbrType, 3);
+	if (nverts == 0)
+		return NULL;
+
+	Value boundsv = getProperty(th, getLocal(th, selfidx), pegsym._bounds);
+	if (boundsv == aNull) {
+		boundsv = pushCData(th, aNull, BoundsValue, 0, sizeof(ShapeBounds)); // Is small enough to stick in header
+		((ShapeBounds*) toHeader(boundsv))->src = aNull;
+		popProperty(th, selfidx, "_bounds");
+	}
+	ShapeBounds *bounds = (ShapeBounds*) toHeader(boundsv);
+	if (bounds->src == positions && bounds->gen == poshdr->gen)
+		return bounds;
+
+	// Box the vertices, then grow a sphere around the box's center to reach them all
+	const void *verts = toCData(positions);
+	shape_getpos(verts, poshdr->mbrType, 0, &bounds->min);
+	bounds->max = bounds->min;
+	for (AuintIdx i=1; i<nverts; i++) {
+		Xyz v;
+		shape_getpos(verts, poshdr->mbrType, i, &v);
+		if (v.x < bounds->min.x) bounds->min.x = v.x;
+		if (v.x > bounds->max.x) bounds->max.x = v.x;
+		if (v.y < bounds->min.y) bounds->min.y = v.y;
+		if (v.y > bounds->max.y) bounds->max.y = v.y;
+		if (v.z < bounds->min.z) bounds->min.z = v.z;
+		if (v.z > bounds->max.z) bounds->max.z = v.z;
+	}
+	bounds->center.x = 0.5f*(bounds->min.x + bounds->max.x);
+	bounds->center.y = 0.5f*(bounds->min.y + bounds->max.y);
+	bounds->center.z = 0.5f*(bounds->min.z + bounds->max.z);
+	GLfloat maxdist2 = 0.0f;
+	for (AuintIdx i=0; i<nverts; i++) {
+		Xyz v, d;
+		shape_getpos(verts, poshdr->mbrType, i, &v);
+		xyzSub(&d, &v, &bounds->center);
+		GLfloat dist2 = d.x*d.x + d.y*d.y + d.z*d.z;
+		if (dist2 > maxdist2)
+			maxdist2 = dist2;
+	}
+	bounds->radius = sqrt(maxdist2);
+	bounds->src = positions;
+	bounds->gen = poshdr->gen;
+	return bounds;
+}
+
+/** Widen local bounds (min, max, center, radius) to enclose every placement in an "instances" list.
+	Returns false if the list holds no instance matrices. */
+bool shape_instancebounds(Value th, Value instances, Xyz *min, Xyz *max, Xyz *center, GLfloat *radius) {
+	Xyz boxcenter, boxextent;
+	boxcenter.x = 0.5f*(max->x + min->x); boxextent.x = 0.5f*(max->x - min->x);
+	boxcenter.y = 0.5f*(max->y + min->y); boxextent.y = 0.5f*(max->y - min->y);
+	boxcenter.z = 0.5f*(max->z + min->z); boxextent.z = 0.5f*(max->z - min->z);
+	bool found = false;
+	AuintIdx sz = getSize(instances);
+	for (AuintIdx i=0; i<sz; i++) {
+		Value matv = arrGet(th, instances, i);
+		if (!isMat4(matv))
+			continue;
+		Xyz c, e, lo, hi;
+		mat4MultBox(&c, &e, toMat4(matv), &boxcenter, &boxextent);
+		xyzSub(&lo, &c, &e);
+		xyzAdd(&hi, &c, &e);
+		if (!found) {
+			*min = lo; *max = hi;
+			found = true;
+			continue;
+		}
+		if (lo.x < min->x) min->x = lo.x;
+		if (hi.x > max->x) max->x = hi.x;
+		if (lo.y < min->y) min->y = lo.y;
+		if (hi.y > max->y) max->y = hi.y;
+		if (lo.z < min->z) min->z = lo.z;
+		if (hi.z > max->z) max->z = hi.z;
+	}
+	if (!found)
+		return false;
+
+	// The sphere simply encloses the widened box
+	Xyz halfdiag;
+	center->x = 0.5f*(max->x + min->x); halfdiag.x = 0.5f*(max->x - min->x);
+	center->y = 0.5f*(max->y + min->y); halfdiag.y = 0.5f*(max->y - min->y);
+	center->z = 0.5f*(max->z + min->z); halfdiag.z = 0.5f*(max->z - min->z);
+	*radius = sqrt(halfdiag.x*halfdiag.x + halfdiag.y*halfdiag.y + halfdiag.z*halfdiag.z);
+	return true;
+}
+
+/** Prepare a shape for rendering, queuing it to be drawn by the camera */
 int shape_renderprep(Value th) {
 	int selfidx = 0;
 	int cameraidx = 1;
 
+	// Queue the shape, noting what it needs for sorting
+	Value self = getLocal(th, selfidx);
+	Value mmatv = getProperty(th, self, pegsym.mmatrix);
+	RenderItem *item = renderqueue_add(self, isMat4(mmatv)? toMat4(mmatv) : NULL);
+	Value transparent = getProperty(th, self, pegsym.transparent);
+	item->transparent = !isFalse(transparent);
+	Value shader = getProperty(th, self, pegsym.shader);
+	if (shader == aNull)
+		shader = getProperty(th, getLocal(th, cameraidx), pegsym.shader);
+	shader_drawkeys(th, shader, getLocal(th, selfidx), getLocal(th, cameraidx), &item->program, &item->texture);
+
+	// Give it world bounds, so the camera can cull it if out of view
+	ShapeBounds *bounds = shape_getbounds(th, selfidx);
+	if (bounds) {
+		Value instances = getProperty(th, self, pegsym.instances);
+		Xyz min = bounds->min, max = bounds->max, center = bounds->center;
+		GLfloat radius = bounds->radius;
+		if (!isArr(instances) || shape_instancebounds(th, instances, &min, &max, &center, &radius))
+			renderqueue_bound(item, &min, &max, &center, radius);
+	}
+
+	// Note how many coarser levels of detail it has, and which it was last drawn at
+	Value lods = getProperty(th, self, pegsym.lods);
+	if (isArr(lods)) {
+		AuintIdx nlods = getSize(lods);
+		if (nlods > SHAPE_MAXLODS)
+			nlods = SHAPE_MAXLODS;
+		while (item->nlods < (int)nlods && isCDataType(arrGet(th, lods, item->nlods), ArrayValue))
+			item->nlods++;
+		item->lod = item->lastlod = renderqueue_lastlod(self, item->lodslot);
+	}
+
+	return 0;
+}
+
+/** Maximum number of vertex attributes a shape's shader may use */
+#define SHAPE_MAXATTRS 16
+
+/** A GPU buffer object and what was last copied into it */
+struct ShapeVbo {
+	GLuint buffer;		//!< Handle for OpenGL buffer object
+	Value src;			//!< Array value last copied into the buffer
+	AuintIdx size;		//!< Number of bytes last copied into the buffer
+	unsigned int gen;	//!< Array's generation stamp when last copied
+};
+
+/** Structure for holding a shape's GPU-resident vertex buffers.
+  We keep these across frames so that static geometry is uploaded only once,
+  and depend on a finalizer to delete them when the shape is no longer referenced. */
+struct ShapeBuffers {
+	Value owner;		//!< Shape these buffers were created for
+	Value attrlist;		//!< Shader's attribute list the vao was set up for
+	GLuint vao;			//!< Handle for OpenGL vertex array object
+	ShapeVbo vbo[SHAPE_MAXATTRS];	//!< Vertex buffer object for each attribute
+	ShapeVbo ebo;		//!< Element (indices) buffer object
+	ShapeVbo inst;		//!< Per-instance matrix buffer object
+	ShapeVbo lodebo[SHAPE_MAXLODS];	//!< Element buffer object for each coarser level of detail
+	ShapeVbo packed;	//!< Interleaved vertex buffer object, when the shape is packed (src is the attribute list)
+	GLsizei stride;		//!< Bytes per vertex in the interleaved buffer
+	Value packsrc[SHAPE_MAXATTRS];	//!< Array interleaved for each attribute (aNull if none)
+	unsigned int packgen[SHAPE_MAXATTRS];	//!< Each interleaved array's generation stamp when packed
+};
+
+/** Close out a shape's vertex buffers that are no longer referenced anywhere */
+int shape_closebuffers(Value bufv) {
+	ShapeBuffers *bufs = (ShapeBuffers*) toHeader(bufv);
+	for (int i=0; i<SHAPE_MAXATTRS; i++)
+		glsDeleteBuffers(1, &bufs->vbo[i].buffer);
+	glsDeleteBuffers(1, &bufs->ebo.buffer);
+	glsDeleteBuffers(1, &bufs->inst.buffer);
+	for (int i=0; i<SHAPE_MAXLODS; i++)
+		glsDeleteBuffers(1, &bufs->lodebo[i].buffer);
+	glsDeleteBuffers(1, &bufs->packed.buffer);
+	glsDeleteVertexArrays(1, &bufs->vao);
+	return 1;
+}
+
+/** Get the shape's vertex buffers, creating them if this shape does not have its own yet */
+ShapeBuffers *shape_getbuffers(Value th, int selfidx) {
+	Value bufv = getProperty(th, getLocal(th, selfidx), pegsym._buffers);
+	if (bufv==aNull || ((ShapeBuffers*) toHeader(bufv))->owner != getLocal(th, selfidx)) {
+		Value buftype = pushProperty(th, selfidx, "_bufferstype");
+		bufv = strHasFinalizer(pushCData(th, buftype, ShapeBufValue, 0, sizeof(ShapeBuffers))); // Is small enough to stick in header
+		ShapeBuffers *bufs = (ShapeBuffers*) toHeader(bufv);
+		memset(bufs, 0, sizeof(ShapeBuffers));
+		bufs->owner = getLocal(th, selfidx);
+		bufs->attrlist = aNull;
+		bufs->ebo.src = aNull;
+		bufs->inst.src = aNull;
+		bufs->packed.src = aNull;
+		for (int i=0; i<SHAPE_MAXLODS; i++)
+			bufs->lodebo[i].src = aNull;
+		for (int i=0; i<SHAPE_MAXATTRS; i++)
+			bufs->vbo[i].src = bufs->packsrc[i] = aNull;
+		glGenVertexArrays(1, &bufs->vao);
+		popProperty(th, selfidx, "_buffers");
+		popValue(th); // _bufferstype
+	}
+	return (ShapeBuffers*) toHeader(bufv);
+}
+
+/** Copy an array's contents into a buffer object, sending only what changed since the last copy.
+	Returns 1 if the buffer's storage was (re)created, meaning its vao pointers need setting. */
+int shape_upload(ShapeVbo *vbo, GLenum target, Value array) {
+	ArrayHeader *hdr = toArrayHeader(array);
+	AuintIdx size = getSize(array);
+
+	// Different array or size: (re)allocate storage and copy everything
+	if (vbo->src != array || vbo->size != size || vbo->buffer == 0) {
+		if (vbo->buffer == 0)
+			glGenBuffers(1, &vbo->buffer);
+		glsBindBuffer(target, vbo->buffer);
+		glBufferData(target, size, toCData(array), GL_STATIC_DRAW); /* Copy data */
+		vbo->src = array;
+		vbo->size = size;
+		vbo->gen = hdr->gen;
+		array_clean(hdr);
+		return 1;
+	}
+
+	// Same array, changed contents: copy just the dirty range if we hold everything before it
+	if (vbo->gen != hdr->gen) {
+		glsBindBuffer(target, vbo->buffer);
+		AuintIdx hi = hdr->dirtyHi < size? hdr->dirtyHi : size;
+		if (vbo->gen == hdr->cleanGen && hdr->dirtyLo < hi)
+			glBufferSubData(target, hdr->dirtyLo, hi - hdr->dirtyLo, (char*)toCData(array) + hdr->dirtyLo);
+		else
+			glBufferSubData(target, 0, size, toCData(array));
+		vbo->gen = hdr->gen;
+		array_clean(hdr);
+	}
 	return 0;
 }
 
+/** Describe to the vao how to fetch attribute i from the bound buffer, given its array's number type */
+static void shape_attribpointer(GLuint i, ArrayHeader *hdr, GLsizei stride, size_t offset) {
+	switch (hdr->mbrType) {
+	case Uint8Nbr: glVertexAttribPointer(i, hdr->structSz, GL_UNSIGNED_BYTE, GL_FALSE, stride, (void*)offset); break;
+	case Uint16Nbr: glVertexAttribPointer(i, hdr->structSz, GL_UNSIGNED_SHORT, GL_FALSE, stride, (void*)offset); break;
+	case Uint32Nbr: glVertexAttribPointer(i, hdr->structSz, GL_UNSIGNED_INT, GL_FALSE, stride, (void*)offset); break;
+	case FloatNbr: case Vec2Value: case XyzValue: case ColorValue: case QuatValue:
+		glVertexAttribPointer(i, hdr->structSz, GL_FLOAT, GL_FALSE, stride, (void*)offset); break;
+	case HalfNbr: glVertexAttribPointer(i, hdr->structSz, GL_HALF_FLOAT, GL_FALSE, stride, (void*)offset); break;
+	case Unorm8Nbr: glVertexAttribPointer(i, hdr->structSz, GL_UNSIGNED_BYTE, GL_TRUE, stride, (void*)offset); break;
+	case Unorm16Nbr: glVertexAttribPointer(i, hdr->structSz, GL_UNSIGNED_SHORT, GL_TRUE, stride, (void*)offset); break;
+	case Snorm1010102Nbr: glVertexAttribPointer(i, 4, GL_INT_2_10_10_10_REV, GL_TRUE, stride, (void*)offset); break;
+	default: ;
+	}
+}
+
+char *shape_packbuf;		//!< Scratch space for interleaving vertex attributes
+AuintIdx shape_packmax;		//!< Number of bytes allocated for interleaving
+
+/** Interleave the shape's vertex attribute arrays into one vertex buffer, so that each vertex's
+	attributes sit next to each other in memory and are fetched from a single stream.
+	Attributes are laid out in the order of the shader's attribute list, each starting on a 4-byte boundary.
+	The buffer is repacked and re-sent in full only when an attribute's array is replaced or changed.
+	Returns the number of vertices (the fewest held by any attribute array). */
+static unsigned int shape_interleave(Value th, ShapeBuffers *bufs, Value attrsource, Value attrlist, int nattrs) {
+	// Gather each attribute's array and where it goes in a vertex
+	Value srcs[SHAPE_MAXATTRS];
+	AuintIdx attrsz[SHAPE_MAXATTRS];
+	AuintIdx offsets[SHAPE_MAXATTRS];
+	AuintIdx stride = 0;
+	unsigned int nverts = 0;
+	bool anysrc = false;
+	bool stale = bufs->packed.src != attrlist || bufs->packed.buffer == 0;
+	for (int i=0; i<nattrs; i++) {
+		Value buffer = getProperty(th, attrsource, arrGet(th, attrlist, i));
+		srcs[i] = isCData(buffer)? buffer : aNull;
+		if (srcs[i] == aNull) {
+			stale = stale || bufs->packsrc[i] != aNull;
+			continue;
+		}
+		ArrayHeader *hdr = toArrayHeader(buffer);
+		attrsz[i] = array_structsize(hdr->mbrType, hdr->structSz);
+		offsets[i] = stride;
+		stride += (attrsz[i] + 3) & ~3u;
+		unsigned int nstructs = attrsz[i]? getSize(buffer) / attrsz[i] : 0;
+		if (hdr->nStructs < nstructs)
+			nstructs = hdr->nStructs;
+		if (!anysrc || nstructs < nverts)
+			nverts = nstructs;
+		anysrc = true;
+		stale = stale || bufs->packsrc[i] != buffer || bufs->packgen[i] != hdr->gen;
+	}
+	AuintIdx size = nverts * stride;
+	if (!stale && size == bufs->packed.size)
+		return nverts;
+
+	// Interleave every attribute's values into scratch space
+	if (size > shape_packmax) {
+		shape_packmax = size;
+		shape_packbuf = (char*) realloc(shape_packbuf, shape_packmax);
+	}
+	for (int i=0; i<nattrs; i++) {
+		if (srcs[i] == aNull)
+			continue;
+		const char *from = (const char*) toCData(srcs[i]);
+		char *to = shape_packbuf + offsets[i];
+		for (unsigned int v=0; v<nverts; v++)
+			memcpy(to + v*stride, from + v*attrsz[i], attrsz[i]);
+	}
+
+	// Send it, then point every attribute at its place within each vertex
+	if (bufs->packed.buffer == 0)
+		glGenBuffers(1, &bufs->packed.buffer);
+	glsBindBuffer(GL_ARRAY_BUFFER, bufs->packed.buffer);
+	if (size != bufs->packed.size || bufs->stride != (GLsizei)stride || bufs->packed.src != attrlist)
+		glBufferData(GL_ARRAY_BUFFER, size, shape_packbuf, GL_STATIC_DRAW);
+	else
+		glBufferSubData(GL_ARRAY_BUFFER, 0, size, shape_packbuf);
+	for (int i=0; i<nattrs; i++) {
+		if (srcs[i] == aNull)
+			glDisableVertexAttribArray(i);
+		else {
+			ArrayHeader *hdr = toArrayHeader(srcs[i]);
+			shape_attribpointer(i, hdr, stride, offsets[i]);
+			glEnableVertexAttribArray(i);
+			bufs->packgen[i] = hdr->gen;
+		}
+		bufs->packsrc[i] = srcs[i];
+		bufs->vbo[i].src = aNull; // Per-attribute buffers are no longer what the vao points to
+	}
+	bufs->packed.src = attrlist;
+	bufs->packed.size = size;
+	bufs->stride = stride;
+	return nverts;
+}
+
+/** Pack the shape's vertex attributes into one interleaved vertex buffer, now and
+	whenever they change, rather than keeping a separate buffer for each attribute.
+	Same as setting the shape's "interleave" property to true. */
+int shape_pack(Value th) {
+	int selfidx = 0;
+	pushValue(th, aTrue);
+	popProperty(th, selfidx, "interleave");
+
+	// Pack right away if we know the shader, and thereby the attributes' order
+	Value shader = pushProperty(th, selfidx, "shader");
+	popValue(th);
+	if (shader != aNull) {
+		Value vertattsym = pushSym(th, "attributes");
+		Value vertattrlistv = getProperty(th, shader, vertattsym);
+		popValue(th); // symbol
+		if (isArr(vertattrlistv)) {
+			int nattrs = getSize(vertattrlistv);
+			if (nattrs > PEG_INSTANCEATTR)
+				nattrs = PEG_INSTANCEATTR;
+			ShapeBuffers *bufs = shape_getbuffers(th, selfidx);
+			glsBindVertexArray(bufs->vao);
+			if (bufs->attrlist != vertattrlistv) {
+				for (int i=0; i<SHAPE_MAXATTRS; i++) {
+					glDisableVertexAttribArray(i);
+					bufs->vbo[i].src = aNull;
+				}
+				bufs->inst.src = aNull;
+				bufs->attrlist = vertattrlistv;
+			}
+			shape_interleave(th, bufs, getLocal(th, selfidx), vertattrlistv, nattrs);
+		}
+	}
+	pushLocal(th, selfidx);
+	return 1;
+}
+
+Mat4 *shape_instmats;		//!< Scratch space for packing instance matrices
+AuintIdx shape_instmax;		//!< Number of instance matrices allocated
+
+/** Copy the shape's "instances" matrices into its per-instance attribute buffer,
+	when its shader takes an "imatrix" attribute to place each copy.
+	Returns the number of instances to draw, or 0 to draw the shape once as usual. */
+GLsizei shape_instances(Value th, int selfidx, Value shader, ShapeBuffers *bufs) {
+	if (!shader_instanced(th, shader))
+		return 0;
+
+	// Pack the instance matrices together
+	GLsizei ninst = 0;
+	Value instances = getProperty(th, getLocal(th, selfidx), pegsym.instances);
+	if (isArr(instances)) {
+		AuintIdx sz = getSize(instances);
+		if (sz > shape_instmax) {
+			shape_instmax = sz;
+			shape_instmats = (Mat4*) realloc(shape_instmats, shape_instmax*sizeof(Mat4));
+		}
+		for (AuintIdx i=0; i<sz; i++) {
+			Value matv = arrGet(th, instances, i);
+			if (isMat4(matv))
+				mat4Set(&shape_instmats[ninst++], toMat4(matv));
+		}
+	}
+
+	// With no instances, imatrix is a constant identity, drawing just the shape itself
+	if (ninst == 0) {
+		if (bufs->inst.src != aNull) {
+			for (int col=0; col<4; col++)
+				glDisableVertexAttribArray(PEG_INSTANCEATTR+col);
+			bufs->inst.src = aNull;
+		}
+		for (int col=0; col<4; col++)
+			glVertexAttrib4f(PEG_INSTANCEATTR+col, col==0? 1.0f:0.0f, col==1? 1.0f:0.0f, col==2? 1.0f:0.0f, col==3? 1.0f:0.0f);
+		return 0;
+	}
+
+	// Instances move freely, so copy them every frame, reallocating only when their number changes
+	AuintIdx size = ninst*sizeof(Mat4);
+	if (bufs->inst.buffer == 0)
+		glGenBuffers(1, &bufs->inst.buffer);
+	glsBindBuffer(GL_ARRAY_BUFFER, bufs->inst.buffer);
+	if (bufs->inst.src != instances || bufs->inst.size != size) {
+		glBufferData(GL_ARRAY_BUFFER, size, shape_instmats, GL_DYNAMIC_DRAW);
+		for (int col=0; col<4; col++) {
+			glVertexAttribPointer(PEG_INSTANCEATTR+col, 4, GL_FLOAT, GL_FALSE, sizeof(Mat4), (void*)(col*4*sizeof(GLfloat)));
+			glVertexAttribDivisor(PEG_INSTANCEATTR+col, 1);
+			glEnableVertexAttribArray(PEG_INSTANCEATTR+col);
+		}
+		bufs->inst.src = instances;
+		bufs->inst.size = size;
+	}
+	else
+		glBufferSubData(GL_ARRAY_BUFFER, 0, size, shape_instmats);
+	return ninst;
+}
+
 /** Render the shape */
 int shape_render(Value th) {
 	int selfidx = 0;
 	int contextidx = 1;
 
 	// Render the shader, loading it and its uniforms
-	pushSym(th, "_Render");
-	Value shader = pushProperty(th, selfidx, "shader");
-	if (shader == aNull) {
-		popValue(th);
-		shader = pushProperty(th, contextidx, "shader");
-	}
+	Value self = getLocal(th, selfidx);
+	pushValue(th, pegsym.Render);
+	Value shader = getProperty(th, self, pegsym.shader);
+	if (shader == aNull)
+		shader = getProperty(th, getLocal(th, contextidx), pegsym.shader);
+	pushValue(th, shader);
 	pushLocal(th, contextidx);
 	pushLocal(th, selfidx);
 	getCall(th, 3, 0);
 
-	// Turn on blending for shapes that use translucent colors
-	Value transparent = pushProperty(th, selfidx, "transparent");
-	popValue(th);
+	// Turn on blending only for shapes that use translucent colors
+	Value transparent = getProperty(th, self, pegsym.transparent);
 	if (!isFalse(transparent)) {
-		glEnable(GL_BLEND);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		glsEnable(GL_BLEND);
+		glsBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	}
+	else
+		glsDisable(GL_BLEND);
 
 	// Draw the vertexes using the vertex attribute buffers
-	GLuint vao;
-	GLuint vbo[100];
 	unsigned int nverts = -1;
 
 	// Get the list of vertex attributes
-	Value vertattsym = pushSym(th, "attributes");
-	Value vertattrlistv = getProperty(th, shader, vertattsym);
-	popValue(th); // symbol
+	Value vertattrlistv = getProperty(th, shader, pegsym.attributes);
 	int nattrs = getSize(vertattrlistv);
+	if (nattrs > PEG_INSTANCEATTR)
+		nattrs = PEG_INSTANCEATTR;
+
+	// Activate the shape's Vertex Array Object, which remembers attribute bindings across frames
+	ShapeBuffers *bufs = shape_getbuffers(th, selfidx);
+	glsBindVertexArray(bufs->vao);
+
+	// A different shader's attribute list means every attribute must be re-bound
+	if (bufs->attrlist != vertattrlistv) {
+		for (int i=0; i<SHAPE_MAXATTRS; i++) {
+			glDisableVertexAttribArray(i);
+			bufs->vbo[i].src = aNull;
+		}
+		bufs->inst.src = aNull;
+		bufs->attrlist = vertattrlistv;
+	}
 
-	// Set up Vertex Array Object
-	glGenVertexArrays(1, &vao);
-	glBindVertexArray(vao);
-
-	// Allocate and assign as many Vertex Buffer Objects to our handle as we have attributes
-	// then load and activate each one. 
-	glGenBuffers(nattrs, vbo);
+	// Either interleave all attributes into one Vertex Buffer Object, when asked to ...
 	Value attrsource = getLocal(th, selfidx);
-	for (int i=0; i<nattrs; i++) {
+	Value interleave = getProperty(th, self, pegsym.interleave);
+	if (!isFalse(interleave) && interleave != aNull)
+		nverts = shape_interleave(th, bufs, attrsource, vertattrlistv, nattrs);
+
+	// ... or copy into each attribute's Vertex Buffer Object only what has changed
+	else for (int i=0; i<nattrs; i++) {
 		Value buffer = getProperty(th, attrsource, arrGet(th, vertattrlistv, i));
-		if (!isCData(buffer))
+		if (!isCData(buffer)) {
+			if (bufs->vbo[i].src != aNull) {
+				glDisableVertexAttribArray(i);
+				bufs->vbo[i].src = aNull;
+			}
 			continue;
+		}
 		ArrayHeader *buffhdr = toArrayHeader(buffer);
 
-		// Bind as active, copy, define and enable the OpenGL buffer
-		glBindBuffer(GL_ARRAY_BUFFER, vbo[i]);
-		glBufferData(GL_ARRAY_BUFFER, getSize(buffer), toCData(buffer), GL_STATIC_DRAW); /* Copy data */
-		AuintIdx n = getSize(buffer);
-		float *f = (float *)toCData(buffer);
-		switch (buffhdr->mbrType) {
-		case Uint8Nbr: glVertexAttribPointer(i, buffhdr->structSz, GL_UNSIGNED_BYTE, GL_FALSE, 0, 0); break;
-		case Uint16Nbr: glVertexAttribPointer(i, buffhdr->structSz, GL_UNSIGNED_SHORT, GL_FALSE, 0, 0); break;
-		case Uint32Nbr: glVertexAttribPointer(i, buffhdr->structSz, GL_INT, GL_FALSE, 0, 0); break;
-		case FloatNbr: case Vec2Value: case XyzValue: case ColorValue: case QuatValue:
-			glVertexAttribPointer(i, buffhdr->structSz, GL_FLOAT, GL_FALSE, 0, 0); break;
-		default: ;
+		// Copy, then define and enable the OpenGL buffer when newly allocated
+		if (shape_upload(&bufs->vbo[i], GL_ARRAY_BUFFER, buffer)) {
+			shape_attribpointer(i, buffhdr, 0, 0);
+			glEnableVertexAttribArray(i);
+			bufs->packed.src = aNull; // Must repack if interleaving is turned back on
 		}
-		glEnableVertexAttribArray(i);
 
 		// Remember the smallest number of vertices we found in the buffers
 		nverts = (nverts < 0 || nverts>buffhdr->nStructs)? buffhdr->nStructs : nverts;
 	}
 
+	// Place every instance with one draw, if the shape has them and its shader can
+	GLsizei ninst = shape_instances(th, selfidx, shader, bufs);
+
 	// How shall we draw the primitives?
-	Value drawprop = pushGetActProp(th, selfidx, "_draw");
+	Value drawprop = getProperty(th, self, pegsym._draw);
 	int drawmode = isInt(drawprop)? toAint(drawprop) : GL_TRIANGLES;
-	popValue(th);
 
-	/* Do we have a "indices" property with vertex indices? Use it */
-	Value indicesym = pushSym(th, "indices");
-	Value vertices = getProperty(th, attrsource, indicesym);
-	popValue(th);
+	/* Do we have a "indices" property with vertex indices? Use it, or the level of detail's instead */
+	Value vertices = getProperty(th, attrsource, pegsym.indices);
+	ShapeVbo *ebo = &bufs->ebo;
+	if (renderqueue_drawlod > 0 && renderqueue_drawlod <= SHAPE_MAXLODS) {
+		Value lods = getProperty(th, self, pegsym.lods);
+		if (isArr(lods) && (AuintIdx) renderqueue_drawlod <= getSize(lods)) {
+			Value lodindices = arrGet(th, lods, renderqueue_drawlod-1);
+			if (isCDataType(lodindices, ArrayValue)) {
+				vertices = lodindices;
+				ebo = &bufs->lodebo[renderqueue_drawlod-1];
+			}
+		}
+	}
 	if (isCData(vertices)) {
 		ArrayHeader *verthdr = toArrayHeader(vertices);
-		// Generate a buffer for the indices
-		GLuint elementbuffer;
-		glGenBuffers(1, &elementbuffer);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, elementbuffer);
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, getSize(vertices), toCData(vertices), GL_STATIC_DRAW);
-
-		// Draw the vertices using the indices as a guide
-		glDrawElements(drawmode, verthdr->nStructs, GL_UNSIGNED_SHORT, (void*)0);
-		glDeleteBuffers(1, &elementbuffer);
+		// Copy into the element buffer whatever indices have changed, and have the vao use it
+		shape_upload(ebo, GL_ELEMENT_ARRAY_BUFFER, vertices);
+		glsBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo->buffer);
+
+		// Draw the vertices using the indices as a guide, in whatever size they are stored
+		GLenum indxtype = integers_gltype(verthdr->mbrType);
+		if (ninst > 0)
+			glDrawElementsInstanced(drawmode, verthdr->nStructs, indxtype, (void*)0, ninst);
+		else
+			glDrawElements(drawmode, verthdr->nStructs, indxtype, (void*)0);
 	}
 	/* Otherwise, draw specified primitives using vertices defined by attribute buffers */
+	else if (ninst > 0)
+		glDrawArraysInstanced(drawmode, 0, nverts, ninst);
 	else
 		glDrawArrays(drawmode, 0, nverts);
 	popValue(th); // vertices
 
-	/* Clean up allocated array and buffers */
-	for (int i=0; i<nattrs; i++) {
-		glDisableVertexAttribArray(i);
-	}
-	glDeleteBuffers(nattrs, vbo);
-	glDeleteVertexArrays(1, &vao);
-
-	if (!isFalse(transparent))
-		glDisable(GL_BLEND);
-
 	return 1;
 }
 
@@ -449,6 +950,20 @@ void shape_init(Value th) {
 		popProperty(th, 0, "NewPlane");
 		pushCMethod(th, shape_cube);
 		popProperty(th, 0, "NewCube");
+		pushCMethod(th, shape_pack);
+		popProperty(th, 0, "Pack");
+		pushCMethod(th, mesh_optimize);
+		popProperty(th, 0, "Optimize");
+		pushCMethod(th, mesh_makelods);
+		popProperty(th, 0, "MakeLods");
+		pushCMethod(th, mesh_save);
+		popProperty(th, 0, "SaveMesh");
+		Value bufmixin = pushMixin(th, aNull, aNull, 4);
+			pushSym(th, "*ShapeBuffers");
+			popProperty(th, 1, "_name");
+			pushCMethod(th, shape_closebuffers);
+			popProperty(th, 1, "_finalizer");
+		popProperty(th, 0, "_bufferstype");
 
 		pushCMethod(th, shape_getDraw);
 		pushCMethod(th, shape_setDraw);
@@ -0,0 +1,71 @@
+/** Pre-interned symbols for hot-path property and method names
+ * @file
+ *
+ * The render loop asks every node and shape for the same handful of properties and
+ * methods each frame. Naming them with C strings would hash and intern each name
+ * anew on every call, so they are interned once here, at startup, and hot paths
+ * pass the resulting symbols straight to getProperty or getCall.
+ *
+ * This source file is part of the Pegasus3d browser.
+ * See Copyright Notice in pegasus3d.h
+*/
+
+#include "pegasus3d.h"
+#include <assert.h>
+
+PegSym pegsym;
+
+#ifdef PEG_COUNTSYMS
+unsigned int pegsym_frameinterns;	//!< Interning calls during the frame being rendered
+#endif
+unsigned int pegsym_lastinterns;	//!< Interning calls during the last completed frame
+
+/** Name of every PegSym member, in the same order */
+static const char *pegsym_names[] = {
+	"_Render", "_RenderPrep", "New", "CalcMatrix",
+	"mmatrix", "vmatrix", "pmatrix",
+	"origin", "orientation", "scale",
+	"parts", "static",
+	"shader", "transparent", "instances",
+	"positions", "indices", "attributes", "interleave",
+	"lods",
+	"_xform", "_bounds", "_buffers", "_drawlist", "_draw",
+	"_program", "_texName"
+};
+
+/** Close out a frame's count of interning calls */
+void pegsym_frameend(void) {
+#ifdef PEG_COUNTSYMS
+	pegsym_lastinterns = pegsym_frameinterns;
+	pegsym_frameinterns = 0;
+#endif
+}
+
+/** Return the number of VM calls that interned a C string during the last completed frame
+	(always 0 unless built with PEG_COUNTSYMS) */
+int pegsym_interned(Value th) {
+	pushValue(th, anInt(pegsym_lastinterns));
+	return 1;
+}
+
+/** Intern every PegSym symbol, keeping them all in a list so they are never collected,
+	and initialize the Symbols type, which reports on interning */
+void pegsym_init(Value th) {
+	Value *syms = (Value *) &pegsym;
+	AuintIdx nsyms = sizeof(pegsym_names)/sizeof(pegsym_names[0]);
+	assert(nsyms == sizeof(PegSym)/sizeof(Value));
+
+	pushType(th, aNull, 4);
+		pushSym(th, "Symbols");
+		popProperty(th, 0, "_name");
+		pushCMethod(th, pegsym_interned);
+		popProperty(th, 0, "Interned");
+		Value symlist = pushArray(th, aNull, nsyms);
+		for (AuintIdx i=0; i<nsyms; i++) {
+			syms[i] = pushSym(th, pegsym_names[i]);
+			arrSet(th, symlist, i, syms[i]);
+			popValue(th);
+		}
+		popProperty(th, 0, "_syms");
+	popGloVar(th, "Symbols");
+}
@@ -0,0 +1,333 @@
+/** Block texture compression (BC1 and BC3), and the on-disk cache of compressed images
+ * @file
+ *
+ * Image workers can compress decoded pixels into the S3TC/DXT block formats, which
+ * OpenGL samples directly: BC1 (DXT1, 8 bytes per 4x4 block) for images without alpha
+ * and BC3 (DXT5, 16 bytes per block) for those with. A full mipmap chain is built and
+ * compressed too, as OpenGL cannot generate mipmaps for compressed textures.
+ *
+ * Each block's endpoints are the corners of its colors' bounding box, inset slightly,
+ * along whichever diagonal the colors actually vary. Every pixel takes the nearest of
+ * the four palette colors (or eight alpha levels).
+ *
+ * Compressing is slow next to decoding, so results are kept in a cache directory,
+ * one file per image, named by a hash of the image's encoded contents. A later load
+ * of the same image reads the compressed blocks back and skips decoding altogether.
+ *
+ * All functions here are safe to call from worker threads.
+ *
+ * This source file is part of the Pegasus3d browser.
+ * See Copyright Notice in pegasus3d.h
+*/
+
+#include "pegasus3d.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#define TEXCOMP_CACHEDIR "texcache"		//!< Directory holding compressed images
+#define TEXCOMP_VERSION 2				//!< Version of the encoder and cache file layout
+
+/** Header of a cached compressed image file, followed by every level's blocks */
+struct TexCompFile {
+	char magic[4];			//!< "PBCN"
+	unsigned short version;	//!< TEXCOMP_VERSION
+	unsigned char comp;		//!< Bytes per pixel of the decoded image
+	unsigned char nlevels;	//!< Number of mipmap levels
+	unsigned int format;	//!< OpenGL compressed format
+	unsigned int x;			//!< Width of level 0
+	unsigned int y;			//!< Height of level 0
+	unsigned int size;		//!< Bytes of blocks that follow
+	unsigned long long hash;	//!< Hash of the encoded image it was made from
+};
+
+/** Which compressed format suits an image with this many bytes per pixel: DXT5 if it has alpha */
+GLenum texcomp_format(int comp) {
+	return comp==2 || comp==4? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+}
+
+/** Number of bytes of blocks in a level of this width and height */
+AuintIdx texcomp_levelsize(int w, int h, GLenum format) {
+	return ((w+3)/4) * ((h+3)/4) * (format==GL_COMPRESSED_RGB_S3TC_DXT1_EXT? 8 : 16);
+}
+
+/** Byte offset of a level's blocks, following all the larger levels' */
+AuintIdx texcomp_leveloffset(int x, int y, GLenum format, int level) {
+	AuintIdx offset = 0;
+	for (int i=0; i<level; i++) {
+		offset += texcomp_levelsize(x, y, format);
+		x = x>1? x/2 : 1;
+		y = y>1? y/2 : 1;
+	}
+	return offset;
+}
+
+/** Number of levels in a full mipmap chain, down to 1x1 */
+static int texcomp_nlevels(int x, int y) {
+	int nlevels = 1;
+	while (x>1 || y>1) {
+		x = x>1? x/2 : 1;
+		y = y>1? y/2 : 1;
+		nlevels++;
+	}
+	return nlevels;
+}
+
+/** FNV-1a hash of an image's encoded contents, naming its cache file */
+unsigned long long texcomp_hash(const unsigned char *data, int len) {
+	unsigned long long hash = 14695981039346656037ULL;
+	for (int i=0; i<len; i++)
+		hash = (hash ^ data[i]) * 1099511628211ULL;
+	return hash;
+}
+
+/** Pack an 8-bit color into 5:6:5 bits */
+static unsigned short texcomp_pack565(const int *rgb) {
+	return (unsigned short) (((rgb[0]*31+127)/255) << 11 | ((rgb[1]*63+127)/255) << 5 | ((rgb[2]*31+127)/255));
+}
+
+/** Expand a 5:6:5 color back to 8 bits per channel */
+static void texcomp_unpack565(unsigned short c, int *rgb) {
+	int r = (c>>11) & 31, g = (c>>5) & 63, b = c & 31;
+	rgb[0] = (r<<3) | (r>>2);
+	rgb[1] = (g<<2) | (g>>4);
+	rgb[2] = (b<<3) | (b>>2);
+}
+
+/** Encode a 4x4 block of RGBA pixels' colors as BC1 (always the four-color mode) */
+static void texcomp_bc1(const unsigned char *px, unsigned char *out) {
+	// Bounding box of the block's colors, and their mean
+	int mn[3] = {255, 255, 255}, mx[3] = {0, 0, 0}, mean[3] = {0, 0, 0};
+	for (int i=0; i<16; i++) {
+		for (int c=0; c<3; c++) {
+			int v = px[4*i+c];
+			if (v < mn[c]) mn[c] = v;
+			if (v > mx[c]) mx[c] = v;
+			mean[c] += v;
+		}
+	}
+	for (int c=0; c<3; c++)
+		mean[c] = (mean[c] + 8) / 16;
+
+	// Use the box diagonal along which green and blue vary with red (or blue with green)
+	int covrg = 0, covrb = 0, covgb = 0;
+	for (int i=0; i<16; i++) {
+		int dr = px[4*i] - mean[0], dg = px[4*i+1] - mean[1], db = px[4*i+2] - mean[2];
+		covrg += dr*dg;
+		covrb += dr*db;
+		covgb += dg*db;
+	}
+	bool redflat = mx[0] == mn[0];
+	if (!redflat && covrg < 0) {
+		int t = mn[1]; mn[1] = mx[1]; mx[1] = t;
+	}
+	if (redflat? covgb < 0 : covrb < 0) {
+		int t = mn[2]; mn[2] = mx[2]; mx[2] = t;
+	}
+
+	// Inset the ends a little, as few pixels sit exactly at the box's corners
+	for (int c=0; c<3; c++) {
+		int inset = (mx[c] - mn[c]) / 16;
+		mn[c] += inset;
+		mx[c] -= inset;
+	}
+	unsigned short c0 = texcomp_pack565(mx), c1 = texcomp_pack565(mn);
+	if (c0 < c1) {
+		unsigned short t = c0; c0 = c1; c1 = t;
+	}
+	unsigned int indices = 0;
+	if (c0 != c1) {
+		int pal[4][3];
+		texcomp_unpack565(c0, pal[0]);
+		texcomp_unpack565(c1, pal[1]);
+		for (int c=0; c<3; c++) {
+			pal[2][c] = (2*pal[0][c] + pal[1][c]) / 3;
+			pal[3][c] = (pal[0][c] + 2*pal[1][c]) / 3;
+		}
+		for (int i=0; i<16; i++) {
+			int best = 0, bestdist = 0x7FFFFFFF;
+			for (int p=0; p<4; p++) {
+				int dr = px[4*i] - pal[p][0], dg = px[4*i+1] - pal[p][1], db = px[4*i+2] - pal[p][2];
+				int dist = dr*dr + dg*dg + db*db;
+				if (dist < bestdist) {
+					bestdist = dist;
+					best = p;
+				}
+			}
+			indices |= best << (2*i);
+		}
+	}
+	out[0] = c0 & 0xFF; out[1] = c0 >> 8;
+	out[2] = c1 & 0xFF; out[3] = c1 >> 8;
+	out[4] = indices & 0xFF; out[5] = (indices >> 8) & 0xFF;
+	out[6] = (indices >> 16) & 0xFF; out[7] = indices >> 24;
+}
+
+/** Encode a 4x4 block of RGBA pixels' alphas as a BC3 alpha block (eight-level mode) */
+static void texcomp_bc3alpha(const unsigned char *px, unsigned char *out) {
+	int amin = 255, amax = 0;
+	for (int i=0; i<16; i++) {
+		if (px[4*i+3] < amin) amin = px[4*i+3];
+		if (px[4*i+3] > amax) amax = px[4*i+3];
+	}
+	out[0] = (unsigned char) amax;
+	out[1] = (unsigned char) amin;
+	unsigned long long indices = 0;
+	if (amax != amin) {
+		int pal[8];
+		pal[0] = amax;
+		pal[1] = amin;
+		for (int p=2; p<8; p++)
+			pal[p] = ((8-p)*amax + (p-1)*amin) / 7;
+		for (int i=0; i<16; i++) {
+			int best = 0, bestdist = 256;
+			for (int p=0; p<8; p++) {
+				int dist = abs(px[4*i+3] - pal[p]);
+				if (dist < bestdist) {
+					bestdist = dist;
+					best = p;
+				}
+			}
+			indices |= (unsigned long long) best << (3*i);
+		}
+	}
+	for (int b=0; b<6; b++)
+		out[2+b] = (unsigned char) (indices >> (8*b));
+}
+
+/** Compress one level of RGBA pixels into blocks, repeating edge pixels to fill partial blocks */
+static void texcomp_level(const unsigned char *rgba, int w, int h, GLenum format, unsigned char *out) {
+	unsigned char block[64];
+	for (int by=0; by<h; by+=4) {
+		for (int bx=0; bx<w; bx+=4) {
+			for (int i=0; i<16; i++) {
+				int px = bx + (i&3), py = by + (i>>2);
+				if (px >= w) px = w-1;
+				if (py >= h) py = h-1;
+				memcpy(&block[4*i], &rgba[4*(py*w + px)], 4);
+			}
+			if (format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT) {
+				texcomp_bc3alpha(block, out);
+				out += 8;
+			}
+			texcomp_bc1(block, out);
+			out += 8;
+		}
+	}
+}
+
+/** Compress decoded pixels (comp bytes each) and their full mipmap chain into BC1 or BC3 blocks.
+	Returns the malloc'd blocks of every level, largest first, with their count and total size. */
+unsigned char *texcomp_compress(const unsigned char *pixels, int x, int y, int comp, int *nlevels, AuintIdx *size) {
+	GLenum format = texcomp_format(comp);
+	*nlevels = texcomp_nlevels(x, y);
+	*size = texcomp_leveloffset(x, y, format, *nlevels);
+	unsigned char *blocks = (unsigned char *) malloc(*size);
+
+	// Widen the pixels to RGBA, so every level is filtered and compressed alike
+	unsigned char *rgba = (unsigned char *) malloc(4*x*y);
+	for (int i=0; i<x*y; i++) {
+		const unsigned char *p = &pixels[i*comp];
+		unsigned char *q = &rgba[4*i];
+		q[0] = p[0];
+		q[1] = comp>2? p[1] : p[0];
+		q[2] = comp>2? p[2] : p[0];
+		q[3] = comp==4? p[3] : comp==2? p[1] : 255;
+	}
+
+	// Compress each level, then box-filter it down to the next
+	unsigned char *out = blocks;
+	int w = x, h = y;
+	for (int level=0; level<*nlevels; level++) {
+		texcomp_level(rgba, w, h, format, out);
+		out += texcomp_levelsize(w, h, format);
+		if (level+1 == *nlevels)
+			break;
+		int nw = w>1? w/2 : 1, nh = h>1? h/2 : 1;
+		for (int py=0; py<nh; py++) {
+			int y0 = 2*py, y1 = 2*py+1<h? 2*py+1 : 2*py;
+			for (int px=0; px<nw; px++) {
+				int x0 = 2*px, x1 = 2*px+1<w? 2*px+1 : 2*px;
+				for (int c=0; c<4; c++)
+					rgba[4*(py*nw + px) + c] = (unsigned char) ((rgba[4*(y0*w + x0) + c] + rgba[4*(y0*w + x1) + c]
+						+ rgba[4*(y1*w + x0) + c] + rgba[4*(y1*w + x1) + c] + 2) / 4);
+			}
+		}
+		w = nw;
+		h = nh;
+	}
+	free(rgba);
+	return blocks;
+}
+
+/** Name of the cache file for an image's hash */
+static void texcomp_cachename(char *name, unsigned long long hash) {
+	sprintf(name, TEXCOMP_CACHEDIR "/%016llx.pbcn", hash);
+}
+
+/** Read an image's compressed blocks from the cache, if there.
+	Returns the malloc'd blocks (and their description), or NULL if not cached. */
+unsigned char *texcomp_cacheload(unsigned long long hash, int *x, int *y, int *comp, int *nlevels, AuintIdx *size) {
+	char name[64];
+	texcomp_cachename(name, hash);
+	FILE *file = fopen(name, "rb");
+	if (file == NULL)
+		return NULL;
+	TexCompFile hdr;
+	unsigned char *blocks = NULL;
+	if (fread(&hdr, sizeof(hdr), 1, file) == 1 && 0==memcmp(hdr.magic, "PBCN", 4)
+		&& hdr.version == TEXCOMP_VERSION && hdr.hash == hash && hdr.format == texcomp_format(hdr.comp)
+		&& hdr.nlevels == texcomp_nlevels(hdr.x, hdr.y)
+		&& hdr.size == texcomp_leveloffset(hdr.x, hdr.y, hdr.format, hdr.nlevels)) {
+		blocks = (unsigned char *) malloc(hdr.size);
+		if (fread(blocks, 1, hdr.size, file) == hdr.size) {
+			*x = hdr.x;
+			*y = hdr.y;
+			*comp = hdr.comp;
+			*nlevels = hdr.nlevels;
+			*size = hdr.size;
+		}
+		else {
+			free(blocks);
+			blocks = NULL;
+		}
+	}
+	fclose(file);
+	return blocks;
+}
+
+/** Write an image's compressed blocks to the cache. The file is written under a temporary
+	name then renamed, so no reader ever sees it half written. */
+void texcomp_cachesave(unsigned long long hash, int x, int y, int comp, int nlevels, const unsigned char *blocks, AuintIdx size) {
+#ifdef _WIN32
+	_mkdir(TEXCOMP_CACHEDIR);
+#else
+	mkdir(TEXCOMP_CACHEDIR, 0755);
+#endif
+	char name[64], tmpname[96];
+	texcomp_cachename(name, hash);
+	sprintf(tmpname, "%s.%p.tmp", name, (void *) blocks);
+	FILE *file = fopen(tmpname, "wb");
+	if (file == NULL)
+		return;
+	TexCompFile hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, "PBCN", 4);
+	hdr.version = TEXCOMP_VERSION;
+	hdr.comp = (unsigned char) comp;
+	hdr.nlevels = (unsigned char) nlevels;
+	hdr.format = texcomp_format(comp);
+	hdr.x = x;
+	hdr.y = y;
+	hdr.size = size;
+	hdr.hash = hash;
+	bool written = fwrite(&hdr, sizeof(hdr), 1, file) == 1 && fwrite(blocks, 1, size, file) == size;
+	fclose(file);
+	if (!written || rename(tmpname, name) != 0)
+		remove(tmpname);
+}
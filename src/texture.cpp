@@ -1,11 +1,127 @@
 /** Texture
  * @file
  *
+ * A texture's images are not handed to OpenGL all at once, which would stall the frame
+ * in which it first becomes visible. Once its images are decoded, its texture object is
+ * created with empty storage and its images queued. Every frame, texture_stream copies
+ * queued rows into a ring of pixel buffer objects, from which OpenGL fills the texture,
+ * until that frame's upload budget (Texture.uploadBudget bytes) is spent. Each staging
+ * buffer is fenced, and is not refilled until OpenGL has finished reading it. Until all
+ * its images are in, a texture is drawn with a 1x1 black placeholder of the same mapping,
+ * bound to a unit of its own like any texture, so it samples as if it had no texture
+ * (without another texture's unit, or the staging unit shared by samplers of two types).
+ *
+ * Texture units are handed out per draw from a binding table, rather than kept by each
+ * texture for good. A texture already bound to a unit reuses it; otherwise it takes the
+ * least recently used unit not already claimed by the same draw. So a world may use
+ * any number of textures, as long as no one draw samples more than there are units.
+ * A texture's OpenGL texture object is held by its "_texName", whose finalizer
+ * deletes it once the texture is no longer referenced.
+ *
+ * Small 2D textures (no larger than TEXTURE_PACKMAX on a side) are packed into shared
+ * atlas textures, so that shapes using them sort together in the render queue and draw
+ * without switching textures. Regions are placed on each atlas by a skyline packer,
+ * aligned and bordered with copies of their edge texels, so that the atlas's mipmaps
+ * (of which it has only as many as the border is wide) do not bleed between them.
+ * A packed texture's image only fills part of its texture object, so texture
+ * coordinates must be mapped into that part: a shader opts in by taking a vec4
+ * uniform named after its sampler plus "Rect" (e.g., "texRect" for "tex"), set to the
+ * region's u,v offset and u,v scale. Only textures sampled through such a shader, and
+ * that clamp at their edges and use the default filters, are packed. Regions are not
+ * reclaimed when their textures are collected.
+ *
+ * An image compressed by its decoder (see texcomp.cpp) is streamed a row of 4x4 blocks
+ * at a time, level by level, as it carries its own mipmaps: OpenGL cannot generate them
+ * for compressed textures.
+ *
  * This source file is part of the Pegasus3d browser.
  * See Copyright Notice in pegasus3d.h
 */
 
 #include "pegasus3d.h"
+#include "glstate.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define TEXTURE_NPBOS 4						//!< Number of pixel buffer objects in the staging ring
+#define TEXTURE_PBOSIZE (2*1024*1024)		//!< Bytes in each staging pixel buffer object
+#define TEXTURE_BUDGET (4*1024*1024)		//!< Default bytes streamed to textures per frame
+#define TEXTURE_MAXUNITS 32					//!< Most texture units managed by the binding table
+#define TEXTURE_STAGINGUNIT 0				//!< Unit textures are created and streamed on, left with nothing bound
+#define TEXTURE_PACKMAX 256					//!< Largest width or height of a texture packed into an atlas
+#define TEXTURE_ATLASSIZE 1024				//!< Width and height of each atlas
+#define TEXTURE_ATLASPAD 4					//!< Width of each region's border of copied edge texels (and their alignment)
+/** Width (or height) of an atlas region for an image n texels wide: bordered all round, then aligned */
+#define TEXTURE_ATLASCELL(n) (((n) + 3*TEXTURE_ATLASPAD - 1) / TEXTURE_ATLASPAD * TEXTURE_ATLASPAD)
+#define TEXTURE_ATLASLEVELS 2				//!< Highest mipmap level of an atlas: log2 of TEXTURE_ATLASPAD, so none bleeds
+#define TEXTURE_MAXATLASES 8				//!< Most atlases created
+#define TEXTURE_MAXSKYLINE 128				//!< Most segments in an atlas's skyline
+
+AuintIdx texcomp_levelsize(int w, int h, GLenum format);
+AuintIdx texcomp_leveloffset(int x, int y, GLenum format, int level);
+
+/** A staging pixel buffer object, in the ring images are streamed through */
+struct TexturePbo {
+	GLuint buffer;		//!< Buffer object (0 until first used)
+	GLsync fence;		//!< Signalled once OpenGL has read what was last staged in it (0 if none)
+};
+
+/** A texture whose images are being streamed into its texture object */
+struct TextureUpload {
+	GLuint tex;			//!< Texture object
+	GLenum mapping;		//!< GL_TEXTURE_2D or GL_TEXTURE_CUBE_MAP
+	int nfaces;			//!< Number of images (6 for a cube map)
+	int face;			//!< Image being streamed
+	int level;			//!< Mipmap level of that image being streamed
+	int nlevels;		//!< Number of levels to stream for each image (1 unless compressed)
+	int row;			//!< First row (of blocks, if compressed) of that level not yet streamed
+	int x;				//!< Where the image goes in the texture object (non-zero if packed into an atlas, inside its border)
+	int y;
+	bool mipmap;		//!< Generate mipmaps once all is streamed?
+	int slot;			//!< Index of the texture in the list of those streaming
+};
+
+/** What the binding table knows of a texture unit */
+struct TextureUnit {
+	GLuint name;		//!< Texture bound to it (0 if none)
+	GLenum mapping;		//!< Target it is bound to
+	unsigned int used;	//!< Draw that last used it (0 if never)
+};
+
+TextureUnit texture_units[TEXTURE_MAXUNITS];	//!< Binding table (the staging unit is never handed out)
+int texture_nunits;						//!< Number of units managed (0 until first bind)
+unsigned int texture_draw = 1;			//!< Stamp of the draw whose textures are being bound
+unsigned int texture_nevictions;		//!< Number of times a unit was taken from another texture
+
+/** A segment of an atlas's skyline: the top edge of the regions placed below it */
+struct TextureSkyline {
+	int x;				//!< Left end
+	int y;				//!< Height of the regions below it
+	int w;				//!< Width
+};
+
+/** An atlas texture small textures are packed into */
+struct TextureAtlas {
+	GLuint name;		//!< Texture object
+	int nskyline;		//!< Number of skyline segments, left to right across the whole atlas
+	TextureSkyline skyline[TEXTURE_MAXSKYLINE];	//!< Skyline
+};
+
+GLuint texture_placeholders[2];			//!< 2D and cube map placeholders for textures not yet loaded (0 until needed)
+
+TextureAtlas texture_atlases[TEXTURE_MAXATLASES];	//!< Atlases created so far
+int texture_natlases;					//!< Number of atlases created
+unsigned int texture_npacked;			//!< Number of textures packed into atlases
+
+TexturePbo texture_pbos[TEXTURE_NPBOS];	//!< Staging ring
+int texture_nextpbo;					//!< Next staging buffer to fill
+TextureUpload *texture_uploads;			//!< Textures streaming, oldest first
+int texture_nuploads;					//!< Number of textures streaming
+int texture_maxuploads;					//!< Number of uploads allocated
+Value texture_uploading;				//!< List of the textures streaming (keeping them from being collected)
+int *texture_freeslots;					//!< Stack of unused indices in texture_uploading
+int texture_nfreeslots;					//!< Number of unused indices
+int texture_nslots;						//!< Number of indices ever used
 
 /** Create a new texture */
 int texture_new(Value th) {
@@ -14,16 +130,81 @@ int texture_new(Value th) {
 	return 1;
 }
 
-/** Get a new unused texture unit */
-int texture_newUnit(Value th) {
-	int texidx = getTop(th);
-	pushGloVar(th, "Texture");
-	Value nTex = pushProperty(th, texidx, "_nTextures");
-	pushValue(th, anInt(1+toAint(nTex)));
-	popProperty(th, texidx, "_nTextures");
+/** Begin binding a new draw's textures. Units bound for earlier draws may now be reused. */
+void texture_newdraw(void) {
+	texture_draw++;
+}
+
+/** Bind a texture object to a unit for the current draw, returning the unit's number.
+	It keeps the unit it is already bound to, if any. Otherwise it takes an unbound unit or
+	else the least recently used one, but never one another texture in this draw holds.
+	Returns the staging unit (no texture) if this draw already holds every unit. */
+static int texture_bindunit(GLuint name, GLenum mapping) {
+	if (texture_nunits == 0) {
+		GLint maxunits;
+		glGetIntegerv(GL_MAX_COMBINED_TEXTURE_IMAGE_UNITS, &maxunits);
+		texture_nunits = maxunits < TEXTURE_MAXUNITS? maxunits : TEXTURE_MAXUNITS;
+	}
+	int lru = TEXTURE_STAGINGUNIT;
+	for (int unit=TEXTURE_STAGINGUNIT+1; unit<texture_nunits; unit++) {
+		TextureUnit *u = &texture_units[unit];
+		if (u->name == name && u->mapping == mapping) {
+			u->used = texture_draw;
+			return unit;
+		}
+		if (u->used != texture_draw && (lru == TEXTURE_STAGINGUNIT || u->used < texture_units[lru].used))
+			lru = unit;
+	}
+	if (lru == TEXTURE_STAGINGUNIT) {
+		vmLog("A draw uses more textures than there are texture units (%d)", texture_nunits - 1);
+		return TEXTURE_STAGINGUNIT;
+	}
+
+	TextureUnit *u = &texture_units[lru];
+	glsActiveTexture(GL_TEXTURE0 + lru);
+	if (u->name) {
+		texture_nevictions++;
+		if (u->mapping != mapping)
+			glsBindTexture(u->mapping, 0);
+	}
+	glsBindTexture(mapping, name);
+	u->name = name;
+	u->mapping = mapping;
+	u->used = texture_draw;
+	return lru;
+}
+
+/** Delete a texture object that is no longer referenced, dropping it from the binding table */
+int texture_close(Value texobj) {
+	TextureObj *obj = toTextureObj(texobj);
+	if (obj->packed)
+		return 1; // its atlas lives on, shared by others
+	for (int unit=TEXTURE_STAGINGUNIT+1; unit<texture_nunits; unit++) {
+		if (texture_units[unit].name == obj->name) {
+			texture_units[unit].name = 0;
+			texture_units[unit].used = 0;
+		}
+	}
+	glsDeleteTextures(1, &obj->name);
 	return 1;
 }
 
+/** Return two values: the number of texture units the binding table manages,
+	and how many times a unit has been taken from one texture for another */
+int texture_unitstats(Value th) {
+	pushValue(th, anInt(texture_nunits>0? texture_nunits - 1 : 0));
+	pushValue(th, anInt(texture_nevictions));
+	return 2;
+}
+
+/** Return two values: the number of atlases small textures are packed into,
+	and the number of textures packed into them */
+int texture_atlasstats(Value th) {
+	pushValue(th, anInt(texture_natlases));
+	pushValue(th, anInt(texture_npacked));
+	return 2;
+}
+
 const char *texture_cubepropnm[6] = {
 	"imagePosX", "imageNegX", "imagePosY", "imageNegY", "imagePosZ", "imageNegZ"
 };
@@ -34,45 +215,245 @@ GLuint texture_cubetarget[6] = {
 	GL_TEXTURE_CUBE_MAP_POSITIVE_Z, GL_TEXTURE_CUBE_MAP_NEGATIVE_Z,
 };
 
-/** Render a texture from a shader's uniform */
-int texture_render(Value th) {
+/** Which mapping (GL_TEXTURE_2D or GL_TEXTURE_CUBE_MAP) does the texture want? */
+static GLenum texture_mapping(Value th) {
+	Value mappingv = pushProperty(th, 0, "mapping"); popValue(th);
+	if (isSym(mappingv) && 0==strcmp(toStr(mappingv), "CubeMap"))
+		return GL_TEXTURE_CUBE_MAP;
+	return GL_TEXTURE_2D;
+}
 
-	// Return unit number if we have it
-	Value texunit = pushProperty(th, 0, "_texUnit");
-	if (texunit != aNull)
-		return 1;
+/** Are all the images the texture uses decoded and ready to load? */
+static bool texture_ready(Value th) {
+	bool cube = texture_mapping(th) == GL_TEXTURE_CUBE_MAP;
+	for (int i=0; i<(cube? 6 : 1); i++) {
+		Value image = pushProperty(th, 0, cube? texture_cubepropnm[i] : "image"); popValue(th);
+		if (!isCDataType(image, ImageValue) || toImageHeader(image)->decoding || toImageHeader(image)->x == 0)
+			return false;
+	}
+	return true;
+}
+
+/** Give the texture its "_texName", holding the texture object it samples
+	(its name also identifies texture when sorting draws) */
+static TextureObj *texture_newobj(Value th, GLuint tex, GLenum mapping) {
+	Value texobjtype = pushProperty(th, 0, "_texnametype");
+	Value texobj = strHasFinalizer(pushCData(th, texobjtype, TextureValue, 0, sizeof(TextureObj)));
+	TextureObj *obj = toTextureObj(texobj);
+	obj->name = tex;
+	obj->mapping = mapping;
+	obj->loaded = false;
+	obj->packed = false;
+	obj->rect[0] = obj->rect[1] = 0.0f;
+	obj->rect[2] = obj->rect[3] = 1.0f;
+	popProperty(th, 0, "_texName");
 	popValue(th);
+	return obj;
+}
+
+/** Queue the texture's images for streaming into a texture object, keeping the texture alive until they are in */
+static void texture_queue(Value th, GLuint tex, GLenum mapping, int nlevels, bool mipmap, int x, int y) {
+	if (texture_nuploads >= texture_maxuploads) {
+		texture_maxuploads = texture_maxuploads? 2*texture_maxuploads : 16;
+		texture_uploads = (TextureUpload *) realloc(texture_uploads, texture_maxuploads*sizeof(TextureUpload));
+		texture_freeslots = (int *) realloc(texture_freeslots, texture_maxuploads*sizeof(int));
+	}
+	TextureUpload *up = &texture_uploads[texture_nuploads++];
+	up->tex = tex;
+	up->mapping = mapping;
+	up->nfaces = mapping==GL_TEXTURE_CUBE_MAP? 6 : 1;
+	up->face = 0;
+	up->level = 0;
+	up->nlevels = nlevels;
+	up->row = 0;
+	up->x = x;
+	up->y = y;
+	up->mipmap = mipmap;
+	up->slot = texture_nfreeslots>0? texture_freeslots[--texture_nfreeslots] : texture_nslots++;
+	arrSet(th, texture_uploading, up->slot, getLocal(th, 0));
+}
+
+/** Find where on an atlas's skyline a w by h region would rest lowest.
+	Returns the index of the segment at its left end (-1 if it does not fit), and its position. */
+static int texture_skylinefit(TextureAtlas *atlas, int w, int h, int *x, int *y) {
+	int best = -1, besty = TEXTURE_ATLASSIZE, bestw = 0;
+	for (int i=0; i<atlas->nskyline; i++) {
+		TextureSkyline *seg = &atlas->skyline[i];
+		if (seg->x + w > TEXTURE_ATLASSIZE)
+			break;
+		// It rests on the highest segment it spans
+		int top = 0;
+		for (int j=i, spanned=0; spanned<w; spanned += atlas->skyline[j++].w)
+			if (atlas->skyline[j].y > top)
+				top = atlas->skyline[j].y;
+		if (top + h <= TEXTURE_ATLASSIZE && (top < besty || (top == besty && seg->w < bestw))) {
+			best = i;
+			besty = top;
+			bestw = seg->w;
+		}
+	}
+	if (best >= 0) {
+		*x = atlas->skyline[best].x;
+		*y = besty;
+	}
+	return best;
+}
 
-	// Obtain new unit number, which we will return
-	pushSym(th, "_NewUnit");
-	pushLocal(th, 0);
-	getCall(th, 1, 1);
-	Value newunit = getFromTop(th, 0);
-	pushValue(th, newunit);
-	popProperty(th, 0, "_texUnit"); // save it for next use
-	glActiveTexture(GL_TEXTURE0 + toAint(newunit));
-
-	// What sort of mapping is desired?
-	GLuint mapping = GL_TEXTURE_2D;
-	Value mappingv  = pushProperty(th, 0, "mapping");
-	if (isSym(mappingv)) {
-		if (0==strcmp(toStr(mappingv), "CubeMap"))
-			mapping = GL_TEXTURE_CUBE_MAP;
+/** Raise an atlas's skyline over a w by h region placed at segment i (at height y) */
+static void texture_skylineadd(TextureAtlas *atlas, int i, int w, int h, int y) {
+	TextureSkyline *sky = atlas->skyline;
+	memmove(&sky[i+1], &sky[i], (atlas->nskyline - i)*sizeof(TextureSkyline));
+	atlas->nskyline++;
+	sky[i].y = y + h;
+	sky[i].w = w;
+
+	// Trim or drop the segments now beneath it
+	int end = sky[i].x + w;
+	while (i+1 < atlas->nskyline && sky[i+1].x < end) {
+		int overlap = end - sky[i+1].x;
+		if (overlap < sky[i+1].w) {
+			sky[i+1].x += overlap;
+			sky[i+1].w -= overlap;
+			break;
+		}
+		memmove(&sky[i+1], &sky[i+2], (atlas->nskyline - i - 2)*sizeof(TextureSkyline));
+		atlas->nskyline--;
 	}
+
+	// Merge neighboring segments of the same height
+	for (int j=0; j+1 < atlas->nskyline; ) {
+		if (sky[j].y == sky[j+1].y) {
+			sky[j].w += sky[j+1].w;
+			memmove(&sky[j+1], &sky[j+2], (atlas->nskyline - j - 2)*sizeof(TextureSkyline));
+			atlas->nskyline--;
+		}
+		else
+			j++;
+	}
+}
+
+/** Create a new, blank atlas (on the staging unit). Returns NULL if no more may be created. */
+static TextureAtlas *texture_newatlas(void) {
+	if (texture_natlases >= TEXTURE_MAXATLASES)
+		return NULL;
+	TextureAtlas *atlas = &texture_atlases[texture_natlases++];
+	glGenTextures(1, &atlas->name);
+	glsActiveTexture(GL_TEXTURE0 + TEXTURE_STAGINGUNIT);
+	glsBindTexture(GL_TEXTURE_2D, atlas->name);
+	void *blank = calloc(TEXTURE_ATLASSIZE * TEXTURE_ATLASSIZE, 4);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, TEXTURE_ATLASSIZE, TEXTURE_ATLASSIZE, 0, GL_RGBA, GL_UNSIGNED_BYTE, blank);
+	free(blank);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, TEXTURE_ATLASLEVELS);
+	glGenerateMipmap(GL_TEXTURE_2D);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_LINEAR);
+	glsBindTexture(GL_TEXTURE_2D, 0);
+	atlas->nskyline = 1;
+	atlas->skyline[0].x = 0;
+	atlas->skyline[0].y = 0;
+	atlas->skyline[0].w = TEXTURE_ATLASSIZE;
+	return atlas;
+}
+
+/** Pack a small 2D texture's image into an atlas, queuing it to stream into its region.
+	Returns false (having done nothing) if the texture does not qualify or no atlas has room. */
+static bool texture_pack(Value th) {
+	if (texture_mapping(th) != GL_TEXTURE_2D)
+		return false;
+	pushGloVar(th, "Texture");
+	Value packv = pushProperty(th, getTop(th) - 1, "packSmall");
+	popValue(th);
 	popValue(th);
+	if (packv == aFalse)
+		return false;
+
+	// Wrapping and filtering can only be as the atlas does it
+	const char *unpackable[] = {"wrapS", "wrapT", "magFilter", "minFilter", "_unpacked"};
+	for (int i=0; i<5; i++) {
+		Value propv = pushProperty(th, 0, unpackable[i]); popValue(th);
+		if (propv != aNull)
+			return false;
+	}
+	Value image = pushProperty(th, 0, "image"); popValue(th);
+	ImageHeader *imghdr = toImageHeader(image);
+	if (imghdr->compressed || imghdr->x > TEXTURE_PACKMAX || imghdr->y > TEXTURE_PACKMAX)
+		return false;
+
+	// Find room for it, bordered and aligned, in an atlas (a new one if none has any)
+	int w = TEXTURE_ATLASCELL(imghdr->x);
+	int h = TEXTURE_ATLASCELL(imghdr->y);
+	TextureAtlas *atlas = NULL;
+	int seg = -1, x, y;
+	for (int i=0; i<texture_natlases && seg<0; i++) {
+		atlas = &texture_atlases[i];
+		if (atlas->nskyline < TEXTURE_MAXSKYLINE)
+			seg = texture_skylinefit(atlas, w, h, &x, &y);
+	}
+	if (seg < 0) {
+		if ((atlas = texture_newatlas()) == NULL)
+			return false;
+		seg = texture_skylinefit(atlas, w, h, &x, &y);
+	}
+	texture_skylineadd(atlas, seg, w, h, y);
+	x += TEXTURE_ATLASPAD;
+	y += TEXTURE_ATLASPAD;
+
+	// Texture coordinates 0 and 1 map to the centers of its edge texels, so it clamps as if on its own
+	TextureObj *obj = texture_newobj(th, atlas->name, GL_TEXTURE_2D);
+	obj->packed = true;
+	obj->rect[0] = (x + 0.5f) / TEXTURE_ATLASSIZE;
+	obj->rect[1] = (y + 0.5f) / TEXTURE_ATLASSIZE;
+	obj->rect[2] = (imghdr->x - 1.0f) / TEXTURE_ATLASSIZE;
+	obj->rect[3] = (imghdr->y - 1.0f) / TEXTURE_ATLASSIZE;
+	texture_npacked++;
 
-	// Create texture
+	// The atlas's mipmaps are regenerated once its image and border are in
+	texture_queue(th, atlas->name, GL_TEXTURE_2D, 1, true, x, y);
+	return true;
+}
+
+/** Create the texture's OpenGL texture object, setting its sampling parameters and
+	allocating storage for its images, then queue the images to be streamed into it */
+static void texture_create(Value th) {
+	GLenum mapping = texture_mapping(th);
+
+	// Create texture on the staging unit, so no texture's unit binding is disturbed
 	GLuint tex;
 	glGenTextures(1, &tex);
-	glBindTexture(mapping, tex);
+	glsActiveTexture(GL_TEXTURE0 + TEXTURE_STAGINGUNIT);
+	glsBindTexture(mapping, tex);
+	texture_newobj(th, tex, mapping);
+	bool mipmap = false;
+	int nlevels = 1;
 
-	// Copy image data into buffer
+	// Allocate storage for image data, to be filled in as it streams in
 	if (mapping == GL_TEXTURE_2D) {
+		// Mipmaps are generated once the image has streamed in, unless it brings its own
+		Value mipmapv = pushProperty(th, 0, "mipmap");
+		mipmap = mipmapv != aFalse;
+		popValue(th);
+
 		// Only need a single image
 		Value image = pushProperty(th, 0, "image");
 		ImageHeader *imghdr = toImageHeader(image);
-		int format = imghdr->nbytes>3? GL_RGBA : GL_RGB;
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, imghdr->x, imghdr->y, 0, format, GL_UNSIGNED_BYTE, toCData(image));
+		if (imghdr->compressed) {
+			nlevels = mipmap? imghdr->levels : 1;
+			int w = imghdr->x, h = imghdr->y;
+			for (int level=0; level<nlevels; level++) {
+				glCompressedTexImage2D(GL_TEXTURE_2D, level, imghdr->compressed, w, h, 0,
+					texcomp_levelsize(w, h, imghdr->compressed), NULL);
+				w = w>1? w/2 : 1;
+				h = h>1? h/2 : 1;
+			}
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, nlevels - 1);
+			mipmap = false;
+		}
+		else {
+			int format = imghdr->nbytes>3? GL_RGBA : GL_RGB;
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, imghdr->x, imghdr->y, 0, format, GL_UNSIGNED_BYTE, NULL);
+		}
 		popValue(th);
 
 		// Edge value sampling
@@ -95,11 +476,6 @@ int texture_render(Value th) {
 		popValue(th);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wraps);
 
-		Value mipmap = pushProperty(th, 0, "mipmap");
-		if (mipmap != aFalse)
-			glGenerateMipmap(GL_TEXTURE_2D);
-		popValue(th);
-
 		// Filter properties
 		int filter = GL_LINEAR;
 		Value filterv = pushProperty(th, 0, "magFilter");
@@ -124,12 +500,17 @@ int texture_render(Value th) {
 
 
 	} else {
-		// Get an image for each side of cube
+		// Get an image for each side of cube (only level 0 of compressed ones, as it is not mipmapped)
 		for (int i=0; i<6; i++) {
 			Value image = pushProperty(th, 0, texture_cubepropnm[i]);
 			ImageHeader *imghdr = toImageHeader(image);
-			int format = imghdr->nbytes>3? GL_RGBA : GL_RGB;
-			glTexImage2D(texture_cubetarget[i], 0, GL_RGB, imghdr->x, imghdr->y, 0, format, GL_UNSIGNED_BYTE, toCData(image));
+			if (imghdr->compressed)
+				glCompressedTexImage2D(texture_cubetarget[i], 0, imghdr->compressed, imghdr->x, imghdr->y, 0,
+					texcomp_levelsize(imghdr->x, imghdr->y, imghdr->compressed), NULL);
+			else {
+				int format = imghdr->nbytes>3? GL_RGBA : GL_RGB;
+				glTexImage2D(texture_cubetarget[i], 0, GL_RGB, imghdr->x, imghdr->y, 0, format, GL_UNSIGNED_BYTE, NULL);
+			}
 			popValue(th);
 		}
 		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
@@ -138,13 +519,217 @@ int texture_render(Value th) {
 		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 	}
+	glsBindTexture(mapping, 0);
+
+	texture_queue(th, tex, mapping, nlevels, mipmap, 0, 0);
+}
+
+/** Fill the border around a packed image on its atlas (bound) with copies of its edge texels,
+	out to the edges of its region, so that filtering and mipmapping near its edges take in
+	only its own colors */
+static void texture_border(TextureUpload *up, ImageHeader *imghdr, const char *src) {
+	int w = imghdr->x, h = imghdr->y, nbytes = imghdr->nbytes;
+	int format = nbytes>3? GL_RGBA : GL_RGB;
+	int pad = TEXTURE_ATLASPAD;
+	int cellw = TEXTURE_ATLASCELL(w), cellh = TEXTURE_ATLASCELL(h);
+	int padr = cellw - pad - w, padb = cellh - pad - h;	// right and bottom borders take up any alignment slack
+	long rowbytes = w * nbytes;
+	int maxpad = padr > padb? padr : padb;
+	char *band = (char *) malloc((cellw > h? cellw : h) * maxpad * nbytes);
+	glsBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	// Left and right: each row's end texel, repeated across the border
+	for (int side=0; side<2; side++) {
+		int bw = side? padr : pad;
+		char *to = band;
+		for (int row=0; row<h; row++) {
+			const char *edge = src + row*rowbytes + (side? rowbytes - nbytes : 0);
+			for (int i=0; i<bw; i++, to += nbytes)
+				memcpy(to, edge, nbytes);
+		}
+		glTexSubImage2D(GL_TEXTURE_2D, 0, side? up->x + w : up->x - pad, up->y, bw, h, format, GL_UNSIGNED_BYTE, band);
+	}
+
+	// Top and bottom: the first or last row, with its corners, repeated down the border
+	for (int side=0; side<2; side++) {
+		int bh = side? padb : pad;
+		const char *edge = src + (side? h-1 : 0)*rowbytes;
+		char *to = band;
+		for (int i=0; i<pad; i++, to += nbytes)
+			memcpy(to, edge, nbytes);
+		memcpy(to, edge, rowbytes);
+		to += rowbytes;
+		for (int i=0; i<padr; i++, to += nbytes)
+			memcpy(to, edge + rowbytes - nbytes, nbytes);
+		for (int i=1; i<bh; i++)
+			memcpy(band + i*cellw*nbytes, band, cellw*nbytes);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, up->x - pad, side? up->y + h : up->y - pad, cellw, bh, format, GL_UNSIGNED_BYTE, band);
+	}
+	free(band);
+}
+
+/** Stream queued texture images to OpenGL, through a ring of pixel buffer objects,
+	until this frame's upload budget (Texture.uploadBudget bytes) is spent.
+	Called once per frame, before anything is drawn. */
+void texture_stream(Value th) {
+	if (texture_nuploads == 0)
+		return;
+	pushGloVar(th, "Texture");
+	Value budgetv = pushProperty(th, getTop(th) - 1, "uploadBudget");
+	long budget = isInt(budgetv)? toAint(budgetv) : TEXTURE_BUDGET;
+	popValue(th);
+	popValue(th);
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1); // image rows are tightly packed
+	glsActiveTexture(GL_TEXTURE0 + TEXTURE_STAGINGUNIT);
+	while (texture_nuploads > 0 && budget > 0) {
+		TextureUpload *up = &texture_uploads[0];
+
+		// The next staging buffer can only be refilled once OpenGL has finished reading it
+		TexturePbo *pbo = &texture_pbos[texture_nextpbo];
+		if (pbo->fence) {
+			if (glClientWaitSync(pbo->fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+				break;
+			glDeleteSync(pbo->fence);
+			pbo->fence = 0;
+		}
+		if (pbo->buffer == 0) {
+			glGenBuffers(1, &pbo->buffer);
+			glsBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo->buffer);
+			glBufferData(GL_PIXEL_UNPACK_BUFFER, TEXTURE_PBOSIZE, NULL, GL_STREAM_DRAW);
+		}
+		else
+			glsBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo->buffer);
+
+		// Find the level's rows: of pixels, or of 4x4 blocks if compressed
+		pushValue(th, arrGet(th, texture_uploading, up->slot));
+		Value image = pushProperty(th, getTop(th) - 1, up->nfaces>1? texture_cubepropnm[up->face] : "image");
+		ImageHeader *imghdr = toImageHeader(image);
+		int w = imghdr->x >> up->level, h = imghdr->y >> up->level;
+		if (w < 1) w = 1;
+		if (h < 1) h = 1;
+		char *src = (char*) toCData(image);
+		long rowbytes, levelrows;
+		if (imghdr->compressed) {
+			src += texcomp_leveloffset(imghdr->x, imghdr->y, imghdr->compressed, up->level);
+			rowbytes = texcomp_levelsize(w, 4, imghdr->compressed);
+			levelrows = (h+3) / 4;
+		}
+		else {
+			rowbytes = w * imghdr->nbytes;
+			levelrows = h;
+		}
+
+		// Copy as many of those rows into it as fit (and the budget allows)
+		long nrows = TEXTURE_PBOSIZE / rowbytes;
+		if (nrows > budget / rowbytes)
+			nrows = budget>rowbytes? budget / rowbytes : 1;
+		if (nrows > levelrows - up->row)
+			nrows = levelrows - up->row;
+		void *staging = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, nrows*rowbytes,
+			GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+		memcpy(staging, src + up->row*rowbytes, nrows*rowbytes);
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+
+		// Have OpenGL copy them from the buffer into the texture, fencing the buffer until it has
+		glsBindTexture(up->mapping, up->tex);
+		GLenum target = up->nfaces>1? texture_cubetarget[up->face] : GL_TEXTURE_2D;
+		if (imghdr->compressed) {
+			int y = up->row * 4;
+			int ny = y + nrows*4 > h? h - y : nrows*4;
+			glCompressedTexSubImage2D(target, up->level, 0, y, w, ny, imghdr->compressed, nrows*rowbytes, (void*)0);
+		}
+		else {
+			int format = imghdr->nbytes>3? GL_RGBA : GL_RGB;
+			glTexSubImage2D(target, 0, up->x, up->y + up->row, w, nrows, format, GL_UNSIGNED_BYTE, (void*)0);
+		}
+		pbo->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		texture_nextpbo = (texture_nextpbo + 1) % TEXTURE_NPBOS;
+		budget -= nrows*rowbytes;
+
+		// On to the next rows, level, face or texture
+		up->row += nrows;
+		if (up->row >= levelrows) {
+			up->row = 0;
+			if (++up->level >= up->nlevels) {
+				up->level = 0;
+				up->face++;
+			}
+			if (up->face >= up->nfaces) {
+				if (up->x > 0)
+					texture_border(up, imghdr, src);
+				if (up->mipmap)
+					glGenerateMipmap(up->mapping);
+				Value texobj = getProperty(th, getFromTop(th, 1), pegsym._texName);
+				if (isCDataType(texobj, TextureValue) && toTextureObj(texobj)->name == up->tex)
+					toTextureObj(texobj)->loaded = true; // (unless unpacked from its atlas meanwhile)
+				arrSet(th, texture_uploading, up->slot, aNull);
+				texture_freeslots[texture_nfreeslots++] = up->slot;
+				memmove(&texture_uploads[0], &texture_uploads[1], (--texture_nuploads)*sizeof(TextureUpload));
+			}
+		}
+		popValue(th); // image
+		popValue(th); // texture
+	}
+
+	// Leave the staging unit empty, and client memory as the source for any other pixel transfers
+	glsBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	glsBindTexture(GL_TEXTURE_2D, 0);
+	glsBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+}
+
+/** Bind the placeholder for a texture of the mapping not yet loaded, returning its unit.
+	The placeholder is a single black texel, as an unbound unit samples. */
+static int texture_bindplaceholder(GLenum mapping) {
+	int cube = mapping==GL_TEXTURE_CUBE_MAP;
+	if (texture_placeholders[cube] == 0) {
+		static const GLubyte black[4] = {0, 0, 0, 255};
+		glGenTextures(1, &texture_placeholders[cube]);
+		glsActiveTexture(GL_TEXTURE0 + TEXTURE_STAGINGUNIT);
+		glsBindTexture(mapping, texture_placeholders[cube]);
+		for (int i=0; i<(cube? 6 : 1); i++)
+			glTexImage2D(cube? texture_cubetarget[i] : GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, black);
+		glTexParameteri(mapping, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(mapping, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glsBindTexture(mapping, 0);
+	}
+	return texture_bindunit(texture_placeholders[cube], mapping);
+}
 
+/** Render a texture from a shader's uniform, binding it to a unit for the current draw
+	and returning the unit's number. Parameter 2 is true if the shader maps texture
+	coordinates into its region (so it may be packed into an atlas). */
+int texture_render(Value th) {
+	bool packable = getTop(th) > 2 && getLocal(th, 2) == aTrue;
+
+	// Until its images are decoded and streamed in, the texture draws with the placeholder
+	Value texobj = getProperty(th, getLocal(th, 0), pegsym._texName);
+	if (texobj == aNull) {
+		GLenum mapping = texture_mapping(th);
+		if (texture_ready(th) && !(packable && texture_pack(th)))
+			texture_create(th);
+		pushValue(th, anInt(texture_bindplaceholder(mapping)));
+		return 1;
+	}
+	TextureObj *obj = toTextureObj(texobj);
+
+	// A shader that cannot find its region in an atlas needs it as a texture of its own
+	if (obj->packed && !packable) {
+		pushValue(th, aTrue);
+		popProperty(th, 0, "_unpacked");
+		pushValue(th, aNull);
+		popProperty(th, 0, "_texName");
+		pushValue(th, anInt(texture_bindplaceholder(GL_TEXTURE_2D)));
+		return 1;
+	}
+	pushValue(th, anInt(obj->loaded? texture_bindunit(obj->name, obj->mapping) : texture_bindplaceholder(obj->mapping)));
 	return 1;
 }
 
 /** Initialize Texture type */
 void texture_init(Value th) {
-	Value Image = pushType(th, aNull, 2);
+	Value Texture = pushType(th, aNull, 12);
 		pushSym(th, "Texture");
 		popProperty(th, 0, "_name");
 		pushCMethod(th, texture_new);
@@ -153,9 +738,21 @@ void texture_init(Value th) {
 		popProperty(th, 0, "name");
 		pushCMethod(th, texture_render);
 		popProperty(th, 0, "_Render");
-		pushValue(th, anInt(0));
-		popProperty(th, 0, "_nTextures");
-		pushCMethod(th, texture_newUnit);
-		popProperty(th, 0, "_NewUnit");
+		pushCMethod(th, texture_unitstats);
+		popProperty(th, 0, "UnitStats");
+		pushCMethod(th, texture_atlasstats);
+		popProperty(th, 0, "AtlasStats");
+		pushValue(th, aTrue);
+		popProperty(th, 0, "packSmall");
+		pushValue(th, anInt(TEXTURE_BUDGET));
+		popProperty(th, 0, "uploadBudget");
+		texture_uploading = pushArray(th, aNull, 16);
+		popProperty(th, 0, "_uploading");
+		Value texobjmixin = pushMixin(th, aNull, aNull, 4);
+			pushSym(th, "*Texture");
+			popProperty(th, 1, "_name");
+			pushCMethod(th, texture_close);
+			popProperty(th, 1, "_finalizer");
+		popProperty(th, 0, "_texnametype");
 	popGloVar(th, "Texture");
 }
\ No newline at end of file
@@ -0,0 +1,221 @@
+/** Transform table: every placed scene node's world matrix, kept up to date incrementally
+ * @file
+ *
+ * Each scene node with a placement (origin, orientation, scale) is given a slot in a
+ * flat table, held as parallel arrays: its parent's slot, a copy of the local placement
+ * its world matrix was last calculated from, and that world matrix. As the camera
+ * traverses the scene, each node's current placement is compared against its copy.
+ * Only a node whose placement changed, or whose parent's world matrix changed, has its
+ * world matrix recalculated and written back to its "mmatrix" property. Static scenery
+ * thus never redoes its matrix math.
+ *
+ * A node's slot is remembered in its "_xform" property. Slots a node no longer visits
+ * (e.g., because it was removed from the scene) are reclaimed when the table fills.
+ * A static group replaying its draw list already knows each node's slot, and passes it
+ * in, so an unmoved node costs only the lookups of its origin, orientation and scale.
+ *
+ * A node whose CalcMatrix is its own (not Placement's) calculates its "mmatrix" itself.
+ * Its slot then just adopts that matrix, so its parts still know when it has moved.
+ *
+ * This source file is part of the Pegasus3d browser.
+ * See Copyright Notice in pegasus3d.h
+*/
+
+#include "pegasus3d.h"
+#include "xyzmath.h"
+#include "transform.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define XF_ORIGIN 0x01		//!< Node has an origin
+#define XF_ORIENT 0x02		//!< Node has an orientation
+#define XF_SCALE 0x04		//!< Node has a scale
+#define XF_ADOPTED 0x40		//!< Slot's world matrix was taken from a script's own CalcMatrix
+#define XF_UNSET 0x80		//!< Slot's world matrix has never been calculated
+
+int transform_current = -1;
+
+Value *transform_node;			//!< Node occupying each slot (aNull if free)
+int *transform_parent;			//!< Parent's slot (-1 if at the root)
+unsigned char *transform_has;	//!< Which parts of the local placement the node has (XF_ flags)
+Xyz *transform_origin;			//!< Local origin last calculated from
+Quat *transform_orient;			//!< Local orientation last calculated from
+Xyz *transform_scale;			//!< Local scale last calculated from
+Mat4 *transform_world;			//!< World matrix
+unsigned int *transform_gen;	//!< Generation stamp, renewed whenever the world matrix changes
+unsigned int *transform_parentgen;	//!< Parent's generation stamp when the world matrix was calculated
+unsigned int *transform_frame;	//!< Frame the node was last visited
+int transform_n;				//!< Number of slots in use or freed
+int transform_max;				//!< Number of slots allocated
+int *transform_freed;			//!< Stack of reclaimed slots
+int transform_nfreed;			//!< Number of reclaimed slots
+
+unsigned int transform_generation;	//!< Source of generation stamps
+unsigned int transform_frames;		//!< Number of frames rendered
+
+/** Grow every array in the table to hold twice as many slots */
+static void transform_grow(void) {
+	transform_max = transform_max? 2*transform_max : 256;
+	transform_node = (Value *) realloc(transform_node, transform_max*sizeof(Value));
+	transform_parent = (int *) realloc(transform_parent, transform_max*sizeof(int));
+	transform_has = (unsigned char *) realloc(transform_has, transform_max*sizeof(unsigned char));
+	transform_origin = (Xyz *) realloc(transform_origin, transform_max*sizeof(Xyz));
+	transform_orient = (Quat *) realloc(transform_orient, transform_max*sizeof(Quat));
+	transform_scale = (Xyz *) realloc(transform_scale, transform_max*sizeof(Xyz));
+	transform_world = (Mat4 *) realloc(transform_world, transform_max*sizeof(Mat4));
+	transform_gen = (unsigned int *) realloc(transform_gen, transform_max*sizeof(unsigned int));
+	transform_parentgen = (unsigned int *) realloc(transform_parentgen, transform_max*sizeof(unsigned int));
+	transform_frame = (unsigned int *) realloc(transform_frame, transform_max*sizeof(unsigned int));
+	transform_freed = (int *) realloc(transform_freed, transform_max*sizeof(int));
+}
+
+/** Reclaim the slots of nodes not visited during the last full frame */
+static void transform_sweep(void) {
+	for (int slot=0; slot<transform_n; slot++) {
+		if (transform_node[slot] != aNull && transform_frame[slot] + 1 < transform_frames) {
+			transform_node[slot] = aNull;
+			transform_freed[transform_nfreed++] = slot;
+		}
+	}
+}
+
+/** Give a node a slot, whose world matrix must be calculated on first use */
+static int transform_alloc(Value node) {
+	if (transform_nfreed == 0 && transform_n >= transform_max)
+		transform_sweep();
+	int slot;
+	if (transform_nfreed > 0)
+		slot = transform_freed[--transform_nfreed];
+	else {
+		if (transform_n >= transform_max)
+			transform_grow();
+		slot = transform_n++;
+	}
+	transform_node[slot] = node;
+	transform_parent[slot] = -1;
+	transform_has[slot] = XF_UNSET;
+	transform_gen[slot] = 0;
+	transform_parentgen[slot] = 0;
+	return slot;
+}
+
+/** Start a traversal of the scene from its root */
+void transform_begin(void) {
+	transform_current = -1;
+}
+
+/** Find a node's slot, giving it one if it has none (or only its prototype's).
+	The slot it is believed to have may be passed (-1 if not known), saving a lookup. */
+static int transform_slot(Value th, int nodeidx, int slot) {
+	Value node = getLocal(th, nodeidx);
+	if (slot < 0 || slot >= transform_n || transform_node[slot] != node) {
+		Value slotv = getProperty(th, node, pegsym._xform);
+		slot = isInt(slotv)? toAint(slotv) : -1;
+	}
+	if (slot < 0 || slot >= transform_n || transform_node[slot] != node) {
+		slot = transform_alloc(node);
+		pushValue(th, anInt(slot));
+		popProperty(th, nodeidx, "_xform");
+	}
+	transform_frame[slot] = transform_frames;
+	return slot;
+}
+
+/** Get a node's "mmatrix", creating it if not found */
+static Mat4 *transform_mmatrix(Value th, int nodeidx) {
+	Value mmatv = getProperty(th, getLocal(th, nodeidx), pegsym.mmatrix);
+	if (!isMat4(mmatv)) {
+		pushValue(th, pegsym.New);
+		pushGloVar(th, "Matrix4");
+		getCall(th, 1, 1);
+		mmatv = getFromTop(th, 0);
+		popProperty(th, nodeidx, "mmatrix");
+	}
+	return toMat4(mmatv);
+}
+
+/** Bring a node's world matrix (and its "mmatrix" property) up to date,
+	relative to the world matrix in its parent's slot (-1 if none).
+	The node's slot may be passed, if known (else -1).
+	Returns the node's slot, for passing as the parent of its parts. */
+int transform_update(Value th, int nodeidx, int parent, int slot) {
+	Value node = getLocal(th, nodeidx);
+	slot = transform_slot(th, nodeidx, slot);
+	bool dirty = false;
+
+	// A different parent, or a recalculated one, means this node must be recalculated too
+	unsigned int parentgen = parent>=0? transform_gen[parent] : 0;
+	if (transform_parent[slot] != parent || transform_parentgen[slot] != parentgen)
+		dirty = true;
+
+	// Has the local placement changed since it was last calculated from?
+	Value originv = getProperty(th, node, pegsym.origin);
+	Value orientv = getProperty(th, node, pegsym.orientation);
+	Value scalev = getProperty(th, node, pegsym.scale);
+	unsigned char has = (isXyz(originv)? XF_ORIGIN : 0) | (isQuat(orientv)? XF_ORIENT : 0) | (isXyz(scalev)? XF_SCALE : 0);
+	if (has != transform_has[slot]
+		|| ((has & XF_ORIGIN) && memcmp(&transform_origin[slot], toXyz(originv), sizeof(Xyz)))
+		|| ((has & XF_ORIENT) && memcmp(&transform_orient[slot], toQuat(orientv), sizeof(Quat)))
+		|| ((has & XF_SCALE) && memcmp(&transform_scale[slot], toXyz(scalev), sizeof(Xyz))))
+		dirty = true;
+	if (!dirty)
+		return slot;
+
+	// Recalculate: world matrix = parent's world matrix * local placement matrix
+	if (has & XF_ORIGIN) transform_origin[slot] = *toXyz(originv);
+	if (has & XF_ORIENT) transform_orient[slot] = *toQuat(orientv);
+	if (has & XF_SCALE) transform_scale[slot] = *toXyz(scalev);
+	transform_has[slot] = has;
+	Mat4 selfmat;
+	mat4Place(&selfmat, (has & XF_ORIGIN)? &transform_origin[slot] : NULL,
+		(has & XF_ORIENT)? &transform_orient[slot] : NULL,
+		(has & XF_SCALE)? &transform_scale[slot] : NULL);
+	if (parent >= 0)
+		mat4Mult(&transform_world[slot], &transform_world[parent], &selfmat);
+	else
+		mat4Set(&transform_world[slot], &selfmat);
+	transform_parent[slot] = parent;
+	transform_parentgen[slot] = parentgen;
+	transform_gen[slot] = ++transform_generation;
+
+	// Write the new world matrix back for shaders and scripts
+	mat4Set(transform_mmatrix(th, nodeidx), &transform_world[slot]);
+	return slot;
+}
+
+/** Take a node's world matrix from its "mmatrix", as just calculated by its own CalcMatrix
+	(relative to the world matrix in its parent's slot, or -1 if none).
+	Returns the node's slot, for passing as the parent of its parts. */
+int transform_adopt(Value th, int nodeidx, int parent) {
+	int slot = transform_slot(th, nodeidx, -1);
+	Mat4 *mmat = transform_mmatrix(th, nodeidx);
+	unsigned int parentgen = parent>=0? transform_gen[parent] : 0;
+	if (transform_has[slot] == XF_ADOPTED && transform_parent[slot] == parent
+		&& transform_parentgen[slot] == parentgen && !memcmp(&transform_world[slot], mmat, sizeof(Mat4)))
+		return slot;
+	mat4Set(&transform_world[slot], mmat);
+	transform_has[slot] = XF_ADOPTED;
+	transform_parent[slot] = parent;
+	transform_parentgen[slot] = parentgen;
+	transform_gen[slot] = ++transform_generation;
+	return slot;
+}
+
+/** Return the generation stamp of a slot's world matrix, which changes whenever it is recalculated */
+unsigned int transform_stamp(int slot) {
+	return slot>=0? transform_gen[slot] : 0;
+}
+
+/** Return the slot of the placement a node is being prepared under:
+	its parent's, if the node has a slot of its own, else the current one */
+int transform_under(Value node) {
+	int slot = transform_current;
+	if (slot >= 0 && transform_node[slot] == node)
+		return transform_parent[slot];
+	return slot;
+}
+
+/** Close out a rendered frame, aging the slots of nodes not visited */
+void transform_frameend(void) {
+	transform_frames++;
+}
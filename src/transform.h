@@ -0,0 +1,21 @@
+/** Transform table: every placed scene node's world matrix, kept up to date incrementally
+ * @file
+ *
+ * This source file is part of the Pegasus3d browser.
+ * See Copyright Notice in pegasus3d.h
+*/
+
+#ifndef transform_h
+#define transform_h 1
+
+extern int transform_current;	//!< Slot of the node whose parts are being prepared (-1 at the root)
+extern Value placement_calcmeth;	//!< Placement's built-in CalcMatrix, which transform_update stands in for
+
+void transform_begin(void);
+int transform_update(Value th, int nodeidx, int parent, int slot);
+int transform_adopt(Value th, int nodeidx, int parent);
+unsigned int transform_stamp(int slot);
+int transform_under(Value node);
+void transform_frameend(void);
+
+#endif
@@ -6,6 +6,7 @@
 */
 
 #include "pegasus3d.h"
+#include "glstate.h"
 
 #include <stdio.h>
 
@@ -109,6 +110,8 @@ int window_setfullscreen(Value th) {
 /** Attach current OpenGL context to this window */
 int window_makecurrent(Value th) {
 	WindowInfo *wininfo = (struct WindowInfo*) toHeader(getLocal(th, 0));
+	if (SDL_GL_GetCurrentContext() != wininfo->sdlContext)
+		glsReset(); // Shadowed OpenGL state belongs to the old context
 	SDL_GL_MakeCurrent(wininfo->sdlWindow, wininfo->sdlContext);
 	if (getTop(th)>1 && isRect(getLocal(th, 1))) {
 		Rect *winrect = toRect(getLocal(th,1));
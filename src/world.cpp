@@ -7,6 +7,10 @@
 
 #include "pegasus3d.h"
 #include "xyzmath.h"
+#include "glstate.h"
+#include "transform.h"
+
+void texture_stream(Value th);
 
 /** Create a new world */
 int world_new(Value th) {
@@ -267,17 +271,20 @@ int world_render(Value th) {
 		popProperty(th, selfidx, "render");
 	}
 
+	// Stream this frame's share of texture images to OpenGL, before anything is drawn
+	texture_stream(th);
+
 	// Perform the rendering
 	if (isArr(renderv)) {
 		Aint sz = getSize(renderv);
 		for (Aint i=0; i<sz; i++) {
-			pushSym(th, "_Render");
+			pushValue(th, pegsym.Render);
 			pushValue(th, arrGet(th, renderv, i));
 			getCall(th, 1, 0);
 		}
 	}
 	else {
-		pushSym(th, "_Render");
+		pushValue(th, pegsym.Render);
 		pushValue(th, renderv);
 		getCall(th, 1, 0);
 	}
@@ -286,6 +293,11 @@ int world_render(Value th) {
 	pushSym(th, "SwapBuffers");
 	pushGloVar(th, "$window");
 	getCall(th, 1, 0);
+
+	// Close out this frame's OpenGL call counts, transform ages and symbol interning counts
+	glsFrameEnd();
+	transform_frameend();
+	pegsym_frameend();
 	return 0;
 }
 
@@ -67,13 +67,65 @@ void mat4SetPos(Mat4 *mat, Xyz *xyz) {
 	(*mat)[14]=xyz->z;
 }
 
+/* Matrix kernels use 4-wide SIMD when the target has it (selected at build time),
+   multiplying and adding in the same order as the scalar code, so results match it.
+   Define XYZMATH_SCALAR to force the scalar versions. */
+#if !defined(XYZMATH_SCALAR) && (defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP>=1))
+#include <xmmintrin.h>
+#define XYZMATH_SIMD 1
+typedef __m128 V4f;
+#define v4Load(p) _mm_loadu_ps(p)
+#define v4Store(p, v) _mm_storeu_ps((p), (v))
+#define v4Splat(f) _mm_set1_ps(f)
+#define v4Mul(a, b) _mm_mul_ps((a), (b))
+#define v4Add(a, b) _mm_add_ps((a), (b))
+#define v4Abs(a) _mm_andnot_ps(_mm_set1_ps(-0.0f), (a))
+#elif !defined(XYZMATH_SCALAR) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#include <arm_neon.h>
+#define XYZMATH_SIMD 1
+typedef float32x4_t V4f;
+#define v4Load(p) vld1q_f32(p)
+#define v4Store(p, v) vst1q_f32((p), (v))
+#define v4Splat(f) vdupq_n_f32(f)
+#define v4Mul(a, b) vmulq_f32((a), (b))
+#define v4Add(a, b) vaddq_f32((a), (b))
+#define v4Abs(a) vabsq_f32(a)
+#endif
+
+#ifdef XYZMATH_SIMD
+/** Multiply a matrix, whose columns are c0-c3, by matrix m2's columns. Put result in md.
+	All of m2 is read before md is written, so md may be m2. */
+#define mat4MultCols(md, c0, c1, c2, c3, m2) { \
+	V4f r[4]; \
+	for (int col=0; col<4; col++) \
+		r[col] = v4Add(v4Add(v4Add(v4Mul(c0, v4Splat((*(m2))[4*col])), v4Mul(c1, v4Splat((*(m2))[4*col+1]))), \
+			v4Mul(c2, v4Splat((*(m2))[4*col+2]))), v4Mul(c3, v4Splat((*(m2))[4*col+3]))); \
+	for (int col=0; col<4; col++) \
+		v4Store(&(*(md))[4*col], r[col]);}
+
+/** Multiply a matrix, whose columns are c0-c3, by a vector (whose w is presumed to be 1) */
+#define mat4MultColsVec(newxyz, c0, c1, c2, c3, xyz) { \
+	GLfloat r[4]; \
+	v4Store(r, v4Add(v4Add(v4Add(v4Mul(c0, v4Splat((xyz)->x)), v4Mul(c1, v4Splat((xyz)->y))), \
+		v4Mul(c2, v4Splat((xyz)->z))), c3)); \
+	(newxyz)->x = r[0]; (newxyz)->y = r[1]; (newxyz)->z = r[2];}
+#endif
+
 /** Multiply two matrices m1 and m2. Put result in md. */
 void mat4Mult(Mat4 *md, Mat4 *m1, Mat4 *m2) {
+#ifdef XYZMATH_SIMD
+	V4f c0 = v4Load(&(*m1)[0]), c1 = v4Load(&(*m1)[4]), c2 = v4Load(&(*m1)[8]), c3 = v4Load(&(*m1)[12]);
+	mat4MultCols(md, c0, c1, c2, c3, m2);
+#else
 	Mat4 tempmat;
 	if (md==m1) {
 		memcpy(tempmat, md, sizeof(Mat4));
 		m1 = &tempmat;
 	}
+	else if (md==m2) {
+		memcpy(tempmat, md, sizeof(Mat4));
+		m2 = &tempmat;
+	}
 	(*md)[0] = (*m1)[0]*(*m2)[0] + (*m1)[4]*(*m2)[1] + (*m1)[ 8]*(*m2)[2] + (*m1)[12]*(*m2)[3];
 	(*md)[1] = (*m1)[1]*(*m2)[0] + (*m1)[5]*(*m2)[1] + (*m1)[ 9]*(*m2)[2] + (*m1)[13]*(*m2)[3];
 	(*md)[2] = (*m1)[2]*(*m2)[0] + (*m1)[6]*(*m2)[1] + (*m1)[10]*(*m2)[2] + (*m1)[14]*(*m2)[3];
@@ -93,13 +145,38 @@ void mat4Mult(Mat4 *md, Mat4 *m1, Mat4 *m2) {
 	(*md)[13] = (*m1)[1]*(*m2)[12] + (*m1)[5]*(*m2)[13] + (*m1)[ 9]*(*m2)[14] + (*m1)[13]*(*m2)[15];
 	(*md)[14] = (*m1)[2]*(*m2)[12] + (*m1)[6]*(*m2)[13] + (*m1)[10]*(*m2)[14] + (*m1)[14]*(*m2)[15];
 	(*md)[15] = (*m1)[3]*(*m2)[12] + (*m1)[7]*(*m2)[13] + (*m1)[11]*(*m2)[14] + (*m1)[15]*(*m2)[15];
+#endif
 }
 
 /** Multiple a matrix by a vector (whose w is presumed to be 1) */
 void mat4MultVec(Xyz *newxyz, Mat4 *mat, Xyz *xyz) {
-	newxyz->x = (*mat)[0]*xyz->x + (*mat)[4]*xyz->y + (*mat)[8]*xyz->z + (*mat)[12];
-	newxyz->y = (*mat)[1]*xyz->x + (*mat)[5]*xyz->y + (*mat)[9]*xyz->z + (*mat)[13];
-	newxyz->z = (*mat)[2]*xyz->x + (*mat)[6]*xyz->y + (*mat)[10]*xyz->z + (*mat)[14];
+#ifdef XYZMATH_SIMD
+	V4f c0 = v4Load(&(*mat)[0]), c1 = v4Load(&(*mat)[4]), c2 = v4Load(&(*mat)[8]), c3 = v4Load(&(*mat)[12]);
+	mat4MultColsVec(newxyz, c0, c1, c2, c3, xyz);
+#else
+	Xyz v = *xyz;
+	newxyz->x = (*mat)[0]*v.x + (*mat)[4]*v.y + (*mat)[8]*v.z + (*mat)[12];
+	newxyz->y = (*mat)[1]*v.x + (*mat)[5]*v.y + (*mat)[9]*v.z + (*mat)[13];
+	newxyz->z = (*mat)[2]*v.x + (*mat)[6]*v.y + (*mat)[10]*v.z + (*mat)[14];
+#endif
+}
+
+/** Transform an axis-aligned box (center and half-size extent) by a matrix,
+	giving the axis-aligned box that encloses the result */
+void mat4MultBox(Xyz *newcenter, Xyz *newextent, Mat4 *mat, Xyz *center, Xyz *extent) {
+	Xyz ext = *extent;
+#ifdef XYZMATH_SIMD
+	V4f c0 = v4Load(&(*mat)[0]), c1 = v4Load(&(*mat)[4]), c2 = v4Load(&(*mat)[8]), c3 = v4Load(&(*mat)[12]);
+	mat4MultColsVec(newcenter, c0, c1, c2, c3, center);
+	GLfloat r[4];
+	v4Store(r, v4Add(v4Add(v4Mul(v4Abs(c0), v4Splat(ext.x)), v4Mul(v4Abs(c1), v4Splat(ext.y))), v4Mul(v4Abs(c2), v4Splat(ext.z))));
+	newextent->x = r[0]; newextent->y = r[1]; newextent->z = r[2];
+#else
+	mat4MultVec(newcenter, mat, center);
+	newextent->x = fabs((*mat)[0])*ext.x + fabs((*mat)[4])*ext.y + fabs((*mat)[8])*ext.z;
+	newextent->y = fabs((*mat)[1])*ext.x + fabs((*mat)[5])*ext.y + fabs((*mat)[9])*ext.z;
+	newextent->z = fabs((*mat)[2])*ext.x + fabs((*mat)[6])*ext.y + fabs((*mat)[10])*ext.z;
+#endif
 }
 
 /** Perspective Frustum matrix */
@@ -76,6 +76,7 @@ void mat4Set(Mat4 *tomat, Mat4 *frommat);
 void mat4SetPos(Mat4 *mat, Xyz *xyz);
 void mat4Mult(Mat4 *md, Mat4 *m1, Mat4 *m2);
 void mat4MultVec(Xyz *newxyz, Mat4 *mat, Xyz *xyz);
+void mat4MultBox(Xyz *newcenter, Xyz *newextent, Mat4 *mat, Xyz *center, Xyz *extent);
 void mat4Perspective(Mat4 *mat, GLfloat fov, GLfloat near, GLfloat far, GLfloat aspratio);
 void mat4HeightPerspective(Mat4 *mat, GLfloat height, GLfloat near, GLfloat far, GLfloat aspratio);
 void mat4Ortho(Mat4 *mat, GLfloat height, GLfloat near, GLfloat far, GLfloat aspratio);